@@ -0,0 +1,31 @@
+#!/usr/bin/env python
+#
+# Read the firmware's main loop performance counters over USB.
+# Only available in firmware built with "make OPTIONS=-DFC_PERF".
+#
+# Pass "-r" to reset the counters after reading them.
+#
+# This example code is released into the public domain.
+#
+
+import usb.core
+import struct
+import sys
+
+FC_PERF_REQUEST = 0x01
+SECTIONS = ['handleUSB', 'updateDrawBuffer', 'leds.show', 'loop']
+
+dev = usb.core.find(idVendor=0x1d50, idProduct=0x607a)
+if not dev:
+    raise IOError("No Fadecandy interfaces found")
+
+reset = '-r' in sys.argv[1:]
+length = 4 + 16 * len(SECTIONS)
+data = dev.ctrl_transfer(0xC0, FC_PERF_REQUEST, int(reset), 0, length)
+values = struct.unpack('<%dI' % (length / 4), data.tostring())
+
+hz = float(values[0])
+print "%-18s %8s %10s %10s %10s" % ("Section", "Count", "Min us", "Avg us", "Max us")
+for i, name in enumerate(SECTIONS):
+    count, cmin, cavg, cmax = values[1 + i*4 : 5 + i*4]
+    print "%-18s %8d %10.1f %10.1f %10.1f" % (name, count, cmin * 1e6 / hz, cavg * 1e6 / hz, cmax * 1e6 / hz)
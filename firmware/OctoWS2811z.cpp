@@ -29,6 +29,7 @@
 
 
 uint16_t OctoWS2811z::stripLen;
+uint16_t OctoWS2811z::activeLen;
 void * OctoWS2811z::frameBuffer;
 void * OctoWS2811z::drawBuffer;
 uint8_t OctoWS2811z::params;
@@ -37,11 +38,13 @@ uint8_t OctoWS2811z::params;
 static const uint8_t ones = 0xFF;
 static volatile uint8_t update_in_progress = 0;
 static uint32_t update_completed_at = 0;
+static uint16_t dma_len = 0;
 
 
 OctoWS2811z::OctoWS2811z(uint32_t numPerStrip, void *buffer, uint8_t config)
 {
     stripLen = numPerStrip;
+    activeLen = numPerStrip;
     frameBuffer = buffer;
     drawBuffer = (24 * numPerStrip) + (uint8_t*) buffer;
     params = config;
@@ -71,6 +74,7 @@ void OctoWS2811z::begin(void)
     uint32_t bufsize, frequency;
 
     bufsize = stripLen*24;
+    dma_len = stripLen;
 
     // Clear both front and back buffers
     memset(frameBuffer, 0, bufsize);
@@ -187,6 +191,19 @@ void OctoWS2811z::show(void)
     // wait for any prior DMA operation
     while (update_in_progress) ; 
 
+    // The DMA channels are idle; safe to change how many bytes they move
+    if (activeLen != dma_len) {
+        uint32_t bufsize = activeLen * 24;
+        dma_len = activeLen;
+        DMA_TCD1_CITER_ELINKNO = bufsize;
+        DMA_TCD1_BITER_ELINKNO = bufsize;
+        DMA_TCD2_SLAST = -bufsize;
+        DMA_TCD2_CITER_ELINKNO = bufsize;
+        DMA_TCD2_BITER_ELINKNO = bufsize;
+        DMA_TCD3_CITER_ELINKNO = bufsize;
+        DMA_TCD3_BITER_ELINKNO = bufsize;
+    }
+
     // Swap buffer pointers without copying
     std::swap(frameBuffer, drawBuffer);
     DMA_TCD2_SADDR = frameBuffer;
@@ -23,6 +23,7 @@
     THE SOFTWARE.
 */
 
+#include <algorithm>
 #include "WProgram.h"
 #include "pins_arduino.h"
 
@@ -43,8 +44,14 @@ public:
     void show(void);
     int busy(void);
 
+    // Number of LEDs per strip to send on the next show(), up to the buffer size
+    void setStripLength(uint32_t numPerStrip) {
+        activeLen = std::min<uint32_t>(numPerStrip, stripLen);
+    }
+
 private:
     static uint16_t stripLen;
+    static uint16_t activeLen;      // Length the DMA channels are set up for, or will be by show()
     static void *frameBuffer;
     static void *drawBuffer;
     static uint8_t params;
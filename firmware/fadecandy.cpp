@@ -27,6 +27,7 @@
 #include "arm_math.h"
 #include "fc_usb.h"
 #include "fc_defs.h"
+#include "fc_perf.h"
 #include "HardwareSerial.h"
 
 // USB data buffers
@@ -179,7 +180,15 @@ static void updateDrawBuffer(unsigned interpCoefficient)
 
     int8_t *pResidual = residual;
 
-    for (int i = 0; i < LEDS_PER_STRIP; ++i, pResidual += 3) {
+    /*
+     * Only the configured number of LEDs per strip are sent, and strips past the
+     * active count are left dark without running them through updatePixel().
+     */
+
+    const int length = buffers.activeLength;
+    const unsigned strips = buffers.activeStrips;
+
+    for (int i = 0; i < length; ++i, pResidual += 3) {
 
         // Six output words
         union {
@@ -199,8 +208,8 @@ static void updateDrawBuffer(unsigned interpCoefficient)
          */
 
         uint32_t p0 = updatePixel(icPrev, icNext,
-            buffers.fbPrev->pixel(i + LEDS_PER_STRIP * 0),
-            buffers.fbNext->pixel(i + LEDS_PER_STRIP * 0),
+            buffers.fbPrev->pixel(0, i),
+            buffers.fbNext->pixel(0, i),
             buffers.lutCurrent, pResidual + LEDS_PER_STRIP * 3 * 0);
 
         o5.p0d = p0;
@@ -228,9 +237,9 @@ static void updateDrawBuffer(unsigned interpCoefficient)
         o0.p0b = p0 >> 22;
         o0.p0a = p0 >> 23;
 
-        uint32_t p1 = updatePixel(icPrev, icNext,
-            buffers.fbPrev->pixel(i + LEDS_PER_STRIP * 1),
-            buffers.fbNext->pixel(i + LEDS_PER_STRIP * 1),
+        uint32_t p1 = 1 >= strips ? 0 : updatePixel(icPrev, icNext,
+            buffers.fbPrev->pixel(1, i),
+            buffers.fbNext->pixel(1, i),
             buffers.lutCurrent, pResidual + LEDS_PER_STRIP * 3 * 1);
 
         o5.p1d = p1;
@@ -258,9 +267,9 @@ static void updateDrawBuffer(unsigned interpCoefficient)
         o0.p1b = p1 >> 22;
         o0.p1a = p1 >> 23;
 
-        uint32_t p2 = updatePixel(icPrev, icNext,
-            buffers.fbPrev->pixel(i + LEDS_PER_STRIP * 2),
-            buffers.fbNext->pixel(i + LEDS_PER_STRIP * 2),
+        uint32_t p2 = 2 >= strips ? 0 : updatePixel(icPrev, icNext,
+            buffers.fbPrev->pixel(2, i),
+            buffers.fbNext->pixel(2, i),
             buffers.lutCurrent, pResidual + LEDS_PER_STRIP * 3 * 2);
 
         o5.p2d = p2;
@@ -288,9 +297,9 @@ static void updateDrawBuffer(unsigned interpCoefficient)
         o0.p2b = p2 >> 22;
         o0.p2a = p2 >> 23;
 
-        uint32_t p3 = updatePixel(icPrev, icNext,
-            buffers.fbPrev->pixel(i + LEDS_PER_STRIP * 3),
-            buffers.fbNext->pixel(i + LEDS_PER_STRIP * 3),
+        uint32_t p3 = 3 >= strips ? 0 : updatePixel(icPrev, icNext,
+            buffers.fbPrev->pixel(3, i),
+            buffers.fbNext->pixel(3, i),
             buffers.lutCurrent, pResidual + LEDS_PER_STRIP * 3 * 3);
 
         o5.p3d = p3;
@@ -318,9 +327,9 @@ static void updateDrawBuffer(unsigned interpCoefficient)
         o0.p3b = p3 >> 22;
         o0.p3a = p3 >> 23;
 
-        uint32_t p4 = updatePixel(icPrev, icNext,
-            buffers.fbPrev->pixel(i + LEDS_PER_STRIP * 4),
-            buffers.fbNext->pixel(i + LEDS_PER_STRIP * 4),
+        uint32_t p4 = 4 >= strips ? 0 : updatePixel(icPrev, icNext,
+            buffers.fbPrev->pixel(4, i),
+            buffers.fbNext->pixel(4, i),
             buffers.lutCurrent, pResidual + LEDS_PER_STRIP * 3 * 4);
 
         o5.p4d = p4;
@@ -348,9 +357,9 @@ static void updateDrawBuffer(unsigned interpCoefficient)
         o0.p4b = p4 >> 22;
         o0.p4a = p4 >> 23;
 
-        uint32_t p5 = updatePixel(icPrev, icNext,
-            buffers.fbPrev->pixel(i + LEDS_PER_STRIP * 5),
-            buffers.fbNext->pixel(i + LEDS_PER_STRIP * 5),
+        uint32_t p5 = 5 >= strips ? 0 : updatePixel(icPrev, icNext,
+            buffers.fbPrev->pixel(5, i),
+            buffers.fbNext->pixel(5, i),
             buffers.lutCurrent, pResidual + LEDS_PER_STRIP * 3 * 5);
 
         o5.p5d = p5;
@@ -378,9 +387,9 @@ static void updateDrawBuffer(unsigned interpCoefficient)
         o0.p5b = p5 >> 22;
         o0.p5a = p5 >> 23;
 
-        uint32_t p6 = updatePixel(icPrev, icNext,
-            buffers.fbPrev->pixel(i + LEDS_PER_STRIP * 6),
-            buffers.fbNext->pixel(i + LEDS_PER_STRIP * 6),
+        uint32_t p6 = 6 >= strips ? 0 : updatePixel(icPrev, icNext,
+            buffers.fbPrev->pixel(6, i),
+            buffers.fbNext->pixel(6, i),
             buffers.lutCurrent, pResidual + LEDS_PER_STRIP * 3 * 6);
 
         o5.p6d = p6;
@@ -408,9 +417,9 @@ static void updateDrawBuffer(unsigned interpCoefficient)
         o0.p6b = p6 >> 22;
         o0.p6a = p6 >> 23;
 
-        uint32_t p7 = updatePixel(icPrev, icNext,
-            buffers.fbPrev->pixel(i + LEDS_PER_STRIP * 7),
-            buffers.fbNext->pixel(i + LEDS_PER_STRIP * 7),
+        uint32_t p7 = 7 >= strips ? 0 : updatePixel(icPrev, icNext,
+            buffers.fbPrev->pixel(7, i),
+            buffers.fbNext->pixel(7, i),
             buffers.lutCurrent, pResidual + LEDS_PER_STRIP * 3 * 7);
 
         o5.p7d = p7;
@@ -468,6 +477,7 @@ extern "C" int main()
 {
     pinMode(LED_BUILTIN, OUTPUT);
     leds.begin();
+    fc_perf_init();
 
     // Announce firmware version
     serial_begin(BAUD2DIV(115200));
@@ -475,16 +485,29 @@ extern "C" int main()
 
     // Application main loop
     while (usb_dfu_state == DFU_appIDLE) {
+        PERF_BEGIN(loop);
         watchdog_refresh();
 
+        PERF_BEGIN(usb);
         buffers.handleUSB();
+        PERF_END(PERF_HANDLE_USB, usb);
+
+        PERF_BEGIN(draw);
         updateDrawBuffer(calculateInterpCoefficient());
+        PERF_END(PERF_DRAW, draw);
+
+        PERF_BEGIN(show);
+        leds.setStripLength(buffers.activeLength);
         leds.show();
+        PERF_END(PERF_SHOW, show);
 
         // Optionally disable dithering by clearing our residual buffer every frame.
         if (buffers.flags & CFLAG_NO_DITHERING) {
             memset(residual, 0, sizeof residual);
         }
+
+        fc_perf_serial_report();
+        PERF_END(PERF_LOOP, loop);
     }
 
     // Reboot into DFU bootloader
@@ -28,7 +28,8 @@
 #pragma once
 
 #define LEDS_PER_STRIP          64
-#define LEDS_TOTAL              (LEDS_PER_STRIP * 8)
+#define NUM_STRIPS              8
+#define LEDS_TOTAL              (LEDS_PER_STRIP * NUM_STRIPS)
 #define CHANNELS_TOTAL          (LEDS_TOTAL * 3)
 
 #define LUT_CH_SIZE             257
@@ -40,9 +41,19 @@
 #define PACKETS_PER_FRAME       25
 #define PACKETS_PER_LUT         25
 
-#define NUM_USB_BUFFERS         104       // Three full frames (3*25), one LUT buffer (25), a little extra (4)
+/*
+ * Optional linear framebuffer layout. Frame packets are copied into arrays ordered
+ * the way updateDrawBuffer() reads them as soon as they arrive, and the USB packets
+ * are freed right away. Enable with "make OPTIONS=-DFC_LINEAR_FRAMEBUFFER".
+ */
+
+#ifdef FC_LINEAR_FRAMEBUFFER
+#define NUM_USB_BUFFERS         57        // One LUT buffer (25), a full frame waiting to be received (25), unread notifications (3), a little extra (4)
+#else
+#define NUM_USB_BUFFERS         107       // Three full frames (3*25), one LUT buffer (25), unread notifications (3), a little extra (4)
+#endif
 
 #define VENDOR_ID               0x1d50    // OpenMoko
 #define PRODUCT_ID              0x607a    // Assigned to Fadecandy project
-#define DEVICE_VER              0x0104	  // BCD device version
-#define DEVICE_VER_STRING		"1.04"
+#define DEVICE_VER              0x0105	  // BCD device version
+#define DEVICE_VER_STRING		"1.05"
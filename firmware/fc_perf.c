@@ -0,0 +1,150 @@
+/*
+ * Fadecandy Firmware - Performance counters
+ * 
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fc_perf.h"
+
+#ifdef FC_PERF
+
+#include "HardwareSerial.h"
+#include "core_pins.h"
+
+// Time between serial reports, and between the lines of one report
+#define REPORT_INTERVAL_MS      2000
+#define LINE_INTERVAL_MS        10
+
+struct fcPerfCounter fc_perf_counters[PERF_NUM_SECTIONS];
+
+static const char *section_names[PERF_NUM_SECTIONS] = {
+    "usb  ", "draw ", "show ", "loop "
+};
+
+static uint32_t usb_report[1 + PERF_NUM_SECTIONS * 4];
+static uint32_t report_time;
+static int report_line = -1;
+
+static void reset_counters(void)
+{
+    int i;
+    for (i = 0; i < PERF_NUM_SECTIONS; i++) {
+        fc_perf_counters[i].count = 0;
+        fc_perf_counters[i].total = 0;
+        fc_perf_counters[i].min = 0xFFFFFFFF;
+        fc_perf_counters[i].max = 0;
+    }
+}
+
+static uint32_t average(const struct fcPerfCounter *c)
+{
+    return c->count ? c->total / c->count : 0;
+}
+
+static void print_decimal(uint32_t n)
+{
+    char buf[11];
+    char *p = buf + sizeof buf;
+
+    *--p = '\0';
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    serial_print(p);
+}
+
+void fc_perf_init(void)
+{
+    reset_counters();
+
+    // Start the DWT cycle counter
+    ARM_DEMCR |= ARM_DEMCR_TRCENA;
+    ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+
+    report_time = millis();
+}
+
+void fc_perf_serial_report(void)
+{
+    /*
+     * Called once per main loop. Each call prints at most one short line, well
+     * under the size of the serial transmit buffer.
+     */
+
+    uint32_t now = millis();
+    const struct fcPerfCounter *c;
+
+    if (report_line < 0) {
+        if (now - report_time < REPORT_INTERVAL_MS) {
+            return;
+        }
+        serial_print("cycles  count / min / avg / max\r\n");
+        report_line = 0;
+        report_time = now;
+        return;
+    }
+
+    if (now - report_time < LINE_INTERVAL_MS) {
+        return;
+    }
+    report_time = now;
+
+    c = &fc_perf_counters[report_line];
+    serial_print(section_names[report_line]);
+    print_decimal(c->count);
+    serial_print(" / ");
+    print_decimal(c->count ? c->min : 0);
+    serial_print(" / ");
+    print_decimal(average(c));
+    serial_print(" / ");
+    print_decimal(c->max);
+    serial_print("\r\n");
+
+    if (++report_line == PERF_NUM_SECTIONS) {
+        report_line = -1;
+    }
+}
+
+const uint8_t *fc_perf_usb_report(uint32_t *length, int reset)
+{
+    // Called from the USB interrupt. Counters may be mid-update, which is harmless here.
+
+    uint32_t *p = usb_report;
+    int i;
+
+    *(p++) = F_CPU;
+    for (i = 0; i < PERF_NUM_SECTIONS; i++) {
+        const struct fcPerfCounter *c = &fc_perf_counters[i];
+        *(p++) = c->count;
+        *(p++) = c->count ? c->min : 0;
+        *(p++) = average(c);
+        *(p++) = c->max;
+    }
+
+    if (reset) {
+        reset_counters();
+    }
+
+    *length = sizeof usb_report;
+    return (const uint8_t*) usb_report;
+}
+
+#endif
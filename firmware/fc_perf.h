@@ -0,0 +1,106 @@
+/*
+ * Fadecandy Firmware - Performance counters
+ * 
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Optional cycle-count profiling of the main loop, using the Cortex-M4 DWT
+ * cycle counter. Enable with "make OPTIONS=-DFC_PERF". When disabled, all of
+ * this compiles to nothing.
+ *
+ * Results are available two ways:
+ *
+ *   - A vendor-specific control request (bmRequestType 0xC0, bRequest
+ *     FC_PERF_REQUEST). The reply is a 32-bit cycles-per-second value, followed
+ *     by count, min, average, and max cycles for each section, all 32-bit little
+ *     endian. A nonzero wValue resets the counters after reading them.
+ *
+ *   - A periodic report on the serial console, one section per line. Lines are
+ *     spaced out so the serial buffer never fills and stalls the main loop.
+ */
+
+#pragma once
+#include <stdint.h>
+
+#define FC_PERF_REQUEST         0x01
+
+// Sections of the main loop
+#define PERF_HANDLE_USB         0       // fcBuffers::handleUSB()
+#define PERF_DRAW               1       // updateDrawBuffer()
+#define PERF_SHOW               2       // leds.show(), mostly waiting for the previous DMA
+#define PERF_LOOP               3       // One full main loop iteration
+#define PERF_NUM_SECTIONS       4
+
+#ifdef FC_PERF
+
+#include "mk20dx128.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct fcPerfCounter {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+};
+
+extern struct fcPerfCounter fc_perf_counters[PERF_NUM_SECTIONS];
+
+void fc_perf_init(void);
+void fc_perf_serial_report(void);
+const uint8_t *fc_perf_usb_report(uint32_t *length, int reset);
+
+static inline uint32_t fc_perf_begin(void) __attribute__((always_inline, unused));
+static inline uint32_t fc_perf_begin(void)
+{
+    return ARM_DWT_CYCCNT;
+}
+
+static inline void fc_perf_end(unsigned section, uint32_t begin) __attribute__((always_inline, unused));
+static inline void fc_perf_end(unsigned section, uint32_t begin)
+{
+    // Unsigned subtraction handles counter wraparound
+    uint32_t cycles = ARM_DWT_CYCCNT - begin;
+    struct fcPerfCounter *c = &fc_perf_counters[section];
+
+    c->count++;
+    c->total += cycles;
+    if (cycles < c->min) c->min = cycles;
+    if (cycles > c->max) c->max = cycles;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#define PERF_BEGIN(name)            uint32_t perf_##name = fc_perf_begin()
+#define PERF_END(section, name)     fc_perf_end(section, perf_##name)
+
+#else
+
+#define fc_perf_init()
+#define fc_perf_serial_report()
+#define PERF_BEGIN(name)
+#define PERF_END(section, name)
+
+#endif
@@ -61,6 +61,10 @@ void fcBuffers::handleUSB()
         switch (type) {
 
             case TYPE_FRAMEBUFFER:
+                if (final) {
+                    // Read this before store() might free the packet
+                    fbNewSequence = packet->buf[62] | (packet->buf[63] << 8);
+                }
                 fbNew->store(index, packet);
                 if (final) {
                     finalizeFramebuffer();
@@ -76,6 +80,8 @@ void fcBuffers::handleUSB()
 
             case TYPE_CONFIG:
                 flags = packet->buf[1];
+                activeLength = packet->buf[2] ? std::min<unsigned>(packet->buf[2], LEDS_PER_STRIP) : LEDS_PER_STRIP;
+                activeStrips = packet->buf[3] ? std::min<unsigned>(packet->buf[3], NUM_STRIPS) : NUM_STRIPS;
                 usb_free(packet);
                 break;
 
@@ -101,8 +107,67 @@ void fcBuffers::finalizeFramebuffer()
     fbPrev = fbNext;
     fbNext = fbNew;
     fbNew = recycle;
+
+    if (flags & CFLAG_FRAME_STATUS) {
+        sendFrameStatus();
+    }
 }
 
+void fcBuffers::sendFrameStatus()
+{
+    /*
+     * Tell the host this frame is now the one we're interpolating toward. If the
+     * host isn't reading notifications, skip them rather than let them pile up
+     * and use all our packet buffers.
+     */
+
+    if (usb_tx_packet_count(FC_IN_ENDPOINT) > 0) {
+        return;
+    }
+
+    usb_packet_t *packet = usb_malloc();
+    if (!packet) {
+        return;
+    }
+
+    fcStatusPacket *status = (fcStatusPacket*) packet->buf;
+    status->type = STATUS_FRAME_PRESENTED;
+    status->reserved = 0;
+    status->sequence = fbNewSequence;
+    status->timestamp = micros();
+
+    packet->len = sizeof *status;
+    usb_tx(FC_IN_ENDPOINT, packet);
+}
+
+#ifdef FC_LINEAR_FRAMEBUFFER
+
+void fcFramebuffer::store(unsigned index, usb_packet_t *packet)
+{
+    /*
+     * Scatter this packet's pixels into rendering order. This costs a little time
+     * per packet, but it saves a divide and a pointer chase for every pixel of every
+     * refresh, and we don't have to hold on to the packet.
+     */
+
+    if (index < PACKETS_PER_FRAME) {
+        unsigned first = index * PIXELS_PER_PACKET;
+        unsigned count = std::min<unsigned>(PIXELS_PER_PACKET, LEDS_TOTAL - first);
+        const uint8_t *src = &packet->buf[1];
+
+        for (unsigned i = 0; i < count; ++i, src += 3) {
+            uint8_t *dest = pixel(first + i);
+            dest[0] = src[0];
+            dest[1] = src[1];
+            dest[2] = src[2];
+        }
+    }
+
+    usb_free(packet);
+}
+
+#endif
+
 void fcBuffers::finalizeLUT()
 {
     /*
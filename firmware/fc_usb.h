@@ -67,14 +67,45 @@ struct fcPacketBuffer
  * Framebuffer
  */
 
+#ifdef FC_LINEAR_FRAMEBUFFER
+
+struct fcFramebuffer
+{
+    // Pixels ordered by LED position, then by strip. This is the order they're rendered in.
+    uint8_t pixels[CHANNELS_TOTAL];
+    uint32_t timestamp;
+
+    // Copy pixels out of a USB packet, and free it
+    void store(unsigned index, usb_packet_t *packet);
+
+    ALWAYS_INLINE uint8_t* pixel(unsigned strip, unsigned led)
+    {
+        return &pixels[(led * NUM_STRIPS + strip) * 3];
+    }
+
+    ALWAYS_INLINE uint8_t* pixel(unsigned index)
+    {
+        return pixel(index / LEDS_PER_STRIP, index % LEDS_PER_STRIP);
+    }
+};
+
+#else
+
 struct fcFramebuffer : public fcPacketBuffer<PACKETS_PER_FRAME>
 {
     ALWAYS_INLINE const uint8_t* pixel(unsigned index)
     {
         return &packets[index / PIXELS_PER_PACKET]->buf[1 + (index % PIXELS_PER_PACKET) * 3];
     }
+
+    ALWAYS_INLINE const uint8_t* pixel(unsigned strip, unsigned led)
+    {
+        return pixel(led + strip * LEDS_PER_STRIP);
+    }
 };
 
+#endif
+
 
 /*
  * Color Lookup table
@@ -98,6 +129,22 @@ struct fcColorLUT : public fcPacketBuffer<PACKETS_PER_LUT>
 #define CFLAG_NO_INTERPOLATION  (1 << 1)
 #define CFLAG_NO_ACTIVITY_LED   (1 << 2)
 #define CFLAG_LED_CONTROL       (1 << 3)
+#define CFLAG_FRAME_STATUS      (1 << 4)
+
+
+/*
+ * Status packets, sent on FC_IN_ENDPOINT
+ */
+
+#define STATUS_FRAME_PRESENTED  0x01
+
+struct fcStatusPacket
+{
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t sequence;          // Copied from the last two bytes of the frame's final packet
+    uint32_t timestamp;         // micros() when the frame became fbNext
+};
 
 
 /*
@@ -116,17 +163,24 @@ struct fcBuffers
     uint16_t lutCurrent[LUT_TOTAL_SIZE];    // Active LUT, linearized for efficiency
 
     uint8_t flags;              // Configuration flags
+    uint8_t activeLength;       // LEDs per strip we actually drive
+    uint8_t activeStrips;       // Number of strips we render, starting with the first
+    uint16_t fbNewSequence;     // Host's sequence number for the frame in fbNew
 
     fcBuffers()
     {
         fbPrev = &fb[0];
         fbNext = &fb[1];
         fbNew = &fb[2];
+        activeLength = LEDS_PER_STRIP;
+        activeStrips = NUM_STRIPS;
+        fbNewSequence = 0;
     }
 
     void handleUSB();
 
 private:
     void finalizeFramebuffer();
+    void sendFrameStatus();
     void finalizeLUT();
 };
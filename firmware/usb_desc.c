@@ -106,7 +106,7 @@ static uint8_t config_descriptor[CONFIG_DESC_SIZE] = {
         4,                                      // bDescriptorType
         FC_INTERFACE,                           // bInterfaceNumber
         0,                                      // bAlternateSetting
-        1,                                      // bNumEndpoints
+        2,                                      // bNumEndpoints
         0xff,                                   // bInterfaceClass (Vendor specific)
         0x00,                                   // bInterfaceSubClass
         0x00,                                   // bInterfaceProtocol
@@ -118,6 +118,13 @@ static uint8_t config_descriptor[CONFIG_DESC_SIZE] = {
         0x02,                                   // bmAttributes (0x02=bulk)
         FC_OUT_SIZE, 0,                         // wMaxPacketSize
         0,                                      // bInterval
+        // endpoint descriptor, USB spec 9.6.6, page 269-271, Table 9-13
+        7,                                      // bLength
+        5,                                      // bDescriptorType
+        FC_IN_ENDPOINT | 0x80,                  // bEndpointAddress
+        0x03,                                   // bmAttributes (0x03=intr)
+        FC_IN_SIZE, 0,                          // wMaxPacketSize
+        1,                                      // bInterval
 #endif // FC_INTERFACE
 
 #ifdef DFU_INTERFACE
@@ -84,16 +84,19 @@ let me know?  http://forum.pjrc.com/forums/4-Suggestions-amp-Bug-Reports
   #define DFU_NAME                  {'F','a','d','e','c','a','n','d','y',' ','B','o','o','t','l','o','a','d','e','r'}
   #define DFU_NAME_LEN              20
   #define EP0_SIZE                  64
-  #define NUM_ENDPOINTS             1
+  #define NUM_ENDPOINTS             2
   #define NUM_INTERFACE             2
   #define FC_INTERFACE              0
   #define FC_OUT_ENDPOINT           1
   #define FC_OUT_SIZE               64
+  #define FC_IN_ENDPOINT            2
+  #define FC_IN_SIZE                8
   #define DFU_INTERFACE             1
   #define DFU_DETACH_TIMEOUT        10000     // 10 seconds
   #define DFU_TRANSFER_SIZE         1024      // Flash sector size
-  #define CONFIG_DESC_SIZE          (9+9+7+9+9)
+  #define CONFIG_DESC_SIZE          (9+9+7+7+9+9)
   #define ENDPOINT1_CONFIG          ENDPOINT_RECEIVE_ONLY
+  #define ENDPOINT2_CONFIG          ENDPOINT_TRANSIMIT_ONLY
 
 // Microsoft Compatible ID Feature Descriptor
 #define MSFT_VENDOR_CODE    '~'     // Arbitrary, but should be printable ASCII
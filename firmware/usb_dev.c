@@ -36,6 +36,7 @@
 #include "usb_dev.h"
 #include "usb_mem.h"
 #include "usb_desc.h"
+#include "fc_perf.h"
 
 // buffer descriptor table
 
@@ -304,6 +305,12 @@ static void usb_setup(void)
         endpoint0_stall();
         return;
 
+#ifdef FC_PERF
+      case (FC_PERF_REQUEST << 8) | 0xC0:       // Read performance counters
+        data = fc_perf_usb_report(&datalen, setup.wValue != 0);
+        break;
+#endif
+
       case 0x03a1: // DFU_GETSTATUS
         if (setup.wIndex != DFU_INTERFACE) {
             endpoint0_stall();
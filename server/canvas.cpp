@@ -0,0 +1,338 @@
+/*
+ * Canvas mapping, sampling a raster image at each LED's position
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "canvas.h"
+#include <math.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+typedef int32_t i32x4 __attribute__((vector_size(16)));
+
+
+CanvasMap::CanvasMap()
+    : mInstruction(0),
+      mChannel(0),
+      mWidth(0),
+      mHeight(0),
+      mFirstOutput(0)
+{
+    // No table yet. No canvas has zero width.
+    memset(&mTableShape, 0, sizeof mTableShape);
+}
+
+bool CanvasMap::parse(const Value &inst, std::ostream &error)
+{
+    /*
+     * A canvas mapping instruction:
+     *
+     *   "canvas": OPC channel carrying the raster image
+     *   "size": [width, height] of the image, in pixels
+     *   "layout": List of points, one for each output pixel. Each point is [x, y],
+     *             [x, y, z], or an object with a "point" list like the Open Pixel
+     *             Control layout files. May also be the name of such a file.
+     *   "first": Optional. First output pixel. Default is 0.
+     *   "axes": Optional. Which two coordinates of each point become the canvas
+     *           x and y. Default is [0, 1].
+     *   "bounds": Optional. [x, y, x, y] of the canvas' top-left and bottom-right
+     *             corners, in layout coordinates. Default is the layout's extent.
+     */
+
+    const Value &channel = inst["canvas"];
+    const Value &size = inst["size"];
+    const Value &first = inst["first"];
+
+    mInstruction = &inst;
+
+    if (!(channel.IsUint() && channel.GetUint() <= 255)) {
+        error << "Canvas map 'canvas' must be a channel number from 0 to 255.\n";
+        return false;
+    }
+    mChannel = channel.GetUint();
+
+    if (!(size.IsArray() && size.Size() == 2 && size[0u].IsUint() && size[1].IsUint() &&
+            size[0u].GetUint() >= 1 && size[1].GetUint() >= 1 &&
+            size[0u].GetUint() * size[1].GetUint() <= 0xFFFF / 3)) {
+        error << "Canvas map 'size' must be [width, height], with at most " << 0xFFFF / 3
+            << " pixels to fit in an OPC message.\n";
+        return false;
+    }
+    mWidth = size[0u].GetUint();
+    mHeight = size[1].GetUint();
+
+    if (first.IsUint()) {
+        mFirstOutput = first.GetUint();
+    } else if (!first.IsNull()) {
+        error << "Canvas map 'first' must be an output pixel number.\n";
+        return false;
+    }
+
+    return parseLayout(inst["layout"], inst["axes"], inst["bounds"], error);
+}
+
+bool CanvasMap::parseLayout(const Value &layout, const Value &axes, const Value &bounds, std::ostream &error)
+{
+    if (layout.IsString()) {
+        // Layout file, parsed once here. Only the positions are kept.
+        std::ifstream file(layout.GetString());
+        std::stringstream text;
+        text << file.rdbuf();
+
+        rapidjson::Document doc;
+        doc.Parse<0>(text.str().c_str());
+
+        if (!file || doc.HasParseError()) {
+            error << "Can't read canvas layout file '" << layout.GetString() << "'.\n";
+            return false;
+        }
+        return parseLayout(doc, axes, bounds, error);
+    }
+
+    if (!layout.IsArray()) {
+        error << "Canvas map 'layout' must be a list of points, or a layout file name.\n";
+        return false;
+    }
+
+    unsigned axisX = 0, axisY = 1;
+    if (axes.IsArray() && axes.Size() == 2 && axes[0u].IsUint() && axes[1].IsUint() &&
+            axes[0u].GetUint() < 3 && axes[1].GetUint() < 3) {
+        axisX = axes[0u].GetUint();
+        axisY = axes[1].GetUint();
+    } else if (!axes.IsNull()) {
+        error << "Canvas map 'axes' must be two coordinate numbers, from 0 to 2.\n";
+        return false;
+    }
+
+    mPoints.clear();
+    mPoints.reserve(layout.Size() * 2);
+
+    for (unsigned i = 0; i < layout.Size(); ++i) {
+        const Value &item = layout[i];
+        const Value &point = item.IsObject() ? item["point"] : item;
+
+        if (!(point.IsArray() && point.Size() > std::max(axisX, axisY) &&
+                point[axisX].IsNumber() && point[axisY].IsNumber())) {
+            error << "Canvas layout point #" << i << " must be a list of coordinates.\n";
+            return false;
+        }
+        mPoints.push_back(point[axisX].GetDouble());
+        mPoints.push_back(point[axisY].GetDouble());
+    }
+
+    if (mPoints.empty()) {
+        return true;
+    }
+
+    // Corners of the canvas, in layout coordinates
+    double left, top, right, bottom;
+
+    if (bounds.IsArray() && bounds.Size() == 4 && bounds[0u].IsNumber() && bounds[1].IsNumber() &&
+            bounds[2].IsNumber() && bounds[3].IsNumber()) {
+        left = bounds[0u].GetDouble();
+        top = bounds[1].GetDouble();
+        right = bounds[2].GetDouble();
+        bottom = bounds[3].GetDouble();
+    } else if (bounds.IsNull()) {
+        left = right = mPoints[0];
+        top = bottom = mPoints[1];
+        for (unsigned i = 0; i < mPoints.size(); i += 2) {
+            left = std::min<double>(left, mPoints[i]);
+            right = std::max<double>(right, mPoints[i]);
+            top = std::min<double>(top, mPoints[i + 1]);
+            bottom = std::max<double>(bottom, mPoints[i + 1]);
+        }
+    } else {
+        error << "Canvas map 'bounds' must be a list of 4 numbers.\n";
+        return false;
+    }
+
+    // Scale to [0, 1]. A layout with no extent on an axis samples the middle.
+    for (unsigned i = 0; i < mPoints.size(); i += 2) {
+        mPoints[i] = right != left ? (mPoints[i] - left) / (right - left) : 0.5;
+        mPoints[i + 1] = bottom != top ? (mPoints[i + 1] - top) / (bottom - top) : 0.5;
+    }
+
+    return true;
+}
+
+bool CanvasMap::sameShape(const Canvas &canvas) const
+{
+    const Canvas &t = mTableShape;
+    return canvas.width == t.width && canvas.height == t.height && canvas.stride == t.stride &&
+        canvas.format == t.format && (canvas.format == Canvas::RGB ||
+        (canvas.chromaStride == t.chromaStride && canvas.chromaShiftX == t.chromaShiftX &&
+         canvas.chromaShiftY == t.chromaShiftY));
+}
+
+void CanvasMap::buildTable(const Canvas &canvas)
+{
+    /*
+     * Pixel centers are at half-integer positions, so [0, 1] covers the canvas
+     * edge to edge. Points outside it take the color of the nearest edge. Weights
+     * are 8-bit fractions on each axis, so the four of them add up to 1 << 16.
+     *
+     * YUV chroma uses the same weights, from the chroma pixel covering each
+     * of the four luma pixels.
+     */
+
+    const unsigned n = count();
+    const bool yuv = canvas.format == Canvas::YUV;
+    const unsigned bytesPerPixel = yuv ? 1 : 3;
+
+    mTableShape = canvas;
+    mOffsets.resize(n * 4);
+    mChromaOffsets.resize(yuv ? n * 4 : 0);
+    mWeights.resize(n * 4);
+
+    for (unsigned i = 0; i < n; ++i) {
+        double x = mPoints[i * 2] * canvas.width - 0.5;
+        double y = mPoints[i * 2 + 1] * canvas.height - 0.5;
+
+        x = std::min<double>(std::max<double>(x, 0), canvas.width - 1);
+        y = std::min<double>(std::max<double>(y, 0), canvas.height - 1);
+
+        unsigned x0 = floor(x), y0 = floor(y);
+        unsigned x1 = std::min(x0 + 1, canvas.width - 1);
+        unsigned y1 = std::min(y0 + 1, canvas.height - 1);
+        uint32_t fx = lrint((x - x0) * 256);
+        uint32_t fy = lrint((y - y0) * 256);
+
+        const unsigned xs[4] = { x0, x1, x0, x1 };
+        const unsigned ys[4] = { y0, y0, y1, y1 };
+        uint32_t *offset = &mOffsets[i * 4];
+        uint32_t *weight = &mWeights[i * 4];
+
+        for (unsigned k = 0; k < 4; ++k) {
+            offset[k] = ys[k] * canvas.stride + xs[k] * bytesPerPixel;
+            if (yuv) {
+                mChromaOffsets[i * 4 + k] = (ys[k] >> canvas.chromaShiftY) * canvas.chromaStride +
+                    (xs[k] >> canvas.chromaShiftX);
+            }
+        }
+
+        weight[0] = (256 - fx) * (256 - fy);
+        weight[1] = fx * (256 - fy);
+        weight[2] = (256 - fx) * fy;
+        weight[3] = fx * fy;
+    }
+}
+
+void CanvasMap::sample(const Canvas &canvas, uint8_t *rgb)
+{
+    if (!count()) {
+        return;
+    }
+    if (!sameShape(canvas)) {
+        buildTable(canvas);
+    }
+
+    if (canvas.format == Canvas::YUV) {
+        sampleYUV(canvas, rgb);
+    } else {
+        sampleRGB(canvas, rgb);
+    }
+}
+
+void CanvasMap::sampleRGB(const Canvas &canvas, uint8_t *rgb)
+{
+    /*
+     * Red, green, and blue of each source pixel go through one vector
+     * multiply-add together, with the fourth lane unused.
+     */
+
+    const unsigned n = count();
+    const uint32_t *offset = &mOffsets[0];
+    const uint32_t *weight = &mWeights[0];
+    const u32x4 round = { 0x8000, 0x8000, 0x8000, 0 };
+
+    for (unsigned i = 0; i < n; ++i, offset += 4, weight += 4, rgb += 3) {
+        u32x4 sum = round;
+
+        for (unsigned k = 0; k < 4; ++k) {
+            const uint8_t *p = canvas.pixels + offset[k];
+            u32x4 color = { p[0], p[1], p[2], 0 };
+            u32x4 w = { weight[k], weight[k], weight[k], weight[k] };
+            sum += color * w;
+        }
+
+        sum >>= 16;
+        rgb[0] = sum[0];
+        rgb[1] = sum[1];
+        rgb[2] = sum[2];
+    }
+}
+
+void CanvasMap::sampleYUV(const Canvas &canvas, uint8_t *rgb)
+{
+    /*
+     * Blend Y, U, and V the same way as RGB, then convert only the blended
+     * result. The conversion is linear, so this matches converting first,
+     * apart from clamping. BT.601 coefficients, in 8-bit fixed point:
+     *
+     *   R = 1.164 (Y - 16) + 1.596 (V - 128)
+     *   G = 1.164 (Y - 16) - 0.391 (U - 128) - 0.813 (V - 128)
+     *   B = 1.164 (Y - 16) + 2.018 (U - 128)
+     */
+
+    const unsigned n = count();
+    const uint32_t *offset = &mOffsets[0];
+    const uint32_t *chroma = &mChromaOffsets[0];
+    const uint32_t *weight = &mWeights[0];
+
+    const i32x4 kY = { 298, 298, 298, 0 };
+    const i32x4 kU = { 0, -100, 516, 0 };
+    const i32x4 kV = { 409, -208, 0, 0 };
+    const i32x4 round = { 0x8000, 0x8000, 0x8000, 0 };
+    const i32x4 zero = { 0, 0, 0, 0 };
+    const i32x4 max = { 255, 255, 255, 255 };
+
+    for (unsigned i = 0; i < n; ++i, offset += 4, chroma += 4, weight += 4, rgb += 3) {
+        u32x4 sum = { 0, 0, 0, 0 };
+
+        for (unsigned k = 0; k < 4; ++k) {
+            u32x4 yuv = { canvas.pixels[offset[k]], canvas.u[chroma[k]], canvas.v[chroma[k]], 0 };
+            u32x4 w = { weight[k], weight[k], weight[k], weight[k] };
+            sum += yuv * w;
+        }
+
+        // Blended Y, U, and V with 8 fractional bits, offset to zero
+        int32_t y = int32_t(sum[0] >> 8) - (16 << 8);
+        int32_t u = int32_t(sum[1] >> 8) - (128 << 8);
+        int32_t v = int32_t(sum[2] >> 8) - (128 << 8);
+
+        i32x4 vy = { y, y, y, 0 };
+        i32x4 vu = { u, u, u, 0 };
+        i32x4 vv = { v, v, v, 0 };
+        i32x4 color = (vy * kY + vu * kU + vv * kV + round) >> 16;
+
+        color &= ~(color < zero);
+        i32x4 over = color > max;
+        color = (color & ~over) | (max & over);
+
+        rgb[0] = color[0];
+        rgb[1] = color[1];
+        rgb[2] = color[2];
+    }
+}
@@ -0,0 +1,110 @@
+/*
+ * Canvas mapping, sampling a raster image at each LED's position
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "rapidjson/document.h"
+#include <ostream>
+#include <vector>
+#include <stdint.h>
+
+
+/*
+ * One frame of a raster image on a canvas channel. Rows are 'stride' bytes
+ * apart. RGB images have 3 bytes for each pixel. YUV images, from video files,
+ * are planar: 'pixels' is the Y plane, and U and V may be subsampled.
+ */
+
+struct Canvas {
+    enum Format {
+        RGB,
+        YUV             // BT.601, with Y from 16 to 235
+    };
+
+    unsigned channel;
+    unsigned width;
+    unsigned height;
+    unsigned stride;
+    const uint8_t *pixels;
+
+    // YUV only. Chroma pixels are (1 << shift) luma pixels apart on each axis.
+    Format format;
+    const uint8_t *u;
+    const uint8_t *v;
+    unsigned chromaStride;
+    unsigned chromaShiftX;
+    unsigned chromaShiftY;
+};
+
+
+/*
+ * A canvas mapping instruction, compiled from its JSON object. Each output pixel
+ * has a position from the layout, which scales onto whatever size of canvas
+ * arrives. For each canvas size we precompute the four neighboring source pixels
+ * and their bilinear weights for every output, so sampling a frame is a plain
+ * gather and multiply-add.
+ */
+
+class CanvasMap
+{
+public:
+    typedef rapidjson::Value Value;
+
+    CanvasMap();
+
+    // Check a mapping instruction that has a "canvas" key, appending any errors
+    bool parse(const Value &inst, std::ostream &error);
+
+    // The instruction this was compiled from
+    const Value *instruction() const { return mInstruction; }
+
+    unsigned channel() const { return mChannel; }
+    unsigned width() const { return mWidth; }
+    unsigned height() const { return mHeight; }
+    unsigned firstOutput() const { return mFirstOutput; }
+    unsigned count() const { return mPoints.size() / 2; }
+
+    // Write 3 bytes of RGB for each output pixel, count() in all
+    void sample(const Canvas &canvas, uint8_t *rgb);
+
+private:
+    const Value *mInstruction;
+    unsigned mChannel;
+    unsigned mWidth;            // Canvas size expected on the OPC channel
+    unsigned mHeight;
+    unsigned mFirstOutput;
+
+    // Positions scaled to [0, 1] across the canvas, x and y for each output pixel
+    std::vector<float> mPoints;
+
+    // Gather table for the last canvas shape: 4 source offsets and 4 weights per output
+    Canvas mTableShape;
+    std::vector<uint32_t> mOffsets;
+    std::vector<uint32_t> mChromaOffsets;
+    std::vector<uint32_t> mWeights;
+
+    bool parseLayout(const Value &layout, const Value &axes, const Value &bounds, std::ostream &error);
+    bool sameShape(const Canvas &canvas) const;
+    void buildTable(const Canvas &canvas);
+    void sampleRGB(const Canvas &canvas, uint8_t *rgb);
+    void sampleYUV(const Canvas &canvas, uint8_t *rgb);
+};
@@ -26,26 +26,10 @@
 #include <iostream>
 
 
-EnttecDMXDevice::Transfer::Transfer(EnttecDMXDevice *device, void *buffer, int length)
-    : transfer(libusb_alloc_transfer(0)),
-      device(device)
-{
-    libusb_fill_bulk_transfer(transfer, device->mHandle,
-        OUT_ENDPOINT, (uint8_t*) buffer, length, EnttecDMXDevice::completeTransfer, this, 2000);
-}
-
-EnttecDMXDevice::Transfer::~Transfer()
-{
-    libusb_free_transfer(transfer);
-}
-
 EnttecDMXDevice::EnttecDMXDevice(libusb_device *device, bool verbose)
-    : USBDevice(device, verbose),
-      mFoundEnttecStrings(false),
-      mConfigMap(0)
+    : USBDevice(device, "enttec", verbose),
+      mFoundEnttecStrings(false)
 {
-    mSerial[0] = '\0';
-
     // Initialize a minimal valid DMX packet
     memset(&mChannelBuffer, 0, sizeof mChannelBuffer);
     mChannelBuffer.start = START_OF_MESSAGE;
@@ -55,19 +39,7 @@ EnttecDMXDevice::EnttecDMXDevice(libusb_device *device, bool verbose)
 }
 
 EnttecDMXDevice::~EnttecDMXDevice()
-{
-    /*
-     * If we have pending transfers, cancel them and jettison them
-     * from the EnttecDMXDevice. The Transfer objects themselves will be freed
-     * once libusb completes them.
-     */
-
-    for (std::set<Transfer*>::iterator i = mPending.begin(), e = mPending.end(); i != e; ++i) {
-        Transfer *fct = *i;
-        libusb_cancel_transfer(fct->transfer);
-        fct->device = 0;
-    }
-}
+{}
 
 bool EnttecDMXDevice::probe(libusb_device *device)
 {
@@ -152,14 +124,9 @@ bool EnttecDMXDevice::probeAfterOpening()
     return mFoundEnttecStrings;
 }
 
-bool EnttecDMXDevice::matchConfiguration(const Value &config)
+void EnttecDMXDevice::loadConfiguration(const Config &config)
 {
-    if (matchConfigurationWithTypeAndSerial(config, "enttec", mSerial)) {
-        mConfigMap = findConfigMap(config);
-        return true;
-    }
-
-    return false;
+    mConfigMaps = config.maps;
 }
 
 std::string EnttecDMXDevice::getName()
@@ -182,56 +149,23 @@ void EnttecDMXDevice::setChannel(unsigned n, uint8_t value)
     }
 }
 
-void EnttecDMXDevice::submitTransfer(Transfer *fct)
-{
-    /*
-     * Submit a new USB transfer. The Transfer object is guaranteed to be freed eventually.
-     * On error, it's freed right away.
-     */
-
-    int r = libusb_submit_transfer(fct->transfer);
-
-    if (r < 0) {
-        if (mVerbose && r != LIBUSB_ERROR_PIPE) {
-            std::clog << "Error submitting USB transfer: " << libusb_strerror(libusb_error(r)) << "\n";
-        }
-        delete fct;
-    } else {
-        mPending.insert(fct);
-    }
-}
-
-void EnttecDMXDevice::completeTransfer(struct libusb_transfer *transfer)
+void EnttecDMXDevice::writeDMXPacket()
 {
     /*
-     * Transfer complete. The EnttecDMXDevice may or may not still exist; if the device was unplugged,
-     * fct->device will be set to 0 by ~EnttecDMXDevice().
+     * Asynchronously write an FTDI packet containing an Enttec packet containing
+     * our set of DMX channels. The OS copies the buffer at submit time, and if the
+     * device can't keep up, newer packets supersede queued ones.
      */
 
-    EnttecDMXDevice::Transfer *fct = static_cast<EnttecDMXDevice::Transfer*>(transfer->user_data);
-    EnttecDMXDevice *self = fct->device;
-
-    if (self) {
-        self->mPending.erase(fct);
-    }
-
-    delete fct;
+    submitTransfer(new Transfer(this, OUT_ENDPOINT, &mChannelBuffer, mChannelBuffer.length + 5, CLASS_FRAME));
 }
 
-void EnttecDMXDevice::writeDMXPacket()
+void EnttecDMXDevice::writeFrame()
 {
-    /*
-     * Asynchronously write an FTDI packet containing an Enttec packet containing
-     * our set of DMX channels.
-     *
-     * XXX: We should probably throttle this so that we don't send DMX messages
-     *      faster than the Enttec device can keep up!
-     */
-
-    submitTransfer(new Transfer(this, &mChannelBuffer, mChannelBuffer.length + 5));
+    writeDMXPacket();
 }
 
-void EnttecDMXDevice::writeMessage(const OPCSink::Message &msg)
+void EnttecDMXDevice::writeMessage(const OPCSink::Message &msg, unsigned listener)
 {
     /*
      * Dispatch an incoming OPC command
@@ -240,8 +174,8 @@ void EnttecDMXDevice::writeMessage(const OPCSink::Message &msg)
     switch (msg.command) {
 
         case OPCSink::SetPixelColors:
-            opcSetPixelColors(msg);
-            writeDMXPacket();
+            opcSetPixelColors(msg, listener);
+            frameChanged();
             return;
 
         case OPCSink::SystemExclusive:
@@ -254,19 +188,20 @@ void EnttecDMXDevice::writeMessage(const OPCSink::Message &msg)
     }
 }
 
-void EnttecDMXDevice::opcSetPixelColors(const OPCSink::Message &msg)
+void EnttecDMXDevice::opcSetPixelColors(const OPCSink::Message &msg, unsigned listener)
 {
     /*
-     * Parse through our device's mapping, and store any relevant portions of 'msg'
-     * in the framebuffer.
+     * Parse through our device's mapping for this listener, and store any relevant
+     * portions of 'msg' in the framebuffer.
      */
 
-    if (!mConfigMap) {
-        // No mapping defined yet. This device is inactive.
+    const Value *mapPtr = listener < mConfigMaps.size() ? mConfigMaps[listener] : 0;
+    if (!mapPtr) {
+        // No mapping defined. This device is inactive for this listener.
         return;
     }
 
-    const Value &map = *mConfigMap;
+    const Value &map = *mapPtr;
     for (unsigned i = 0, e = map.Size(); i != e; i++) {
         opcMapPixelColors(msg, map[i]);
     }
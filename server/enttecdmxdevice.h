@@ -23,7 +23,6 @@
 
 #pragma once
 #include "usbdevice.h"
-#include <set>
 
 
 class EnttecDMXDevice : public USBDevice
@@ -36,8 +35,8 @@ public:
 
     virtual int open();
     virtual bool probeAfterOpening();
-    virtual bool matchConfiguration(const Value &config);
-    virtual void writeMessage(const OPCSink::Message &msg);
+    virtual void loadConfiguration(const Config &config);
+    virtual void writeMessage(const OPCSink::Message &msg, unsigned listener);
     virtual std::string getName();
 
     void writeDMXPacket();
@@ -57,22 +56,11 @@ private:
         uint8_t data[514];
     };
 
-    struct Transfer {
-        Transfer(EnttecDMXDevice *device, void *buffer, int length);
-        ~Transfer();
-        libusb_transfer *transfer;
-        EnttecDMXDevice *device;
-    };
-
-    char mSerial[256];
     bool mFoundEnttecStrings;
-    const Value *mConfigMap;
+    std::vector<const Value*> mConfigMaps;
     Packet mChannelBuffer;
-    std::set<Transfer*> mPending;
-
-    void submitTransfer(Transfer *fct);
-    static void completeTransfer(struct libusb_transfer *transfer);
 
-    void opcSetPixelColors(const OPCSink::Message &msg);
+    virtual void writeFrame();
+    void opcSetPixelColors(const OPCSink::Message &msg, unsigned listener);
     void opcMapPixelColors(const OPCSink::Message &msg, const Value &inst);
 };
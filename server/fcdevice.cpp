@@ -22,40 +22,48 @@
  */
 
 #include "fcdevice.h"
+#include "testpattern.h"
+#include "util.h"
 #include <math.h>
 #include <iostream>
 #include <sstream>
 #include <stdio.h>
+#include <stdlib.h>
 
 
-FCDevice::Transfer::Transfer(FCDevice *device, void *buffer, int length)
-    : transfer(libusb_alloc_transfer(0)),
-      device(device)
-{
-    libusb_fill_bulk_transfer(transfer, device->mHandle,
-        OUT_ENDPOINT, (uint8_t*) buffer, length, FCDevice::completeTransfer, this, 2000);
-}
-
-FCDevice::Transfer::~Transfer()
-{
-    libusb_free_transfer(transfer);
-}
+const double FCDevice::SERVICE_TIME_ALPHA = 1.0 / 8;
+const double FCDevice::STATUS_TIMEOUT = 0.1;
 
 FCDevice::FCDevice(libusb_device *device, bool verbose)
-    : USBDevice(device, verbose),
-      mConfigMap(0)
+    : USBDevice(device, "fadecandy", verbose),
+      mCurrentFrame(0),
+      mFramebuffer(0),
+      mFrameMemory(0),
+      mFrameDeviceMemory(false),
+      mServiceTime(0),
+      mLastSubmitTime(0),
+      mLastCompleteTime(0),
+      mFramesInFlight(0),
+      mFrameDeferred(false),
+      mFramesSubmitted(0),
+      mFramesCompleted(0),
+      mFramesDropped(0),
+      mStatusTransfer(0),
+      mNextSequence(0),
+      mLastPresented(0),
+      mFrameReceived(0),
+      mLastPresentTime(0),
+      mPresentLatency(0),
+      mPresentLatencyMax(0),
+      mLastDeviceTimestamp(0),
+      mDeviceFrameInterval(0),
+      mFramesPresented(0)
 {
-    mSerial[0] = '\0';
-
     memset(&mFirmwareConfig, 0, sizeof mFirmwareConfig);
     mFirmwareConfig.control = TYPE_CONFIG;
-
-    // Framebuffer headers
-    memset(mFramebuffer, 0, sizeof mFramebuffer);
-    for (unsigned i = 0; i < FRAMEBUFFER_PACKETS; ++i) {
-        mFramebuffer[i].control = TYPE_FRAMEBUFFER | i;
-    }
-    mFramebuffer[FRAMEBUFFER_PACKETS - 1].control |= FINAL;
+    memset(mFrameTimes, 0, sizeof mFrameTimes);
+    ev_timer_init(&mDeferTimer, cbDeferTimer, 0, 0);
+    mDeferTimer.data = this;
 
     // Color LUT headers
     memset(mColorLUT, 0, sizeof mColorLUT);
@@ -68,15 +76,22 @@ FCDevice::FCDevice(libusb_device *device, bool verbose)
 FCDevice::~FCDevice()
 {
     /*
-     * If we have pending transfers, cancel them and jettison them
-     * from the FCDevice. The Transfer objects themselves will be freed
-     * once libusb completes them.
+     * Frames still in flight are cancelled by ~USBDevice. With device memory, the
+     * kernel keeps its own reference until those transfers finish.
      */
 
-    for (std::set<Transfer*>::iterator i = mPending.begin(), e = mPending.end(); i != e; ++i) {
-        Transfer *fct = *i;
-        libusb_cancel_transfer(fct->transfer);
-        fct->device = 0;
+    if (eventLoop()) {
+        ev_timer_stop(eventLoop(), &mDeferTimer);
+    }
+
+    if (mStatusTransfer) {
+        // Freed by cbFrameStatus once the cancellation completes
+        mStatusTransfer->user_data = 0;
+        libusb_cancel_transfer(mStatusTransfer);
+    }
+
+    if (mFrameMemory) {
+        freeTransferMemory(mFrameMemory, FRAMEBUFFER_RING * sizeof(Packet) * FRAMEBUFFER_PACKETS, mFrameDeviceMemory);
     }
 }
 
@@ -109,18 +124,53 @@ int FCDevice::open()
         return r;
     }
 
+    if (!allocFramebuffers()) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
     return libusb_get_string_descriptor_ascii(mHandle, mDD.iSerialNumber, (uint8_t*)mSerial, sizeof mSerial);
 }
 
-bool FCDevice::matchConfiguration(const Value &config)
+bool FCDevice::allocFramebuffers()
 {
-    if (matchConfigurationWithTypeAndSerial(config, "fadecandy", mSerial)) {
-        mConfigMap = findConfigMap(config);
-        configureDevice(config);
-        return true;
+    /*
+     * One block of transfer memory holds every frame in the ring.
+     */
+
+    const size_t frameSize = sizeof(Packet) * FRAMEBUFFER_PACKETS;
+
+    mFrameMemory = allocTransferMemory(FRAMEBUFFER_RING * frameSize, mFrameDeviceMemory);
+    if (!mFrameMemory) {
+        return false;
     }
 
-    return false;
+    for (unsigned f = 0; f < FRAMEBUFFER_RING; ++f) {
+        Frame &frame = mFrames[f];
+        frame.packets = (Packet*) (mFrameMemory + f * frameSize);
+        frame.pending = false;
+
+        // Packet headers never change
+        for (unsigned i = 0; i < FRAMEBUFFER_PACKETS; ++i) {
+            frame.packets[i].control = TYPE_FRAMEBUFFER | i;
+        }
+        frame.packets[FRAMEBUFFER_PACKETS - 1].control |= FINAL;
+    }
+
+    mCurrentFrame = 0;
+    mFramebuffer = mFrames[0].packets;
+
+    if (mVerbose && mFrameDeviceMemory) {
+        std::clog << "Using zero-copy USB device memory for Fadecandy framebuffers\n";
+    }
+    return true;
+}
+
+void FCDevice::loadConfiguration(const Config &config)
+{
+    mConfigMaps = config.maps;
+    mCanvasMaps = config.canvases;
+    configureDevice(*config.value);
+    startFrameStatus();
 }
 
 void FCDevice::configureDevice(const Value &config)
@@ -140,43 +190,79 @@ void FCDevice::configureDevice(const Value &config)
         (led.IsNull() ? 0 : CFLAG_NO_ACTIVITY_LED) |
         (led.IsTrue() ? CFLAG_LED_CONTROL : 0)     ;
 
-    writeFirmwareConfiguration();
-}
-
-void FCDevice::submitTransfer(Transfer *fct)
-{
     /*
-     * Submit a new USB transfer. The Transfer object is guaranteed to be freed eventually.
-     * On error, it's freed right away.
+     * Optionally drive fewer or shorter strips. Zero tells the firmware to use
+     * its full size. Shorter strips refresh faster.
      */
 
-    int r = libusb_submit_transfer(fct->transfer);
+    const Value &ledsPerStrip = config["ledsPerStrip"];
+    const Value &strips = config["strips"];
 
-    if (r < 0) {
-        if (mVerbose && r != LIBUSB_ERROR_PIPE) {
-            std::clog << "Error submitting USB transfer: " << libusb_strerror(libusb_error(r)) << "\n";
-        }
-        delete fct;
+    if (!(ledsPerStrip.IsNull() || (ledsPerStrip.IsUint() && ledsPerStrip.GetUint() >= 1
+            && ledsPerStrip.GetUint() <= LEDS_PER_STRIP))) {
+        std::clog << "ledsPerStrip must be a number from 1 to " << LEDS_PER_STRIP << ".\n";
+    } else {
+        mFirmwareConfig.data[1] = ledsPerStrip.IsNull() ? 0 : ledsPerStrip.GetUint();
+    }
+
+    if (!(strips.IsNull() || (strips.IsUint() && strips.GetUint() >= 1 && strips.GetUint() <= NUM_STRIPS))) {
+        std::clog << "strips must be a number from 1 to " << NUM_STRIPS << ".\n";
     } else {
-        mPending.insert(fct);
+        mFirmwareConfig.data[2] = strips.IsNull() ? 0 : strips.GetUint();
     }
+
+    writeFirmwareConfiguration();
 }
 
-void FCDevice::completeTransfer(struct libusb_transfer *transfer)
+void FCDevice::transferFinished(Transfer *t)
 {
-    /*
-     * Transfer complete. The FCDevice may or may not still exist; if the device was unplugged,
-     * fct->device will be set to 0 by ~FCDevice().
-     */
-
-    FCDevice::Transfer *fct = static_cast<FCDevice::Transfer*>(transfer->user_data);
-    FCDevice *self = fct->device;
+    // A frame can be reused once its transfer is done with it
+    Frame *frame = static_cast<Frame*>(t->context);
+    if (!frame) {
+        return;
+    }
+    frame->pending = false;
+    mFramesInFlight--;
+
+    if (t->transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        /*
+         * Service time is measured from when the device could have started on this
+         * frame: its submit time, or the previous completion if it was still busy.
+         */
+
+        double now = monotonicTime();
+        double sample = now - std::max(frame->submitTime, mLastCompleteTime);
+
+        mServiceTime = mServiceTime ? mServiceTime + (sample - mServiceTime) * SERVICE_TIME_ALPHA : sample;
+        mLastCompleteTime = now;
+        mFramesCompleted++;
+
+        FrameTimes &times = mFrameTimes[frame->sequence % SEQUENCE_HISTORY];
+        times.completed = now;
+
+        if (mTracer) {
+            mTracer->record(this, LatencyTracer::STAGE_HOLD, frame->sequence, times.received, times.queued);
+            mTracer->record(this, LatencyTracer::STAGE_QUEUE, frame->sequence, times.queued, t->submitTime);
+            mTracer->record(this, LatencyTracer::STAGE_USB, frame->sequence, t->submitTime, now);
+            if (!mStatusTransfer) {
+                // No frame status, so this is as far as we can follow the frame
+                mTracer->record(this, LatencyTracer::STAGE_TOTAL, frame->sequence, times.received, now);
+            } else if (times.presented) {
+                // Status packet beat the completion callback here
+                mTracer->record(this, LatencyTracer::STAGE_DEVICE, frame->sequence, times.presented, times.presented);
+                mTracer->record(this, LatencyTracer::STAGE_TOTAL, frame->sequence, times.received, times.presented);
+            }
+        }
 
-    if (self) {
-        self->mPending.erase(fct);
+    } else if (t->transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+        // Superseded by a newer frame before it was sent
+        mFramesDropped++;
     }
 
-    delete fct;
+    if (mFrameDeferred) {
+        // Device has room now, send the frame we held back
+        writeFramebuffer();
+    }
 }
 
 void FCDevice::writeColorCorrection(const Value &color)
@@ -259,23 +345,104 @@ void FCDevice::writeColorCorrection(const Value &color)
     }
 
     // Start asynchronously sending the LUT.
-    submitTransfer(new Transfer(this, &mColorLUT, sizeof mColorLUT));
+    submitTransfer(new Transfer(this, OUT_ENDPOINT, &mColorLUT, sizeof mColorLUT, CLASS_LUT));
 }
 
 void FCDevice::writeFramebuffer()
 {
     /*
-     * Asynchronously write the current framebuffer.
-     * Note that the OS will copy our framebuffer at submit-time.
+     * Asynchronously write the current framebuffer, and move the mapper on to a
+     * free frame in the ring. The submitted frame belongs to the transfer until it
+     * finishes, since with device memory the controller reads it in place.
      *
-     * XXX: To-do, flow control. If more than one frame is pending, we need to be able to
-     *      tell clients that we're going too fast, *or* we need to drop frames.
+     * If we're going faster than the device, the transfer engine keeps only the
+     * newest queued frame. That frees the one it supersedes, so there is always
+     * a free frame here.
+     */
+
+    static_assert(FRAMEBUFFER_RING >= MAX_PENDING + 2, "Framebuffer ring too small");
+
+    if (!mFramebuffer) {
+        return;
+    }
+
+    double now = monotonicTime();
+    bool tooFast = mFramesInFlight && now - mLastSubmitTime < mServiceTime;
+
+    /*
+     * With frame status, also hold back while too many frames are still on their way to
+     * the LEDs. If status packets stop coming, fall back on the service time alone.
      */
+    bool tooFar = mFramesPresented && now - mLastPresentTime < STATUS_TIMEOUT &&
+        uint16_t(mNextSequence - 1 - mLastPresented) >= MAX_UNPRESENTED;
+
+    if (tooFast || tooFar) {
+        // Hold this frame until a transfer finishes or a frame is presented.
+        if (mFrameDeferred) {
+            mFramesDropped++;
+        }
+        mFrameDeferred = true;
+
+        if (tooFar && eventLoop()) {
+            /*
+             * The firmware drops status packets when it's busy, and nothing may be in
+             * flight to wake us. Try again when the status timeout runs out.
+             */
+            ev_timer_stop(eventLoop(), &mDeferTimer);
+            ev_timer_set(&mDeferTimer, mLastPresentTime + STATUS_TIMEOUT - now, 0);
+            ev_timer_start(eventLoop(), &mDeferTimer);
+        }
+        return;
+    }
 
-    submitTransfer(new Transfer(this, &mFramebuffer, sizeof mFramebuffer));
+    const size_t frameSize = sizeof(Packet) * FRAMEBUFFER_PACKETS;
+    Frame &current = mFrames[mCurrentFrame];
+
+    // Frame sequence number goes in the unused end of the final packet
+    Packet &final = current.packets[FRAMEBUFFER_PACKETS - 1];
+    uint16_t sequence = mNextSequence++;
+    final.data[sizeof final.data - 2] = uint8_t(sequence);
+    final.data[sizeof final.data - 1] = uint8_t(sequence >> 8);
+
+    FrameTimes &times = mFrameTimes[sequence % SEQUENCE_HISTORY];
+    times.received = mFrameReceived ? mFrameReceived : now;
+    times.queued = now;
+    times.completed = 0;
+    times.presented = 0;
+    mFrameReceived = 0;
+
+    mFrameDeferred = false;
+    if (eventLoop()) {
+        ev_timer_stop(eventLoop(), &mDeferTimer);
+    }
+    mLastSubmitTime = now;
+    mFramesSubmitted++;
+    mFramesInFlight++;
+    current.pending = true;
+    current.submitTime = now;
+    current.sequence = sequence;
+    submitTransfer(new Transfer(this, OUT_ENDPOINT, current.packets, frameSize, CLASS_FRAME, &current));
+
+    for (unsigned i = 1; i < FRAMEBUFFER_RING; ++i) {
+        unsigned nextIndex = (mCurrentFrame + i) % FRAMEBUFFER_RING;
+        Frame &next = mFrames[nextIndex];
+
+        if (!next.pending) {
+            // OPC messages may update only part of the frame, so carry the rest forward.
+            memcpy(next.packets, current.packets, frameSize);
+            mCurrentFrame = nextIndex;
+            mFramebuffer = next.packets;
+            return;
+        }
+    }
 }
 
-void FCDevice::writeMessage(const OPCSink::Message &msg)
+void FCDevice::writeFrame()
+{
+    writeFramebuffer();
+}
+
+void FCDevice::writeMessage(const OPCSink::Message &msg, unsigned listener)
 {
     /*
      * Dispatch an incoming OPC command
@@ -284,8 +451,11 @@ void FCDevice::writeMessage(const OPCSink::Message &msg)
     switch (msg.command) {
 
         case OPCSink::SetPixelColors:
-            opcSetPixelColors(msg);
-            writeFramebuffer();
+            if (!mFrameReceived) {
+                mFrameReceived = msg.receiveTime;
+            }
+            opcSetPixelColors(msg, listener);
+            frameChanged();
             return;
 
         case OPCSink::SystemExclusive:
@@ -300,19 +470,14 @@ void FCDevice::writeMessage(const OPCSink::Message &msg)
 
 void FCDevice::opcSysEx(const OPCSink::Message &msg)
 {
-    if (msg.length() < 4) {
+    if (msg.length() < OPCSink::SYSEX_ID_LENGTH) {
         if (mVerbose) {
             std::clog << "SysEx message too short!\n";
         }
         return;
     }
 
-    unsigned id = (unsigned(msg.data[0]) << 24) |
-                  (unsigned(msg.data[1]) << 16) |
-                  (unsigned(msg.data[2]) << 8)  |
-                   unsigned(msg.data[3])        ;
-
-    switch (id) {
+    switch (OPCSink::sysExId(msg)) {
 
         case OPCSink::FCSetGlobalColorCorrection:
             return opcSetGlobalColorCorrection(msg);
@@ -325,19 +490,20 @@ void FCDevice::opcSysEx(const OPCSink::Message &msg)
     // Quietly ignore unhandled SysEx messages.
 }
 
-void FCDevice::opcSetPixelColors(const OPCSink::Message &msg)
+void FCDevice::opcSetPixelColors(const OPCSink::Message &msg, unsigned listener)
 {
     /*
-     * Parse through our device's mapping, and store any relevant portions of 'msg'
-     * in the framebuffer.
+     * Parse through our device's mapping for this listener, and store any relevant
+     * portions of 'msg' in the framebuffer.
      */
 
-    if (!mConfigMap) {
-        // No mapping defined yet. This device is inactive.
+    const Value *mapPtr = listener < mConfigMaps.size() ? mConfigMaps[listener] : 0;
+    if (!mapPtr) {
+        // No mapping defined. This device is inactive for this listener.
         return;
     }
 
-    const Value &map = *mConfigMap;
+    const Value &map = *mapPtr;
     for (unsigned i = 0, e = map.Size(); i != e; i++) {
         opcMapPixelColors(msg, map[i]);
     }
@@ -351,10 +517,27 @@ void FCDevice::opcMapPixelColors(const OPCSink::Message &msg, const Value &inst)
      * recognize:
      *
      *   [ OPC Channel, First OPC Pixel, First output pixel, pixel count ]
+     *   { "canvas": OPC Channel, ... }, compiled ahead of time into a CanvasMap
      */
 
     unsigned msgPixelCount = msg.length() / 3;
 
+    if (inst.IsObject()) {
+        for (unsigned i = 0; i < mCanvasMaps.size(); ++i) {
+            CanvasMap &map = *mCanvasMaps[i];
+            if (map.instruction() != &inst) {
+                continue;
+            }
+
+            // The whole image, or nothing
+            if (map.channel() == msg.channel && msgPixelCount >= map.width() * map.height()) {
+                Canvas canvas = { msg.channel, map.width(), map.height(), map.width() * 3, msg.data };
+                writeCanvasMap(map, canvas);
+            }
+            return;
+        }
+    }
+
     if (inst.IsArray() && inst.Size() == 4) {
         // Map a range from an OPC channel to our framebuffer
 
@@ -401,6 +584,81 @@ void FCDevice::opcMapPixelColors(const OPCSink::Message &msg, const Value &inst)
     }
 }
 
+void FCDevice::writeCanvas(const Canvas &canvas)
+{
+    /*
+     * A whole frame from a video file. It goes through the same canvas
+     * instructions as images on OPC channels, from the default map.
+     */
+
+    const Value *mapPtr = mConfigMaps.empty() ? 0 : mConfigMaps[0];
+    if (!mapPtr || !mFramebuffer) {
+        return;
+    }
+
+    const Value &map = *mapPtr;
+    bool changed = false;
+
+    for (unsigned i = 0, e = map.Size(); i != e; i++) {
+        for (unsigned j = 0; j < mCanvasMaps.size(); ++j) {
+            CanvasMap &canvasMap = *mCanvasMaps[j];
+            if (canvasMap.instruction() == &map[i] && canvasMap.channel() == canvas.channel) {
+                writeCanvasMap(canvasMap, canvas);
+                changed = true;
+            }
+        }
+    }
+
+    if (changed) {
+        if (!mFrameReceived) {
+            mFrameReceived = monotonicTime();
+        }
+        frameChanged();
+    }
+}
+
+void FCDevice::writeCanvasMap(CanvasMap &map, const Canvas &canvas)
+{
+    // Sample the whole layout, then copy the part that fits on this device
+    if (!map.count()) {
+        return;
+    }
+    mCanvasPixels.resize(map.count() * 3);
+    map.sample(canvas, &mCanvasPixels[0]);
+
+    unsigned first = std::min<unsigned>(map.firstOutput(), NUM_PIXELS);
+    unsigned count = std::min<unsigned>(map.count(), NUM_PIXELS - first);
+    const uint8_t *inPtr = &mCanvasPixels[0];
+
+    for (unsigned i = 0; i < count; ++i, inPtr += 3) {
+        uint8_t *outPtr = fbPixel(first + i);
+        outPtr[0] = inPtr[0];
+        outPtr[1] = inPtr[1];
+        outPtr[2] = inPtr[2];
+    }
+}
+
+void FCDevice::writeTestPattern(const TestPattern &pattern)
+{
+    /*
+     * Straight into the framebuffer, one pixel for each output. It goes out like
+     * any other frame, so frames we can't keep up with are dropped.
+     */
+
+    if (!mFramebuffer) {
+        return;
+    }
+
+    for (unsigned i = 0; i < NUM_PIXELS; ++i) {
+        pattern.pixel(i, fbPixel(i));
+    }
+
+    if (!mFrameReceived) {
+        mFrameReceived = monotonicTime();
+    }
+    frameChanged();
+}
+
 void FCDevice::opcSetGlobalColorCorrection(const OPCSink::Message &msg)
 {
     /*
@@ -409,7 +667,7 @@ void FCDevice::opcSetGlobalColorCorrection(const OPCSink::Message &msg)
      */
 
     // Mutable NUL-terminated copy of the message string
-    std::string text((char*)msg.data + 4, msg.length() - 4);
+    std::string text((char*)msg.data + OPCSink::SYSEX_ID_LENGTH, msg.length() - OPCSink::SYSEX_ID_LENGTH);
     if (mVerbose) {
         std::clog << "New global color correction settings: " << text << "\n";
     }
@@ -439,17 +697,23 @@ void FCDevice::opcSetFirmwareConfiguration(const OPCSink::Message &msg)
      * Raw firmware configuration packet
      */
 
-    memcpy(mFirmwareConfig.data, msg.data + 4, std::min<size_t>(sizeof mFirmwareConfig.data, msg.length() - 4));
+    memcpy(mFirmwareConfig.data, msg.data + OPCSink::SYSEX_ID_LENGTH,
+        std::min<size_t>(sizeof mFirmwareConfig.data, msg.length() - OPCSink::SYSEX_ID_LENGTH));
     writeFirmwareConfiguration();
 }
 
 void FCDevice::writeFirmwareConfiguration()
 {
     /*
-     * Write mFirmwareConfig to the device, and log it.
+     * Write mFirmwareConfig to the device, and log it. Frame status stays on
+     * even if an OPC client sends its own configuration.
      */
 
-    submitTransfer(new Transfer(this, &mFirmwareConfig, sizeof mFirmwareConfig));
+    if (hasFrameStatus()) {
+        mFirmwareConfig.data[0] |= CFLAG_FRAME_STATUS;
+    }
+
+    submitTransfer(new Transfer(this, OUT_ENDPOINT, &mFirmwareConfig, sizeof mFirmwareConfig, CLASS_CONFIG));
 
     if (mVerbose) {
         std::clog << "New Fadecandy firmware configuration:";
@@ -466,6 +730,138 @@ void FCDevice::writeFirmwareConfiguration()
     }
 }
 
+void FCDevice::deviceWasReset()
+{
+    // The firmware starts over with default settings and an identity LUT
+    writeFirmwareConfiguration();
+    startFrameStatus();
+    submitTransfer(new Transfer(this, OUT_ENDPOINT, &mColorLUT, sizeof mColorLUT, CLASS_LUT));
+}
+
+bool FCDevice::hasFrameStatus()
+{
+    return mDD.bcdDevice >= FRAME_STATUS_VERSION;
+}
+
+void FCDevice::startFrameStatus()
+{
+    /*
+     * Keep one interrupt transfer waiting on the status endpoint. It's resubmitted
+     * each time it completes. If it fails, we carry on without frame status until
+     * the next reset.
+     */
+
+    if (mStatusTransfer || !hasFrameStatus() || !mHandle) {
+        // Emulated devices report presented frames directly
+        return;
+    }
+
+    mStatusTransfer = libusb_alloc_transfer(0);
+    libusb_fill_interrupt_transfer(mStatusTransfer, mHandle, IN_ENDPOINT,
+        (uint8_t*) malloc(STATUS_PACKET_SIZE), STATUS_PACKET_SIZE, cbFrameStatus, this, 0);
+    mStatusTransfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+
+    int r = libusb_submit_transfer(mStatusTransfer);
+    if (r < 0) {
+        if (mVerbose) {
+            std::clog << "Can't receive frame status from " << getName() << ": "
+                << libusb_strerror(libusb_error(r)) << "\n";
+        }
+        libusb_free_transfer(mStatusTransfer);
+        mStatusTransfer = 0;
+    }
+}
+
+void FCDevice::cbFrameStatus(struct libusb_transfer *transfer)
+{
+    FCDevice *self = static_cast<FCDevice*>(transfer->user_data);
+
+    if (self && transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        const uint8_t *p = transfer->buffer;
+        if (transfer->actual_length >= int(STATUS_PACKET_SIZE) && p[0] == STATUS_FRAME_PRESENTED) {
+            self->framePresented(p[2] | (p[3] << 8), p[4] | (p[5] << 8) | (p[6] << 16) | (uint32_t(p[7]) << 24));
+        }
+        if (libusb_submit_transfer(transfer) == 0) {
+            return;
+        }
+    }
+
+    // Device is gone, or the endpoint failed
+    if (self) {
+        self->mStatusTransfer = 0;
+    }
+    libusb_free_transfer(transfer);
+}
+
+void FCDevice::cbDeferTimer(struct ev_loop *loop, ev_timer *w, int revents)
+{
+    FCDevice *self = static_cast<FCDevice*>(w->data);
+    if (self->mFrameDeferred) {
+        self->writeFramebuffer();
+    }
+}
+
+void FCDevice::framePresented(uint16_t sequence, uint32_t timestamp)
+{
+    double now = monotonicTime();
+
+    // Latency from writeFramebuffer() to the frame taking effect, if it's still in our history
+    if (uint16_t(mNextSequence - sequence) <= SEQUENCE_HISTORY) {
+        FrameTimes &times = mFrameTimes[sequence % SEQUENCE_HISTORY];
+        times.presented = now;
+        double latency = now - times.queued;
+        mPresentLatency = mPresentLatency ? mPresentLatency + (latency - mPresentLatency) * SERVICE_TIME_ALPHA : latency;
+        mPresentLatencyMax = std::max(mPresentLatencyMax, latency);
+
+        if (mTracer && times.completed) {
+            mTracer->record(this, LatencyTracer::STAGE_DEVICE, sequence, times.completed, now);
+            mTracer->record(this, LatencyTracer::STAGE_TOTAL, sequence, times.received, now);
+        }
+    }
+
+    if (mFramesPresented) {
+        if (mTracer) {
+            // The previous frame was faded in until this one took over
+            mTracer->record(this, LatencyTracer::STAGE_INTERPOLATE, mLastPresented, mLastPresentTime, now);
+        }
+
+        double interval = uint32_t(timestamp - mLastDeviceTimestamp) * 1e-6;
+        mDeviceFrameInterval = mDeviceFrameInterval ?
+            mDeviceFrameInterval + (interval - mDeviceFrameInterval) * SERVICE_TIME_ALPHA : interval;
+    }
+
+    mLastPresented = sequence;
+    mLastPresentTime = now;
+    mLastDeviceTimestamp = timestamp;
+    mFramesPresented++;
+
+    if (mFrameDeferred) {
+        // There may be room for the frame we held back
+        writeFramebuffer();
+    }
+}
+
+void FCDevice::writeStatus(StatusWriter &w)
+{
+    USBDevice::writeStatus(w);
+
+    const double frameBytes = sizeof(Packet) * FRAMEBUFFER_PACKETS;
+
+    w.String("frameServiceTime").Double(mServiceTime);
+    w.String("maxFrameRate").Double(mServiceTime ? 1.0 / mServiceTime : 0.0);
+    w.String("throughput").Double(mServiceTime ? frameBytes / mServiceTime : 0.0);
+    w.String("framesSubmitted").Uint64(mFramesSubmitted);
+    w.String("framesCompleted").Uint64(mFramesCompleted);
+    w.String("framesDropped").Uint64(mFramesDropped);
+
+    if (hasFrameStatus()) {
+        w.String("framesPresented").Uint64(mFramesPresented);
+        w.String("presentLatency").Double(mPresentLatency);
+        w.String("presentLatencyMax").Double(mPresentLatencyMax);
+        w.String("deviceFrameInterval").Double(mDeviceFrameInterval);
+    }
+}
+
 std::string FCDevice::getName()
 {
     std::ostringstream s;
@@ -23,7 +23,6 @@
 
 #pragma once
 #include "usbdevice.h"
-#include <set>
 
 
 class FCDevice : public USBDevice
@@ -35,14 +34,17 @@ public:
     static bool probe(libusb_device *device);
 
     virtual int open();
-    virtual bool matchConfiguration(const Value &config);
-    virtual void writeMessage(const OPCSink::Message &msg);
+    virtual void loadConfiguration(const Config &config);
+    virtual void writeMessage(const OPCSink::Message &msg, unsigned listener);
     virtual void writeColorCorrection(const Value &color);
+    virtual void writeTestPattern(const TestPattern &pattern);
+    virtual void writeCanvas(const Canvas &canvas);
+    virtual void writeStatus(StatusWriter &w);
     virtual std::string getName();
 
     static const unsigned NUM_PIXELS = 512;
-
-    const char *getSerial() { return mSerial; }
+    static const unsigned NUM_STRIPS = 8;
+    static const unsigned LEDS_PER_STRIP = NUM_PIXELS / NUM_STRIPS;
 
     // Send current buffer contents
     void writeFramebuffer();
@@ -52,13 +54,17 @@ public:
         return &mFramebuffer[num / PIXELS_PER_PACKET].data[3 * (num % PIXELS_PER_PACKET)];
     }
  
-private:
+protected:
     static const unsigned PIXELS_PER_PACKET = 21;
     static const unsigned LUT_ENTRIES_PER_PACKET = 31;
     static const unsigned FRAMEBUFFER_PACKETS = 25;
+    static const unsigned FRAMEBUFFER_RING = 4;
     static const unsigned LUT_PACKETS = 25;
     static const unsigned LUT_ENTRIES = 257;
     static const unsigned OUT_ENDPOINT = 1;
+    static const unsigned IN_ENDPOINT = 0x82;
+    static const unsigned STATUS_PACKET_SIZE = 8;
+    static const unsigned FRAME_STATUS_VERSION = 0x0105;    // First firmware with frame status packets
 
     static const uint8_t TYPE_FRAMEBUFFER = 0x00;
     static const uint8_t TYPE_LUT = 0x40;
@@ -69,36 +75,109 @@ private:
     static const uint8_t CFLAG_NO_INTERPOLATION = (1 << 1);
     static const uint8_t CFLAG_NO_ACTIVITY_LED  = (1 << 2);
     static const uint8_t CFLAG_LED_CONTROL      = (1 << 3);
+    static const uint8_t CFLAG_FRAME_STATUS     = (1 << 4);
+
+    static const uint8_t STATUS_FRAME_PRESENTED = 0x01;
+
+    // Frames we may send ahead of the last one the device reported as presented
+    static const unsigned MAX_UNPRESENTED = 2;
+
+    // Frame times kept for matching up with frame status packets
+    static const unsigned SEQUENCE_HISTORY = 16;
 
     struct Packet {
         uint8_t control;
         uint8_t data[63];
     };
 
-    struct Transfer {
-        Transfer(FCDevice *device, void *buffer, int length);
-        ~Transfer();
-        libusb_transfer *transfer;
-        FCDevice *device;
+    struct Frame {
+        Packet *packets;
+        bool pending;           // Owned by an in-flight transfer
+        double submitTime;
+        uint16_t sequence;
+    };
+
+    // Lifecycle of one frame, for latency tracing. Times from monotonicTime().
+    struct FrameTimes {
+        double received;        // Oldest OPC message in the frame
+        double queued;          // writeFramebuffer() sent it
+        double completed;       // 0 until the transfer completes
+        double presented;       // 0 until the device reports it
     };
 
-    const Value *mConfigMap;
-    std::set<Transfer*> mPending;
+    // Weight of each new sample in the frame service time average
+    static const double SERVICE_TIME_ALPHA;
+
+    // Seconds without frame status before we stop waiting on it
+    static const double STATUS_TIMEOUT;
+
+    std::vector<const Value*> mConfigMaps;
+    std::vector<CanvasMap*> mCanvasMaps;
+    std::vector<uint8_t> mCanvasPixels;
 
-    char mSerial[256];
     libusb_device_descriptor mDD;
-    Packet mFramebuffer[FRAMEBUFFER_PACKETS];
+
+    /*
+     * Ring of framebuffers in transfer memory. The mapper writes directly into
+     * mFramebuffer, which is always the one frame in the ring that isn't pending.
+     */
+    Frame mFrames[FRAMEBUFFER_RING];
+    unsigned mCurrentFrame;
+    Packet *mFramebuffer;
+    uint8_t *mFrameMemory;
+    bool mFrameDeviceMemory;
+
+    /*
+     * Frame rate control. We keep a moving average of how long the device takes to
+     * accept each frame. If frames arrive faster than that while one is in flight,
+     * the newest is held back until the device catches up, and any it replaces are
+     * dropped. This keeps a slow device from building up a queue of stale frames.
+     */
+    double mServiceTime;        // Seconds per frame, 0 until measured
+    double mLastSubmitTime;
+    double mLastCompleteTime;
+    unsigned mFramesInFlight;
+    bool mFrameDeferred;
+    uint64_t mFramesSubmitted;
+    uint64_t mFramesCompleted;
+    uint64_t mFramesDropped;
+
+    /*
+     * Frame status. Newer firmware tells us when each frame takes effect. That lets us
+     * limit how many frames are on their way to the LEDs, and measure latency from
+     * our submission all the way to the device.
+     */
+    libusb_transfer *mStatusTransfer;
+    uint16_t mNextSequence;
+    uint16_t mLastPresented;
+    FrameTimes mFrameTimes[SEQUENCE_HISTORY];
+    double mFrameReceived;          // Oldest message not yet in a sent frame, 0 if none
+    double mLastPresentTime;
+    double mPresentLatency;         // Moving average, seconds
+    double mPresentLatencyMax;
+    uint32_t mLastDeviceTimestamp;
+    double mDeviceFrameInterval;    // Moving average, seconds, by the device's clock
+    uint64_t mFramesPresented;
+    ev_timer mDeferTimer;           // Retries a frame held back for frame status
     Packet mColorLUT[LUT_PACKETS];
     Packet mFirmwareConfig;
 
-    void submitTransfer(Transfer *fct);
+    bool allocFramebuffers();
     void configureDevice(const Value &config);
     void writeFirmwareConfiguration();
-    static void completeTransfer(struct libusb_transfer *transfer);
-
-    void opcSetPixelColors(const OPCSink::Message &msg);
+    virtual void transferFinished(Transfer *t);
+    bool hasFrameStatus();
+    void startFrameStatus();
+    void framePresented(uint16_t sequence, uint32_t timestamp);
+    static void cbFrameStatus(struct libusb_transfer *transfer);
+    static void cbDeferTimer(struct ev_loop *loop, ev_timer *w, int revents);
+    virtual void deviceWasReset();
+    virtual void writeFrame();
+
+    void opcSetPixelColors(const OPCSink::Message &msg, unsigned listener);
     void opcSysEx(const OPCSink::Message &msg);
     void opcSetGlobalColorCorrection(const OPCSink::Message &msg);
     void opcSetFirmwareConfiguration(const OPCSink::Message &msg);
     void opcMapPixelColors(const OPCSink::Message &msg, const Value &inst);
+    void writeCanvasMap(CanvasMap &map, const Canvas &canvas);
 };
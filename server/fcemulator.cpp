@@ -0,0 +1,202 @@
+/*
+ * Host-side emulation of the Fadecandy firmware's rendering pipeline
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "fcemulator.h"
+#include <string.h>
+#include <algorithm>
+
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+typedef int32_t i32x4 __attribute__((vector_size(16)));
+
+
+FCEmulator::FCEmulator()
+    : mPrev(&mFramebuffers[0]),
+      mNext(&mFramebuffers[1]),
+      mNew(&mFramebuffers[2]),
+      mFlags(0),
+      mActiveLength(LEDS_PER_STRIP),
+      mActiveStrips(NUM_STRIPS),
+      mNewSequence(0)
+{
+    // Like the firmware, everything starts out zeroed, including the LUT
+    memset(mFramebuffers, 0, sizeof mFramebuffers);
+    memset(mLUTPackets, 0, sizeof mLUTPackets);
+    memset(mLUT, 0, sizeof mLUT);
+    memset(mResidual, 0, sizeof mResidual);
+}
+
+bool FCEmulator::handlePacket(const uint8_t *packet, uint32_t millis)
+{
+    unsigned control = packet[0];
+    unsigned index = control & 0x1F;
+    bool final = control & 0x20;
+
+    switch (control & 0xC0) {
+
+        case 0x00:      // Framebuffer
+            if (index < FRAMEBUFFER_PACKETS) {
+                unsigned first = index * PIXELS_PER_PACKET;
+                unsigned count = std::min(PIXELS_PER_PACKET, NUM_PIXELS - std::min(first, NUM_PIXELS));
+                memcpy(mNew->pixels + first * 3, packet + 1, count * 3);
+            }
+            if (final) {
+                mNewSequence = packet[62] | (packet[63] << 8);
+
+                Framebuffer *recycle = mPrev;
+                mNew->timestamp = millis;
+                mPrev = mNext;
+                mNext = mNew;
+                mNew = recycle;
+                return true;
+            }
+            return false;
+
+        case 0x40:      // LUT
+            if (index < LUT_PACKETS) {
+                memcpy(mLUTPackets[index], packet, PACKET_SIZE);
+            }
+            if (final) {
+                finalizeLUT();
+            }
+            return false;
+
+        case 0x80:      // Configuration
+            mFlags = packet[1];
+            mActiveLength = packet[2] ? std::min<unsigned>(packet[2], LEDS_PER_STRIP) : LEDS_PER_STRIP;
+            mActiveStrips = packet[3] ? std::min<unsigned>(packet[3], NUM_STRIPS) : NUM_STRIPS;
+            return false;
+    }
+
+    return false;
+}
+
+void FCEmulator::finalizeLUT()
+{
+    // Little-endian entries, starting after the control byte and a padding byte
+    for (unsigned i = 0; i < LUT_CH_SIZE * 3; ++i) {
+        const uint8_t *p = &mLUTPackets[i / LUT_ENTRIES_PER_PACKET][2 + (i % LUT_ENTRIES_PER_PACKET) * 2];
+        mLUT[i] = p[0] | (p[1] << 8);
+    }
+}
+
+uint32_t FCEmulator::interpCoefficient(uint32_t millis) const
+{
+    /*
+     * Fixed point, from 0x0000 (all fbPrev) to 0x10000 (all fbNext). The firmware's
+     * clock has millisecond resolution. If two frames arrive within the same
+     * millisecond, the Cortex-M4 divides by zero and gets zero.
+     */
+
+    if (mFlags & CFLAG_NO_INTERPOLATION) {
+        return 0x10000;
+    }
+
+    uint32_t tsDiff = mNext->timestamp - mPrev->timestamp;
+    uint32_t tsElapsed = millis - mNext->timestamp;
+
+    return tsDiff ? (std::min(tsElapsed, tsDiff) << 16) / tsDiff : 0;
+}
+
+void FCEmulator::draw(uint32_t millis, uint8_t *rgb)
+{
+    /*
+     * Only active strips are rendered, and only the active length of each one is
+     * updated. LEDs past the end keep whatever they last showed, and strips past
+     * the active count are dark.
+     */
+
+    const uint32_t coefficient = interpCoefficient(millis);
+    const uint32_t icPrev = 257 * (0x10000 - coefficient);
+    const uint32_t icNext = 257 * coefficient;
+    const unsigned stripChannels = LEDS_PER_STRIP * 3;
+    const unsigned channels = mActiveStrips * stripChannels;
+    const unsigned activeChannels = mActiveLength * 3;
+
+    // Interpolate framebuffers, converting to 16-bit color
+    const u32x4 vPrev = { icPrev, icPrev, icPrev, icPrev };
+    const u32x4 vNext = { icNext, icNext, icNext, icNext };
+    const uint8_t *prev = mPrev->pixels;
+    const uint8_t *next = mNext->pixels;
+
+    for (unsigned i = 0; i < channels; i += 4) {
+        u32x4 p = { prev[i], prev[i + 1], prev[i + 2], prev[i + 3] };
+        u32x4 n = { next[i], next[i + 1], next[i + 2], next[i + 3] };
+        *(u32x4*)(mInterpolated + i) = (p * vPrev + n * vNext) >> 16;
+    }
+
+    // Color LUT, with linear interpolation between entries
+    for (unsigned i = 0; i < channels; i += 3) {
+        for (unsigned c = 0; c < 3; ++c) {
+            const uint16_t *lut = mLUT + c * LUT_CH_SIZE;
+            uint32_t arg = mInterpolated[i + c];
+            unsigned index = arg >> 8;
+            unsigned alpha = arg & 0xFF;
+            mCorrected[i + c] = (lut[index] * (0x100 - alpha) + lut[index + 1] * alpha) >> 8;
+        }
+    }
+
+    /*
+     * Add the residual from the last refresh, round to 8 bits with clamping, and keep
+     * the new error. Masks stand in for the firmware's USAT instruction.
+     */
+    const i32x4 vRound = { 0x80, 0x80, 0x80, 0x80 };
+    const i32x4 vMax = { 0xFFFF, 0xFFFF, 0xFFFF, 0xFFFF };
+    const i32x4 vZero = { 0, 0, 0, 0 };
+    const i32x4 v257 = { 257, 257, 257, 257 };
+
+    for (unsigned strip = 0; strip < mActiveStrips; ++strip) {
+        unsigned base = strip * stripChannels;
+
+        for (unsigned i = 0; i < activeChannels; i += 4) {
+            unsigned c = base + i;
+            i32x4 residual = { mResidual[c], mResidual[c + 1], mResidual[c + 2], mResidual[c + 3] };
+            i32x4 v = *(i32x4*)(mCorrected + c) + residual;
+
+            i32x4 rounded = v + vRound;
+            rounded &= ~(rounded < vZero);
+            i32x4 over = rounded > vMax;
+            rounded = (rounded & ~over) | (vMax & over);
+            i32x4 out = rounded >> 8;
+            i32x4 error = v - out * v257;
+
+            // The last group may run past the active length. Leave those LEDs alone.
+            unsigned count = std::min(4u, activeChannels - i);
+            for (unsigned j = 0; j < count; ++j) {
+                rgb[c + j] = out[j];
+                mResidual[c + j] = error[j];
+            }
+        }
+    }
+
+    memset(rgb + channels, 0, NUM_CHANNELS - channels);
+
+    if (mFlags & CFLAG_NO_DITHERING) {
+        memset(mResidual, 0, sizeof mResidual);
+    }
+}
+
+double FCEmulator::refreshInterval() const
+{
+    // 24 bits per LED at 800 kHz, all strips in parallel, then 50us to latch
+    return mActiveLength * 30e-6 + 50e-6;
+}
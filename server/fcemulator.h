@@ -0,0 +1,100 @@
+/*
+ * Host-side emulation of the Fadecandy firmware's rendering pipeline
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+
+
+/*
+ * Takes the same 64-byte USB packets the firmware does, and renders what the LEDs
+ * would show: keyframe interpolation, the color LUT, and temporal dithering, with
+ * the firmware's fixed-point arithmetic, so the results match bit for bit. See
+ * handleUSB() in firmware/fc_usb.cpp and updatePixel() in firmware/fadecandy.cpp.
+ *
+ * The firmware does one pixel at a time. Here each stage runs over every channel
+ * before the next, with the interpolation and dithering stages four channels at a
+ * time using compiler vector extensions. Only the LUT lookup is scalar.
+ */
+
+class FCEmulator
+{
+public:
+    static const unsigned NUM_STRIPS = 8;
+    static const unsigned LEDS_PER_STRIP = 64;
+    static const unsigned NUM_PIXELS = NUM_STRIPS * LEDS_PER_STRIP;
+    static const unsigned NUM_CHANNELS = NUM_PIXELS * 3;
+    static const unsigned PACKET_SIZE = 64;
+
+    static const uint8_t CFLAG_NO_DITHERING     = (1 << 0);
+    static const uint8_t CFLAG_NO_INTERPOLATION = (1 << 1);
+    static const uint8_t CFLAG_FRAME_STATUS     = (1 << 4);
+
+    FCEmulator();
+
+    // File one USB packet. Returns true if it finished a frame, which is now the one we fade toward.
+    bool handlePacket(const uint8_t *packet, uint32_t millis);
+
+    // Render one refresh. 'rgb' has 3 bytes for each LED, by strip and then position.
+    void draw(uint32_t millis, uint8_t *rgb);
+
+    // Seconds the WS2811 data and reset take, for each refresh
+    double refreshInterval() const;
+
+    uint8_t flags() const { return mFlags; }
+    unsigned activeLength() const { return mActiveLength; }
+    unsigned activeStrips() const { return mActiveStrips; }
+    uint16_t frameSequence() const { return mNewSequence; }
+
+private:
+    static const unsigned PIXELS_PER_PACKET = 21;
+    static const unsigned FRAMEBUFFER_PACKETS = 25;
+    static const unsigned LUT_CH_SIZE = 257;
+    static const unsigned LUT_ENTRIES_PER_PACKET = 31;
+    static const unsigned LUT_PACKETS = 25;
+
+    struct Framebuffer {
+        uint8_t pixels[NUM_CHANNELS] __attribute__((aligned(16)));
+        uint32_t timestamp;
+    };
+
+    Framebuffer mFramebuffers[3];
+    Framebuffer *mPrev;         // Frame we're interpolating from
+    Framebuffer *mNext;         // Frame we're interpolating to
+    Framebuffer *mNew;          // Partial frame
+
+    uint8_t mLUTPackets[LUT_PACKETS][PACKET_SIZE];
+    uint16_t mLUT[LUT_CH_SIZE * 3];
+
+    uint8_t mFlags;
+    uint8_t mActiveLength;
+    uint8_t mActiveStrips;
+    uint16_t mNewSequence;
+
+    // Per-channel state and scratch space for each stage
+    int8_t mResidual[NUM_CHANNELS];
+    uint32_t mInterpolated[NUM_CHANNELS] __attribute__((aligned(16)));
+    int32_t mCorrected[NUM_CHANNELS] __attribute__((aligned(16)));
+
+    uint32_t interpCoefficient(uint32_t millis) const;
+    void finalizeLUT();
+};
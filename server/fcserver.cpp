@@ -26,74 +26,649 @@
 #include "usbdevice.h"
 #include "fcdevice.h"
 #include "enttecdmxdevice.h"
+#include "virtualdevice.h"
 #include <netdb.h>
+#include <arpa/inet.h>
 #include <ctype.h>
 #include <iostream>
+#include <algorithm>
 
 
 FCServer::FCServer(rapidjson::Document &config)
-    : mListen(config["listen"]),
-      mColor(config["color"]),
+    : mColor(config["color"]),
       mDevices(config["devices"]),
       mVerbose(config["verbose"].IsTrue()),
-      mListenAddr(0),
-      mOPCSink(cbMessage, this, mVerbose),
-      mUSB(0)
+      mIOUring(config["ioUring"].IsTrue()),
+      mPatternMessage(0),
+      mLoop(0),
+      mUSB(0),
+      mUSBScheduler(mVerbose),
+      mSharded(false)
 {
     /*
-     * Parse the listen [host, port] list.
+     * Listening sockets. The original single 'listen' [host, port] list is still
+     * supported, alongside a 'listeners' list of objects for multiple sockets.
      */
 
-    if (mListen.IsArray() && mListen.Size() == 2) {
-        const Value &host = mListen[0u];
-        const Value &port = mListen[1];
-        const char *hostStr = 0;
-        std::ostringstream portStr;
+    const Value &listen = config["listen"];
+    const Value &listeners = config["listeners"];
 
-        if (host.IsString()) {
-            hostStr = host.GetString();
-        } else if (!host.IsNull()) {
-            mError << "Hostname in 'listen' must be null (any) or a hostname string.\n";
+    if (!listen.IsNull()) {
+        Listener *l = new Listener(this, mListeners.size());
+        mListeners.push_back(l);
+        parseListenAddress(listen, l->addr);
+    }
+
+    if (listeners.IsArray()) {
+        for (unsigned i = 0; i < listeners.Size(); ++i) {
+            Listener *l = new Listener(this, mListeners.size());
+            mListeners.push_back(l);
+            parseListener(listeners[i], *l);
         }
+    } else if (!listeners.IsNull()) {
+        mError << "The 'listeners' configuration key must be an array.\n";
+    }
 
-        if (port.IsUint()) {
-            portStr << port.GetUint();
-        } else {
-            mError << "The 'listen' port must be an integer.\n";
+    if (mListeners.empty()) {
+        mError << "The required 'listen' configuration key must be a [host, port] list.\n";
+    }
+
+    /*
+     * Optional 'relays' list, forwarding channels to other OPC servers.
+     */
+
+    const Value &relays = config["relays"];
+
+    if (relays.IsArray()) {
+        for (unsigned i = 0; i < relays.Size(); ++i) {
+            OPCRelay *r = new OPCRelay(mVerbose);
+            mRelays.push_back(r);
+            r->parse(relays[i], mError);
+        }
+    } else if (!relays.IsNull()) {
+        mError << "The 'relays' configuration key must be an array.\n";
+    }
+
+    /*
+     * Optional 'testPatterns' list, running from startup.
+     */
+
+    const Value &patterns = config["testPatterns"];
+
+    if (patterns.IsArray()) {
+        for (unsigned i = 0; i < patterns.Size(); ++i) {
+            TestPattern *p = new TestPattern(cbPattern, this);
+            p->parse(patterns[i], mError);
+            addTestPattern(p);
         }
+    } else if (!patterns.IsNull()) {
+        mError << "The 'testPatterns' configuration key must be an array.\n";
+    }
+
+    /*
+     * Optional 'videos' list, played onto canvas mapping instructions.
+     */
 
-        struct addrinfo hints;
-        memset(&hints, 0, sizeof hints);
-        hints.ai_family = PF_UNSPEC;
-        hints.ai_flags = AI_PASSIVE;
+    const Value &videos = config["videos"];
 
-        if (getaddrinfo(hostStr, portStr.str().c_str(), &hints, &mListenAddr) || !mListenAddr) {
-            mError << "Failed to resolve hostname '" << host.GetString() << "'\n";
+    if (videos.IsArray()) {
+        for (unsigned i = 0; i < videos.Size(); ++i) {
+            VideoPlayer *v = new VideoPlayer(cbVideo, this);
+            mVideos.push_back(v);
+            v->parse(videos[i], mError);
         }
-    } else {
-        mError << "The required 'listen' configuration key must be a [host, port] list.\n";
+    } else if (!videos.IsNull()) {
+        mError << "The 'videos' configuration key must be an array.\n";
     }
 
     /*
-     * Minimal validation on 'devices'
+     * Check the 'devices' list once, up front, and keep a table of the parts we need
+     * when devices are attached.
      */
 
-    if (!mDevices.IsArray()) {
+    if (mDevices.IsArray()) {
+        compileDeviceConfigs();
+    } else {
         mError << "The required 'devices' configuration key must be an array.\n";
     }
+
+    parseTrace(config["trace"]);
+    parseShard(config["shard"]);
+    mRealtime.parse(config["realtime"], mError);
 }
 
 FCServer::~FCServer()
 {
-    if (mListenAddr) {
-        freeaddrinfo(mListenAddr);
+    for (unsigned i = 0; i < mListeners.size(); ++i) {
+        delete mListeners[i];
+    }
+    for (unsigned i = 0; i < mRelays.size(); ++i) {
+        delete mRelays[i];
+    }
+    for (unsigned i = 0; i < mPatterns.size(); ++i) {
+        delete mPatterns[i];
+    }
+    delete mPatternMessage;
+    for (unsigned i = 0; i < mVideos.size(); ++i) {
+        delete mVideos[i];
+    }
+    for (unsigned i = 0; i < mCanvasMaps.size(); ++i) {
+        delete mCanvasMaps[i];
+    }
+}
+
+FCServer::Listener::Listener(FCServer *server, unsigned index)
+    : server(server),
+      index(index),
+      name(0),
+      addr(0),
+      datagram(false),
+      sync(0),
+      sink(cbMessage, this, server->mVerbose)
+{
+    sink.setBatchCallback(cbBatch);
+
+    // Default is to pass channels through unmodified
+    for (unsigned i = 0; i < NUM_CHANNELS; ++i) {
+        channelMap[i] = i;
+    }
+}
+
+FCServer::Listener::~Listener()
+{
+    if (addr) {
+        freeaddrinfo(addr);
+    }
+    delete sync;
+}
+
+void FCServer::parseTrace(const Value &trace)
+{
+    /*
+     * Optional latency trace file: { "file": path, "frames": count }
+     */
+
+    if (trace.IsNull()) {
+        return;
+    }
+
+    if (!(trace.IsObject() && trace["file"].IsString())) {
+        mError << "The 'trace' configuration key must be an object with a 'file' name.\n";
+        return;
+    }
+
+    const Value &file = trace["file"];
+    const Value &frames = trace["frames"];
+    if (!(frames.IsNull() || (frames.IsUint() && frames.GetUint() > 0))) {
+        mError << "The trace 'frames' count must be a positive integer.\n";
+        return;
+    }
+
+    if (!mTracer.openTrace(file.GetString(), frames.IsNull() ? 1000 : frames.GetUint())) {
+        mError << "Can't open trace file '" << file.GetString() << "'.\n";
+    }
+}
+
+void FCServer::parseShard(const Value &shard)
+{
+    /*
+     * Optional shard: { "buses": [ USB bus numbers ], "serials": [ serial numbers ] }
+     * A device belongs to this server if it matches either list.
+     */
+
+    if (shard.IsNull()) {
+        return;
+    }
+    if (!shard.IsObject()) {
+        mError << "The 'shard' configuration key must be an object.\n";
+        return;
+    }
+
+    const Value &buses = shard["buses"];
+    const Value &serials = shard["serials"];
+    mSharded = true;
+
+    if (buses.IsArray()) {
+        for (unsigned i = 0; i < buses.Size(); ++i) {
+            if (!buses[i].IsUint()) {
+                mError << "Shard 'buses' must be a list of USB bus numbers.\n";
+                break;
+            }
+            mShardBuses.insert(buses[i].GetUint());
+        }
+    } else if (!buses.IsNull()) {
+        mError << "Shard 'buses' must be a list of USB bus numbers.\n";
+    }
+
+    if (serials.IsArray()) {
+        for (unsigned i = 0; i < serials.Size(); ++i) {
+            if (!serials[i].IsString()) {
+                mError << "Shard 'serials' must be a list of serial number strings.\n";
+                break;
+            }
+            mShardSerials.insert(serials[i].GetString());
+        }
+    } else if (!serials.IsNull()) {
+        mError << "Shard 'serials' must be a list of serial number strings.\n";
+    }
+
+    if (mShardBuses.empty() && mShardSerials.empty()) {
+        mError << "A 'shard' needs a list of 'buses' or 'serials'.\n";
+    }
+}
+
+bool FCServer::shardOwnsDevice(libusb_device *device)
+{
+    /*
+     * Decide before a driver opens the device. Drivers claim its interface, and
+     * only one process can do that at a time. Reading the serial number needs a
+     * handle, but not a claimed interface.
+     */
+
+    if (!mSharded || mShardBuses.count(libusb_get_bus_number(device))) {
+        return true;
+    }
+    if (mShardSerials.empty()) {
+        return false;
+    }
+
+    libusb_device_descriptor dd;
+    libusb_device_handle *handle;
+    char serial[256];
+
+    if (libusb_get_device_descriptor(device, &dd) < 0 || libusb_open(device, &handle) < 0) {
+        return false;
+    }
+    int r = libusb_get_string_descriptor_ascii(handle, dd.iSerialNumber, (uint8_t*)serial, sizeof serial);
+    libusb_close(handle);
+
+    return r >= 0 && mShardSerials.count(std::string(serial, r));
+}
+
+void FCServer::parseListenAddress(const Value &listen, struct addrinfo *&addr)
+{
+    /*
+     * Parse and resolve a listen [host, port] list.
+     */
+
+    if (!(listen.IsArray() && listen.Size() == 2)) {
+        mError << "Each 'listen' address must be a [host, port] list.\n";
+        return;
+    }
+
+    const Value &host = listen[0u];
+    const Value &port = listen[1];
+    const char *hostStr = 0;
+    std::ostringstream portStr;
+
+    if (host.IsString()) {
+        hostStr = host.GetString();
+    } else if (!host.IsNull()) {
+        mError << "Hostname in 'listen' must be null (any) or a hostname string.\n";
+        return;
+    }
+
+    if (port.IsUint()) {
+        portStr << port.GetUint();
+    } else {
+        mError << "The 'listen' port must be an integer.\n";
+        return;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_flags = AI_PASSIVE;
+
+    if (getaddrinfo(hostStr, portStr.str().c_str(), &hints, &addr) || !addr) {
+        mError << "Failed to resolve hostname '" << (hostStr ? hostStr : "(any)") << "'\n";
+    }
+}
+
+void FCServer::parseListener(const Value &config, Listener &l)
+{
+    /*
+     * One entry in the 'listeners' list:
+     *
+     *   "listen": [host, port]
+     *   "name": Optional. Devices may have a separate map for each named listener.
+     *   "channelOffset": Optional. Added to every OPC channel from this listener.
+     *   "channels": Optional. List of global channels for each of this listener's
+     *               channels, in order. Null, or channels past the end, are dropped.
+     *   "protocol": Optional. "tcp" (default) or "udp", for one OPC message per datagram.
+     *   "reusePort": Optional. true to share the port with other servers, using SO_REUSEPORT.
+     *   "multicast": Optional. IPv4 multicast group to join. Implies "udp".
+     *   "interface": Optional. Address of the local interface to join the group on.
+     *   "sync": Optional. true to hold each frame until a Commit Frame message.
+     */
+
+    if (!config.IsObject()) {
+        mError << "Each item in 'listeners' must be a JSON object.\n";
+        return;
+    }
+
+    const Value &name = config["name"];
+    const Value &offset = config["channelOffset"];
+    const Value &channels = config["channels"];
+    const Value &protocol = config["protocol"];
+    const Value &reusePort = config["reusePort"];
+    const Value &multicast = config["multicast"];
+    const Value &interface = config["interface"];
+    const Value &sync = config["sync"];
+
+    parseListenAddress(config["listen"], l.addr);
+
+    if (protocol.IsString() && !strcmp(protocol.GetString(), "udp")) {
+        l.datagram = true;
+    } else if (!(protocol.IsNull() || (protocol.IsString() && !strcmp(protocol.GetString(), "tcp")))) {
+        mError << "Listener 'protocol' must be \"tcp\" or \"udp\".\n";
+    }
+
+    if (multicast.IsString()) {
+        struct in_addr group, local;
+        local.s_addr = htonl(INADDR_ANY);
+
+        if (!inet_aton(multicast.GetString(), &group) || !IN_MULTICAST(ntohl(group.s_addr))) {
+            mError << "Listener 'multicast' must be an IPv4 multicast group address.\n";
+        } else if (!(interface.IsNull() || (interface.IsString() && inet_aton(interface.GetString(), &local)))) {
+            mError << "Listener 'interface' must be the IPv4 address of a local interface.\n";
+        } else if (!protocol.IsNull() && !l.datagram) {
+            mError << "Multicast listeners must use the \"udp\" protocol.\n";
+        } else {
+            l.datagram = true;
+            l.sink.setMulticast(group, local);
+        }
+    } else if (!multicast.IsNull()) {
+        mError << "Listener 'multicast' must be an IPv4 multicast group address.\n";
+    }
+
+    if (sync.IsTrue()) {
+        l.sync = new FrameSync(cbSyncMessage, cbSyncFrame, &l);
+    } else if (!(sync.IsNull() || sync.IsFalse())) {
+        mError << "Listener 'sync' must be true or false.\n";
+    }
+
+    if (reusePort.IsBool()) {
+        l.sink.setReusePort(reusePort.IsTrue());
+    } else if (!reusePort.IsNull()) {
+        mError << "Listener 'reusePort' must be true or false.\n";
+    }
+
+    if (name.IsString()) {
+        l.name = name.GetString();
+        for (unsigned i = 0; i < l.index; ++i) {
+            if (mListeners[i]->name && !strcmp(mListeners[i]->name, l.name)) {
+                mError << "Listener name '" << l.name << "' is used more than once.\n";
+            }
+        }
+    } else if (!name.IsNull()) {
+        mError << "Listener 'name' must be a string.\n";
+    }
+
+    if (!offset.IsNull() && !channels.IsNull()) {
+        mError << "A listener may have a 'channelOffset' or a 'channels' list, but not both.\n";
+
+    } else if (offset.IsUint() && offset.GetUint() < NUM_CHANNELS) {
+        for (unsigned i = 0; i < NUM_CHANNELS; ++i) {
+            unsigned global = i + offset.GetUint();
+            l.channelMap[i] = global < NUM_CHANNELS ? int(global) : -1;
+        }
+
+    } else if (channels.IsArray() && channels.Size() <= NUM_CHANNELS) {
+        for (unsigned i = 0; i < NUM_CHANNELS; ++i) {
+            l.channelMap[i] = -1;
+        }
+        for (unsigned i = 0; i < channels.Size(); ++i) {
+            const Value &global = channels[i];
+            if (global.IsUint() && global.GetUint() < NUM_CHANNELS) {
+                l.channelMap[i] = global.GetUint();
+            } else if (!global.IsNull()) {
+                mError << "Listener 'channels' must contain channel numbers from 0 to 255, or null.\n";
+                break;
+            }
+        }
+
+    } else if (!offset.IsNull()) {
+        mError << "Listener 'channelOffset' must be an integer from 0 to 255.\n";
+
+    } else if (!channels.IsNull()) {
+        mError << "Listener 'channels' must be a list of at most 256 channels.\n";
     }
 }
 
+void FCServer::compileDeviceConfigs()
+{
+    mDeviceConfigs.reserve(mDevices.Size());
+
+    for (unsigned i = 0; i < mDevices.Size(); ++i) {
+        const Value &device = mDevices[i];
+        USBDevice::Config config;
+
+        if (!device.IsObject()) {
+            mError << "Device #" << i << " must be a JSON object.\n";
+            continue;
+        }
+
+        const Value &vtype = device["type"];
+        const Value &vserial = device["serial"];
+        const Value &vmap = device["map"];
+        const Value &vmaps = device["maps"];
+
+        if (!vtype.IsString()) {
+            mError << "Device #" << i << " needs a 'type' string.\n";
+            continue;
+        }
+        if (!(vserial.IsString() || vserial.IsNull())) {
+            mError << "Device #" << i << " 'serial' must be a string, or null to match any device.\n";
+            continue;
+        }
+        if (!(vmap.IsArray() || vmap.IsNull())) {
+            mError << "Device #" << i << " 'map' must be an array.\n";
+            continue;
+        }
+        if (!(vmaps.IsObject() || vmaps.IsNull())) {
+            mError << "Device #" << i << " 'maps' must be an object with a map for each listener name.\n";
+            continue;
+        }
+
+        config.type = vtype.GetString();
+        config.serial = vserial.IsString() ? vserial.GetString() : 0;
+        config.value = &device;
+        if (!compileDeviceMaps(i, vmap, vmaps, config)) {
+            continue;
+        }
+
+        // The first entry for any given key wins, same as a linear search would.
+        unsigned index = mDeviceConfigs.size();
+        if (config.serial) {
+            mConfigsBySerial.insert(ConfigIndex::value_type(configKey(config.type, config.serial), index));
+        } else {
+            mWildcardConfigs.insert(ConfigIndex::value_type(config.type, index));
+        }
+
+        mDeviceConfigs.push_back(config);
+    }
+}
+
+bool FCServer::compileDeviceMaps(unsigned deviceIndex, const Value &map, const Value &maps, USBDevice::Config &config)
+{
+    /*
+     * Pick the mapping table this device uses for messages from each listener.
+     * A named listener uses the device's entry in 'maps' if there is one.
+     * Anything else uses the default 'map'.
+     */
+
+    const Value *defaultMap = map.IsArray() ? &map : 0;
+    config.maps.assign(mListeners.size(), defaultMap);
+
+    if (defaultMap && !compileCanvasMaps(deviceIndex, map, config)) {
+        return false;
+    }
+    if (maps.IsNull()) {
+        return true;
+    }
+
+    for (Value::ConstMemberIterator m = maps.MemberBegin(), e = maps.MemberEnd(); m != e; ++m) {
+        const char *name = m->name.GetString();
+        unsigned l = 0;
+
+        while (l < mListeners.size() && !(mListeners[l]->name && !strcmp(mListeners[l]->name, name))) {
+            ++l;
+        }
+
+        if (l == mListeners.size()) {
+            mError << "Device #" << deviceIndex << " has a map for unknown listener '" << name << "'.\n";
+            return false;
+        }
+        if (!m->value.IsArray()) {
+            mError << "Device #" << deviceIndex << " map for listener '" << name << "' must be an array.\n";
+            return false;
+        }
+
+        config.maps[l] = &m->value;
+        if (!compileCanvasMaps(deviceIndex, m->value, config)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool FCServer::compileCanvasMaps(unsigned deviceIndex, const Value &map, USBDevice::Config &config)
+{
+    /*
+     * Canvas instructions need their layouts scaled and their sampling tables
+     * built, so they're compiled here instead of being read on every message.
+     */
+
+    for (unsigned i = 0; i < map.Size(); ++i) {
+        const Value &inst = map[i];
+        if (!(inst.IsObject() && inst.HasMember("canvas"))) {
+            continue;
+        }
+
+        CanvasMap *canvas = new CanvasMap();
+        mCanvasMaps.push_back(canvas);
+
+        std::ostringstream error;
+        if (!canvas->parse(inst, error)) {
+            mError << "Device #" << deviceIndex << ": " << error.str();
+            return false;
+        }
+        config.canvases.push_back(canvas);
+    }
+
+    return true;
+}
+
+std::string FCServer::configKey(const char *type, const char *serial)
+{
+    // Neither string can contain a NUL, so it makes an unambiguous separator
+    std::string key(type);
+    key.push_back('\0');
+    key.append(serial);
+    return key;
+}
+
+const USBDevice::Config *FCServer::findDeviceConfig(const char *type, const char *serial)
+{
+    /*
+     * Find the first entry in the 'devices' list which matches this type and serial number.
+     * That may be an exact match, or a wildcard entry for this type. If both exist, the
+     * one listed earlier in the config file takes precedence.
+     */
+
+    ConfigIndex::iterator exact = mConfigsBySerial.find(configKey(type, serial));
+    ConfigIndex::iterator wildcard = mWildcardConfigs.find(type);
+    unsigned index;
+
+    if (exact != mConfigsBySerial.end()) {
+        index = exact->second;
+        if (wildcard != mWildcardConfigs.end()) {
+            index = std::min(index, wildcard->second);
+        }
+    } else if (wildcard != mWildcardConfigs.end()) {
+        index = wildcard->second;
+    } else {
+        return 0;
+    }
+
+    return &mDeviceConfigs[index];
+}
+
 void FCServer::start(struct ev_loop *loop)
 {
-    mOPCSink.start(loop, mListenAddr);
+    mLoop = loop;
+    for (unsigned i = 0; i < mListeners.size(); ++i) {
+        Listener *l = mListeners[i];
+        if (l->datagram) {
+            l->sink.startDatagram(loop, l->addr);
+        } else {
+            l->sink.start(loop, l->addr, mIOUring);
+        }
+        if (l->sync) {
+            l->sync->start(loop);
+        }
+    }
+    for (unsigned i = 0; i < mRelays.size(); ++i) {
+        mRelays[i]->start(loop);
+    }
+    startVirtualDevices(loop);
     startUSB(loop);
+    for (unsigned i = 0; i < mPatterns.size(); ++i) {
+        mPatterns[i]->start(loop);
+    }
+    for (unsigned i = 0; i < mVideos.size(); ++i) {
+        mVideos[i]->start(loop);
+    }
+
+    // After startup, so everything allocated so far is locked and threads exist
+    if (mRealtime.locksMemory()) {
+        for (unsigned i = 0; i < mVideos.size(); ++i) {
+            mVideos[i]->beforeMemoryLock();
+        }
+    }
+    mRealtime.start(loop, mVerbose);
+    if (mRealtime.locksMemory()) {
+        for (unsigned i = 0; i < mVideos.size(); ++i) {
+            mVideos[i]->afterMemoryLock();
+        }
+    }
+}
+
+void FCServer::startVirtualDevices(struct ev_loop *loop)
+{
+    /*
+     * Virtual devices have no hardware to wait for. Each 'virtual' config entry
+     * is one device, created right away.
+     */
+
+    for (unsigned i = 0; i < mDeviceConfigs.size(); ++i) {
+        const USBDevice::Config &config = mDeviceConfigs[i];
+        if (strcmp(config.type, "virtual")) {
+            continue;
+        }
+
+        USBDevice *dev = new VirtualFCDevice(loop, config.serial ? config.serial : "virtual", mVerbose);
+        dev->setEventLoop(loop);
+        dev->setTracer(&mTracer);
+
+        int r = dev->open();
+        if (r < 0) {
+            std::clog << "Error opening " << dev->getName() << ": " << libusb_strerror(libusb_error(r)) << "\n";
+            delete dev;
+            continue;
+        }
+
+        mTracer.nameSource(dev, dev->getName());
+        dev->loadConfiguration(config);
+        dev->writeColorCorrection(mColor);
+        mUSBDevices.push_back(dev);
+
+        if (mVerbose) {
+            std::clog << "Virtual device " << dev->getName() << " started.\n";
+        }
+    }
 }
 
 void FCServer::startUSB(struct ev_loop *loop)
@@ -120,17 +695,323 @@ void FCServer::startUSB(struct ev_loop *loop)
 void FCServer::cbMessage(OPCSink::Message &msg, void *context)
 {
     /*
-     * Broadcast the OPC message to all configured devices.
+     * Translate the message to a global OPC channel, according to the listener
+     * it arrived on, and broadcast it to all configured devices and relays.
+     */
+
+    Listener *l = static_cast<Listener*>(context);
+    FCServer *self = l->server;
+
+    const unsigned sysEx = OPCSink::sysExId(msg);
+
+    if (sysEx == OPCSink::FCQueryStatus) {
+        // FCQueryStatus is answered by the server itself, not forwarded to devices
+        self->replyStatus(l->sink);
+        return;
+    }
+
+    if (sysEx == OPCSink::FCTestPattern) {
+        // FCTestPattern starts or stops one of the server's own patterns
+        self->opcTestPattern(msg);
+        return;
+    }
+
+    if (l->sync) {
+        // Count every message in the frame, even on channels we don't use
+        if (sysEx == OPCSink::FCCommitFrame) {
+            l->sync->commit(msg.data + OPCSink::SYSEX_ID_LENGTH, msg.length() - OPCSink::SYSEX_ID_LENGTH);
+            return;
+        }
+        l->sync->message();
+    }
+
+    int channel = l->channelMap[msg.channel];
+    if (channel < 0) {
+        return;
+    }
+    msg.channel = channel;
+
+    if (l->sync) {
+        l->sync->hold(msg);
+    } else {
+        self->dispatch(msg, l->index);
+    }
+}
+
+void FCServer::dispatch(OPCSink::Message &msg, unsigned listener)
+{
+    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
+        USBDevice *dev = *i;
+        dev->writeMessage(msg, listener);
+    }
+
+    for (std::vector<OPCRelay*>::iterator i = mRelays.begin(), e = mRelays.end(); i != e; ++i) {
+        (*i)->forward(msg);
+    }
+}
+
+void FCServer::opcTestPattern(const OPCSink::Message &msg)
+{
+    /*
+     * The SysEx data is a JSON object, the same as one entry in 'testPatterns'.
+     * It replaces any pattern with the same target.
+     */
+
+    // Mutable NUL-terminated copy of the message string
+    std::string text((char*)msg.data + OPCSink::SYSEX_ID_LENGTH, msg.length() - OPCSink::SYSEX_ID_LENGTH);
+
+    rapidjson::Document doc;
+    doc.ParseInsitu<0>(&text[0]);
+
+    if (doc.HasParseError()) {
+        if (mVerbose) {
+            std::clog << "Parse error in test pattern JSON at character "
+                << doc.GetErrorOffset() << ": " << doc.GetParseError() << "\n";
+        }
+        return;
+    }
+
+    TestPattern *p = new TestPattern(cbPattern, this);
+    std::ostringstream error;
+
+    if (!p->parse(doc, error)) {
+        if (mVerbose) {
+            std::clog << error.str();
+        }
+        delete p;
+        return;
+    }
+
+    addTestPattern(p);
+    if (mLoop) {
+        p->start(mLoop);
+    }
+}
+
+void FCServer::addTestPattern(TestPattern *pattern)
+{
+    // Replace the pattern on the same device or channel. "off" just removes it.
+    for (unsigned i = 0; i < mPatterns.size(); ++i) {
+        if (mPatterns[i]->sameTarget(*pattern)) {
+            delete mPatterns[i];
+            mPatterns.erase(mPatterns.begin() + i);
+            break;
+        }
+    }
+
+    if (pattern->kind() == TestPattern::OFF) {
+        delete pattern;
+    } else {
+        mPatterns.push_back(pattern);
+    }
+}
+
+void FCServer::cbPattern(TestPattern &pattern, void *context)
+{
+    /*
+     * One frame of a test pattern. On a channel, it's an ordinary Set Pixel Colors
+     * message, mapped by the first listener's maps. Otherwise, it's drawn directly
+     * on each device it's for.
      */
 
     FCServer *self = static_cast<FCServer*>(context);
 
+    if (pattern.hasChannel()) {
+        if (!self->mPatternMessage) {
+            self->mPatternMessage = new OPCSink::Message;
+        }
+
+        OPCSink::Message &msg = *self->mPatternMessage;
+        unsigned length = pattern.pixelCount() * 3;
+
+        msg.channel = pattern.channel();
+        msg.command = OPCSink::SetPixelColors;
+        msg.lenHigh = length >> 8;
+        msg.lenLow = length;
+        msg.receiveTime = monotonicTime();
+        for (unsigned i = 0; i < pattern.pixelCount(); ++i) {
+            pattern.pixel(i, msg.data + i * 3);
+        }
+
+        self->dispatch(msg, 0);
+        return;
+    }
+
     for (std::vector<USBDevice*>::iterator i = self->mUSBDevices.begin(), e = self->mUSBDevices.end(); i != e; ++i) {
         USBDevice *dev = *i;
-        dev->writeMessage(msg);
+        if (!pattern.serial() || !strcmp(pattern.serial(), dev->getSerial())) {
+            dev->writeTestPattern(pattern);
+        }
+    }
+}
+
+void FCServer::cbVideo(const Canvas &frame, void *context)
+{
+    /*
+     * One video frame. It skips OPC entirely; each device samples it through
+     * the canvas instructions for its channel in the device's default map.
+     */
+
+    FCServer *self = static_cast<FCServer*>(context);
+
+    for (std::vector<USBDevice*>::iterator i = self->mUSBDevices.begin(), e = self->mUSBDevices.end(); i != e; ++i) {
+        (*i)->writeCanvas(frame);
+    }
+}
+
+void FCServer::cbBatch(bool begin, void *context)
+{
+    /*
+     * Messages that arrived together make up a single frame. Devices collect the
+     * pixels from all of them, and send one frame at the end.
+     */
+
+    Listener *l = static_cast<Listener*>(context);
+
+    // Synchronized listeners make frames from Commit Frame messages instead
+    if (!l->sync) {
+        l->server->batchDevices(begin);
+    }
+}
+
+void FCServer::cbSyncMessage(OPCSink::Message &msg, void *context)
+{
+    // A held message, sent now that its frame is being shown
+    Listener *l = static_cast<Listener*>(context);
+    l->server->dispatch(msg, l->index);
+}
+
+void FCServer::cbSyncFrame(bool begin, void *context)
+{
+    Listener *l = static_cast<Listener*>(context);
+    l->server->batchDevices(begin);
+}
+
+void FCServer::batchDevices(bool begin)
+{
+    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
+        if (begin) {
+            (*i)->beginBatch();
+        } else {
+            (*i)->endBatch();
+        }
     }
 }
 
+void FCServer::replyStatus(OPCSink &sink)
+{
+    /*
+     * Reply with a Query Status SysEx message, containing JSON text describing
+     * each attached device.
+     */
+
+    rapidjson::StringBuffer buffer;
+    USBDevice::StatusWriter w(buffer);
+
+    // SysEx header: System ID and SysEx ID, then the JSON text
+    uint8_t header[OPCSink::SYSEX_ID_LENGTH];
+    OPCSink::putSysExId(header, OPCSink::FCQueryStatus);
+    for (unsigned i = 0; i < sizeof header; ++i) {
+        buffer.Put(header[i]);
+    }
+
+    w.StartObject();
+    w.String("devices").StartArray();
+    for (std::vector<USBDevice*>::iterator i = mUSBDevices.begin(), e = mUSBDevices.end(); i != e; ++i) {
+        w.StartObject();
+        (*i)->writeStatus(w);
+        w.EndObject();
+    }
+    w.EndArray();
+    w.String("latency").StartObject();
+    mTracer.writeStatus(w);
+    w.EndObject();
+    if (!mPatterns.empty()) {
+        w.String("testPatterns").StartArray();
+        for (std::vector<TestPattern*>::iterator i = mPatterns.begin(), e = mPatterns.end(); i != e; ++i) {
+            w.StartObject();
+            (*i)->writeStatus(w);
+            w.EndObject();
+        }
+        w.EndArray();
+    }
+    if (!mVideos.empty()) {
+        w.String("videos").StartArray();
+        for (std::vector<VideoPlayer*>::iterator i = mVideos.begin(), e = mVideos.end(); i != e; ++i) {
+            w.StartObject();
+            (*i)->writeStatus(w);
+            w.EndObject();
+        }
+        w.EndArray();
+    }
+
+    if (!mRelays.empty()) {
+        w.String("relays").StartArray();
+        for (std::vector<OPCRelay*>::iterator i = mRelays.begin(), e = mRelays.end(); i != e; ++i) {
+            w.StartObject();
+            (*i)->writeStatus(w);
+            w.EndObject();
+        }
+        w.EndArray();
+    }
+    bool synced = false;
+    for (std::vector<Listener*>::iterator i = mListeners.begin(), e = mListeners.end(); i != e; ++i) {
+        Listener *l = *i;
+        if (!l->sync) {
+            continue;
+        }
+        if (!synced) {
+            w.String("sync").StartArray();
+            synced = true;
+        }
+        w.StartObject();
+        w.String("listener").Uint(l->index);
+        if (l->name) {
+            w.String("name").String(l->name);
+        }
+        l->sync->writeStatus(w);
+        w.EndObject();
+    }
+    if (synced) {
+        w.EndArray();
+    }
+    if (mRealtime.enabled()) {
+        w.String("realtime").StartObject();
+        mRealtime.writeStatus(w);
+        w.EndObject();
+    }
+    w.EndObject();
+
+    if (buffer.Size() > OPCSink::MAX_REPLY) {
+        /*
+         * Too much status for one OPC message. Say so, with the parts a client most
+         * likely needs, rather than leaving it waiting for a reply that never comes.
+         */
+
+        std::ostringstream error;
+        error << "Status is " << buffer.Size() << " bytes, more than one OPC message can carry";
+
+        buffer.Clear();
+        USBDevice::StatusWriter small(buffer);
+        for (unsigned i = 0; i < sizeof header; ++i) {
+            buffer.Put(header[i]);
+        }
+        small.StartObject();
+        small.String("error").String(error.str().c_str());
+        small.String("deviceCount").Uint(mUSBDevices.size());
+        small.String("latency").StartObject();
+        mTracer.writeStatus(small);
+        small.EndObject();
+        small.EndObject();
+
+        if (mVerbose) {
+            std::clog << error.str() << "\n";
+        }
+    }
+
+    sink.reply(0, OPCSink::SystemExclusive, buffer.GetString(), buffer.Size());
+}
+
 int FCServer::cbHotplug(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data)
 {
     FCServer *self = static_cast<FCServer*>(user_data);
@@ -163,6 +1044,12 @@ void FCServer::usbDeviceArrived(libusb_device *device)
         return;
     }
 
+    if (!shardOwnsDevice(device)) {
+        // Another server takes care of this one
+        delete dev;
+        return;
+    }
+
     int r = dev->open();
     if (r < 0) {
         if (mVerbose) {
@@ -178,18 +1065,22 @@ void FCServer::usbDeviceArrived(libusb_device *device)
         return;
     }
 
-    for (unsigned i = 0; i < mDevices.Size(); ++i) {
-        if (dev->matchConfiguration(mDevices[i])) {
-            // Found a matching configuration for this device. We're keeping it!
+    const USBDevice::Config *config = findDeviceConfig(dev->getType(), dev->getSerial());
+    if (config) {
+        // Found a matching configuration for this device. We're keeping it!
 
-            dev->writeColorCorrection(mColor);
-            mUSBDevices.push_back(dev);
+        dev->setLink(mUSBScheduler.linkForDevice(device));
+        dev->setEventLoop(mLoop);
+        dev->setTracer(&mTracer);
+        mTracer.nameSource(dev, dev->getName());
+        dev->loadConfiguration(*config);
+        dev->writeColorCorrection(mColor);
+        mUSBDevices.push_back(dev);
 
-            if (mVerbose) {
-                std::clog << "USB device " << dev->getName() << " attached.\n";
-            }
-            return;
+        if (mVerbose) {
+            std::clog << "USB device " << dev->getName() << " attached.\n";
         }
+        return;
     }
 
     if (mVerbose) {
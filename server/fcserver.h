@@ -24,11 +24,21 @@
 #pragma once
 #include "rapidjson/document.h"
 #include "opcsink.h"
+#include "opcrelay.h"
+#include "framesync.h"
+#include "testpattern.h"
+#include "videoplayer.h"
 #include "usbdevice.h"
+#include "usbscheduler.h"
 #include "libusbev.h"
+#include "latencytracer.h"
+#include "realtime.h"
 #include <libusb.h>
 #include <sstream>
+#include <string>
 #include <vector>
+#include <unordered_map>
+#include <set>
 #include <ev.h>
 #include <netinet/in.h>
 #include <netdb.h>
@@ -42,7 +52,7 @@ public:
     FCServer(rapidjson::Document &config);
     ~FCServer();
 
-    const char *errorText() const { return mError.str().c_str(); }
+    std::string errorText() const { return mError.str(); }
     bool hasError() const { return !mError.str().empty(); }
 
     void start(struct ev_loop *loop);
@@ -50,22 +60,85 @@ public:
 private:
     std::ostringstream mError;
 
-    const Value& mListen;
     const Value& mColor;
     const Value& mDevices;
     bool mVerbose;
+    bool mIOUring;
 
-    struct addrinfo *mListenAddr;
-    OPCSink mOPCSink;
+    static const unsigned NUM_CHANNELS = 256;
 
+    struct Listener {
+        Listener(FCServer *server, unsigned index);
+        ~Listener();
+
+        FCServer *server;
+        unsigned index;
+        const char *name;                   // NULL if unnamed
+        struct addrinfo *addr;
+        bool datagram;                      // UDP instead of TCP
+        FrameSync *sync;                    // Frames wait for Commit Frame, or NULL
+        int channelMap[NUM_CHANNELS];       // Global channel for each local channel, -1 to drop
+        OPCSink sink;
+    };
+
+    std::vector<Listener*> mListeners;
+    std::vector<OPCRelay*> mRelays;
+
+    // Test patterns in progress, and the message that carries them on OPC channels
+    std::vector<TestPattern*> mPatterns;
+    OPCSink::Message *mPatternMessage;
+
+    std::vector<VideoPlayer*> mVideos;
+
+    struct ev_loop *mLoop;
     libusb_context *mUSB;
     LibUSBEventBridge mUSBEvent;
+    USBScheduler mUSBScheduler;
 
     std::vector<USBDevice*> mUSBDevices;
+    std::vector<USBDevice::Config> mDeviceConfigs;
+    std::vector<CanvasMap*> mCanvasMaps;
+    LatencyTracer mTracer;
+    Realtime mRealtime;
+
+    // Index into mDeviceConfigs. Exact matches are keyed by type and serial, wildcards by type only.
+    typedef std::unordered_map<std::string, unsigned> ConfigIndex;
+    ConfigIndex mConfigsBySerial;
+    ConfigIndex mWildcardConfigs;
+
+    /*
+     * Sharding. Several servers on one host can split up the USB devices, each
+     * one only opening devices on the buses or with the serial numbers listed
+     * in its 'shard' object.
+     */
+    bool mSharded;
+    std::set<unsigned> mShardBuses;
+    std::set<std::string> mShardSerials;
 
     static void cbMessage(OPCSink::Message &msg, void *context);
+    static void cbBatch(bool begin, void *context);
+    static void cbSyncMessage(OPCSink::Message &msg, void *context);
+    static void cbSyncFrame(bool begin, void *context);
+    static void cbPattern(TestPattern &pattern, void *context);
+    static void cbVideo(const Canvas &frame, void *context);
+    void dispatch(OPCSink::Message &msg, unsigned listener);
+    void addTestPattern(TestPattern *pattern);
+    void opcTestPattern(const OPCSink::Message &msg);
+    void batchDevices(bool begin);
+    void replyStatus(OPCSink &sink);
     static int cbHotplug(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data);
 
+    void parseTrace(const Value &trace);
+    void parseShard(const Value &shard);
+    bool shardOwnsDevice(libusb_device *device);
+    void parseListenAddress(const Value &listen, struct addrinfo *&addr);
+    void parseListener(const Value &config, Listener &l);
+    void compileDeviceConfigs();
+    bool compileDeviceMaps(unsigned deviceIndex, const Value &map, const Value &maps, USBDevice::Config &config);
+    bool compileCanvasMaps(unsigned deviceIndex, const Value &map, USBDevice::Config &config);
+    const USBDevice::Config *findDeviceConfig(const char *type, const char *serial);
+    static std::string configKey(const char *type, const char *serial);
+    void startVirtualDevices(struct ev_loop *loop);
     void startUSB(struct ev_loop *loop);
     void usbDeviceArrived(libusb_device *device);
     void usbDeviceLeft(libusb_device *device);
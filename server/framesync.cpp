@@ -0,0 +1,209 @@
+/*
+ * Frames held until a sender's commit time, for synchronized multicast
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "framesync.h"
+#include "util.h"
+#include <string.h>
+#include <time.h>
+
+
+FrameSync::FrameSync(OPCSink::callback_t messageCb, OPCSink::batch_callback_t batchCb, void *context)
+    : mMessageCallback(messageCb),
+      mBatchCallback(batchCb),
+      mContext(context),
+      mLoop(0),
+      mReplay(0),
+      mFrameOpen(false),
+      mPending(false),
+      mMessages(0),
+      mHaveSequence(false),
+      mSequence(0),
+      mFrames(0),
+      mFramesLost(0),
+      mMessagesLost(0),
+      mLate(0),
+      mEarly(0),
+      mExpired(0),
+      mDropped(0)
+{}
+
+FrameSync::~FrameSync()
+{
+    if (mLoop) {
+        ev_timer_stop(mLoop, &mTimer);
+    }
+    delete mReplay;
+}
+
+void FrameSync::start(struct ev_loop *loop)
+{
+    mLoop = loop;
+    ev_init(&mTimer, cbTimer);
+}
+
+void FrameSync::message()
+{
+    if (mPending) {
+        // The sender is ahead of its own commit times. Don't mix two frames.
+        ev_timer_stop(mLoop, &mTimer);
+        present();
+        mEarly++;
+    }
+
+    if (!mFrameOpen) {
+        // Don't hold on to the frame forever if its commit was lost
+        ev_timer_set(&mTimer, MAX_HOLD_USEC * 1e-6, 0);
+        ev_timer_start(mLoop, &mTimer);
+        mFrameOpen = true;
+    }
+    mMessages++;
+}
+
+void FrameSync::hold(const OPCSink::Message &msg)
+{
+    unsigned size = 4 + msg.length();
+    if (mFrame.size() + size > MAX_FRAME) {
+        mDropped++;
+        return;
+    }
+
+    mFrame.insert(mFrame.end(), &msg.channel, &msg.channel + size);
+    mReceiveTimes.push_back(msg.receiveTime);
+}
+
+void FrameSync::commit(const uint8_t *data, unsigned length)
+{
+    /*
+     * Commit Frame data, all big-endian:
+     *
+     *   4 bytes: Frame sequence number, one more than the last frame's
+     *   2 bytes: Number of messages in this frame, not counting this one
+     *   8 bytes: When to show the frame, in microseconds since 1970 (UTC), or zero for now
+     */
+
+    if (length < COMMIT_LENGTH) {
+        return;
+    }
+
+    uint32_t sequence = (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | data[3];
+    unsigned count = (unsigned(data[4]) << 8) | data[5];
+    uint64_t timestamp = 0;
+    for (unsigned i = 6; i < COMMIT_LENGTH; ++i) {
+        timestamp = (timestamp << 8) | data[i];
+    }
+
+    // Gaps in the sequence are lost frames. Going backwards means the sender restarted.
+    if (mHaveSequence && int32_t(sequence - mSequence) > 1) {
+        mFramesLost += sequence - mSequence - 1;
+    }
+    mSequence = sequence;
+    mHaveSequence = true;
+
+    if (count > mMessages) {
+        mMessagesLost += count - mMessages;
+    }
+    mMessages = 0;
+
+    // Nothing new since the last commit
+    if (!mFrameOpen || mPending) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t delay = timestamp ? int64_t(timestamp - (uint64_t(now.tv_sec) * 1000000 + now.tv_nsec / 1000)) : 0;
+
+    if (delay <= 0) {
+        if (timestamp) {
+            mLate++;
+        }
+        present();
+        return;
+    }
+
+    mSlack.add(delay * 1e-6);
+    if (delay > int64_t(MAX_HOLD_USEC)) {
+        delay = MAX_HOLD_USEC;
+    }
+
+    ev_timer_stop(mLoop, &mTimer);
+    ev_timer_set(&mTimer, delay * 1e-6, 0);
+    ev_timer_start(mLoop, &mTimer);
+    mPending = true;
+}
+
+void FrameSync::present()
+{
+    ev_timer_stop(mLoop, &mTimer);
+    mPending = false;
+    mFrameOpen = false;
+    mFrames++;
+
+    if (mReceiveTimes.empty()) {
+        return;
+    }
+    if (!mReplay) {
+        mReplay = new OPCSink::Message;
+    }
+
+    // Devices collect every message, and send the frame at the end of the batch
+    mBatchCallback(true, mContext);
+
+    const uint8_t *ptr = &mFrame[0];
+    for (unsigned i = 0; i < mReceiveTimes.size(); ++i) {
+        unsigned size = 4 + ((unsigned(ptr[2]) << 8) | ptr[3]);
+        memcpy(&mReplay->channel, ptr, size);
+        mReplay->receiveTime = mReceiveTimes[i];
+        mMessageCallback(*mReplay, mContext);
+        ptr += size;
+    }
+
+    mBatchCallback(false, mContext);
+
+    mFrame.clear();
+    mReceiveTimes.clear();
+}
+
+void FrameSync::cbTimer(struct ev_loop *loop, struct ev_timer *watcher, int revents)
+{
+    FrameSync *self = container_of(watcher, FrameSync, mTimer);
+
+    if (!self->mPending) {
+        self->mExpired++;
+    }
+    self->present();
+}
+
+void FrameSync::writeStatus(StatusWriter &w)
+{
+    w.String("frames").Uint64(mFrames);
+    w.String("framesLost").Uint64(mFramesLost);
+    w.String("messagesLost").Uint64(mMessagesLost);
+    w.String("late").Uint64(mLate);
+    w.String("early").Uint64(mEarly);
+    w.String("expired").Uint64(mExpired);
+    w.String("dropped").Uint64(mDropped);
+    w.String("slack").StartObject();
+    mSlack.writeStatus(w);
+    w.EndObject();
+}
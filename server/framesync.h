@@ -0,0 +1,102 @@
+/*
+ * Frames held until a sender's commit time, for synchronized multicast
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "opcsink.h"
+#include "histogram.h"
+#include <ev.h>
+#include <stdint.h>
+#include <vector>
+
+
+/*
+ * A listener with "sync" collects messages into a frame until a Commit Frame
+ * SysEx arrives, then sends the frame to devices at the time in that message.
+ * Servers on several hosts receiving the same multicast stream show each frame
+ * together, as long as their clocks agree.
+ *
+ * Commit Frame carries a sequence number, for counting lost frames, and the
+ * number of messages in the frame, for counting lost messages.
+ *
+ * The frame is held here, not in the devices, so other listeners keep sending
+ * their own frames while this one waits. A frame whose commit never arrives is
+ * shown anyway after MAX_HOLD_USEC.
+ */
+
+class FrameSync
+{
+public:
+    typedef Histogram::StatusWriter StatusWriter;
+
+    // Each frame is shown by replaying its messages, in one batch
+    FrameSync(OPCSink::callback_t messageCb, OPCSink::batch_callback_t batchCb, void *context);
+    ~FrameSync();
+
+    void start(struct ev_loop *loop);
+
+    // Before each message that belongs to the next frame
+    void message();
+
+    // Keep a copy of a message, to send when the frame is shown
+    void hold(const OPCSink::Message &msg);
+
+    // Commit Frame, with the data that follows its SysEx header
+    void commit(const uint8_t *data, unsigned length);
+
+    // Write JSON object members with frame and loss counts
+    void writeStatus(StatusWriter &w);
+
+private:
+    static const unsigned COMMIT_LENGTH = 14;       // Sequence, message count, and timestamp
+    static const unsigned MAX_HOLD_USEC = 1000000;  // Longest we'll wait, in case the clocks disagree
+    static const unsigned MAX_FRAME = 1 << 20;      // Bytes held, before we drop messages
+
+    OPCSink::callback_t mMessageCallback;
+    OPCSink::batch_callback_t mBatchCallback;
+    void *mContext;
+    struct ev_loop *mLoop;
+    struct ev_timer mTimer;     // Commit time, or hold timeout while the frame is open
+
+    // Held messages, each an OPC header and its data, and their receive times
+    std::vector<uint8_t> mFrame;
+    std::vector<double> mReceiveTimes;
+    OPCSink::Message *mReplay;
+
+    bool mFrameOpen;            // Devices are collecting a frame
+    bool mPending;              // Committed, waiting for its time
+    unsigned mMessages;         // Received since the last commit
+    bool mHaveSequence;
+    uint32_t mSequence;
+
+    uint64_t mFrames;
+    uint64_t mFramesLost;
+    uint64_t mMessagesLost;
+    uint64_t mLate;             // Commit time had already passed
+    uint64_t mEarly;            // Shown before its time, because the next frame started
+    uint64_t mExpired;          // Shown without a commit, after the hold timeout
+    uint64_t mDropped;          // Messages that didn't fit in the held frame
+    Histogram mSlack;           // Time from commit to its timestamp
+
+    void present();
+    static void cbTimer(struct ev_loop *loop, struct ev_timer *watcher, int revents);
+};
@@ -0,0 +1,80 @@
+/*
+ * Log-scale histogram of time intervals
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "histogram.h"
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+
+Histogram::Histogram()
+    : mCount(0), mTotal(0), mMax(0)
+{
+    memset(mBuckets, 0, sizeof mBuckets);
+}
+
+void Histogram::add(double seconds)
+{
+    seconds = std::max(0.0, seconds);
+
+    int exponent;
+    frexp(seconds * 1e6, &exponent);
+    mBuckets[std::min<int>(NUM_BUCKETS - 1, std::max(0, exponent))]++;
+    mCount++;
+    mTotal += seconds;
+    mMax = std::max(mMax, seconds);
+}
+
+double Histogram::percentile(double fraction) const
+{
+    // Upper bound of the bucket holding this fraction of samples, or the max if that's lower
+    uint64_t target = uint64_t(ceil(mCount * fraction));
+    uint64_t seen = 0;
+
+    for (unsigned i = 0; i < NUM_BUCKETS; ++i) {
+        seen += mBuckets[i];
+        if (seen >= target && seen) {
+            return std::min(mMax, ldexp(1e-6, i));
+        }
+    }
+    return mMax;
+}
+
+void Histogram::writeStatus(StatusWriter &w) const
+{
+    w.String("count").Uint64(mCount);
+    w.String("mean").Double(mCount ? mTotal / mCount : 0.0);
+    w.String("max").Double(mMax);
+    w.String("p50").Double(percentile(0.5));
+    w.String("p90").Double(percentile(0.9));
+    w.String("p99").Double(percentile(0.99));
+
+    // Nonempty buckets, as [upper bound in seconds, count]
+    w.String("histogram").StartArray();
+    for (unsigned i = 0; i < NUM_BUCKETS; ++i) {
+        if (mBuckets[i]) {
+            w.StartArray().Double(ldexp(1e-6, i)).Uint64(mBuckets[i]).EndArray();
+        }
+    }
+    w.EndArray();
+}
@@ -0,0 +1,55 @@
+/*
+ * Log-scale histogram of time intervals
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+#include <stdint.h>
+
+
+class Histogram
+{
+public:
+    typedef rapidjson::Writer<rapidjson::StringBuffer> StatusWriter;
+
+    Histogram();
+
+    // Add one interval, in seconds
+    void add(double seconds);
+
+    uint64_t count() const { return mCount; }
+
+    // Write JSON object members with a summary and the nonempty buckets
+    void writeStatus(StatusWriter &w) const;
+
+private:
+    // Bucket 0 is under 1us, bucket N is [2^(N-1), 2^N) microseconds
+    static const unsigned NUM_BUCKETS = 24;
+
+    uint64_t mCount;
+    double mTotal;
+    double mMax;
+    uint64_t mBuckets[NUM_BUCKETS];
+
+    double percentile(double fraction) const;
+};
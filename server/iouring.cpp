@@ -0,0 +1,295 @@
+/*
+ * Minimal io_uring wrapper, for batched socket I/O on Linux
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "iouring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#    include <linux/io_uring.h>
+#  endif
+#endif
+
+// Multishot receive is the newest feature we need; its flag implies the rest
+#ifdef IORING_RECV_MULTISHOT
+#  define HAVE_IO_URING 1
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#endif
+
+
+IOURing::IOURing()
+    : mFd(-1),
+      mSQRing(0),
+      mSQRingSize(0),
+      mSQEs(0),
+      mSQEntries(0),
+      mSQPending(0),
+      mCQRing(0),
+      mCQRingSize(0),
+      mCQEs(0),
+      mCQLocalHead(0),
+      mBufRing(0),
+      mBufRingSize(0),
+      mBufCount(0),
+      mBufferSize(0),
+      mBufTail(0),
+      mBuffers(0)
+{}
+
+#ifdef HAVE_IO_URING
+
+IOURing::~IOURing()
+{
+    if (mFd >= 0) {
+        close(mFd);
+    }
+    if (mBufRing) {
+        munmap(mBufRing, mBufRingSize);
+    }
+    if (mSQEs) {
+        munmap(mSQEs, mSQEntries * sizeof(struct io_uring_sqe));
+    }
+    if (mCQRing && mCQRing != mSQRing) {
+        munmap(mCQRing, mCQRingSize);
+    }
+    if (mSQRing) {
+        munmap(mSQRing, mSQRingSize);
+    }
+    free(mBuffers);
+}
+
+bool IOURing::init(unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+
+    mFd = syscall(__NR_io_uring_setup, entries, &p);
+    if (mFd < 0) {
+        return false;
+    }
+
+    /*
+     * Map the rings. Newer kernels put both queue rings in a single mapping.
+     */
+
+    mSQRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    mCQRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        mSQRingSize = mCQRingSize = mSQRingSize > mCQRingSize ? mSQRingSize : mCQRingSize;
+    }
+
+    void *sq = mmap(0, mSQRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        return false;
+    }
+    mSQRing = (uint8_t*) sq;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        mCQRing = mSQRing;
+    } else {
+        void *cq = mmap(0, mCQRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            return false;
+        }
+        mCQRing = (uint8_t*) cq;
+    }
+
+    void *sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+    mSQEs = sqes;
+    mSQEntries = p.sq_entries;
+
+    mSQHead = (unsigned*) (mSQRing + p.sq_off.head);
+    mSQTail = (unsigned*) (mSQRing + p.sq_off.tail);
+    mSQMask = (unsigned*) (mSQRing + p.sq_off.ring_mask);
+    mSQArray = (unsigned*) (mSQRing + p.sq_off.array);
+    mCQHead = (unsigned*) (mCQRing + p.cq_off.head);
+    mCQTail = (unsigned*) (mCQRing + p.cq_off.tail);
+    mCQMask = (unsigned*) (mCQRing + p.cq_off.ring_mask);
+    mCQEs = mCQRing + p.cq_off.cqes;
+    mCQLocalHead = *mCQHead;
+
+    return true;
+}
+
+bool IOURing::addBuffers(uint16_t group, unsigned count, unsigned size)
+{
+    /*
+     * A provided buffer ring. The kernel picks a buffer for each receive, and
+     * tells us which one in the completion. The count must be a power of two.
+     */
+
+    mBufRingSize = count * sizeof(struct io_uring_buf);
+    void *ring = mmap(0, mBufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        mBufRingSize = 0;
+        return false;
+    }
+    mBufRing = ring;
+
+    mBuffers = (uint8_t*) malloc(count * size);
+    if (!mBuffers) {
+        return false;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (uintptr_t) ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+
+    if (syscall(__NR_io_uring_register, mFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return false;
+    }
+
+    mBufCount = count;
+    mBufferSize = size;
+    for (unsigned i = 0; i < count; ++i) {
+        recycleBuffer(i);
+    }
+    return true;
+}
+
+void IOURing::recycleBuffer(unsigned id)
+{
+    /*
+     * The tail is only published to the kernel in submit(). Index the ring as a plain
+     * array; in C++ the header's flexible array member doesn't start at offset 0.
+     */
+    struct io_uring_buf &b = ((struct io_uring_buf*) mBufRing)[mBufTail & (mBufCount - 1)];
+    b.addr = (uintptr_t) buffer(id);
+    b.len = mBufferSize;
+    b.bid = id;
+    mBufTail++;
+}
+
+void *IOURing::getSQE()
+{
+    unsigned head = __atomic_load_n(mSQHead, __ATOMIC_ACQUIRE);
+    unsigned tail = *mSQTail + mSQPending;
+
+    if (tail - head >= mSQEntries) {
+        // Full. Flush what we have, and try again.
+        if (submit() < 0) {
+            return 0;
+        }
+        head = __atomic_load_n(mSQHead, __ATOMIC_ACQUIRE);
+        tail = *mSQTail;
+        if (tail - head >= mSQEntries) {
+            return 0;
+        }
+    }
+
+    unsigned index = tail & *mSQMask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe*) mSQEs + index;
+    memset(sqe, 0, sizeof *sqe);
+    mSQArray[index] = index;
+    mSQPending++;
+    return sqe;
+}
+
+bool IOURing::prepAcceptMultishot(int fd, uint64_t userData)
+{
+    struct io_uring_sqe *sqe = (struct io_uring_sqe*) getSQE();
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = userData;
+    return true;
+}
+
+bool IOURing::prepRecvMultishot(int fd, uint16_t group, uint64_t userData)
+{
+    struct io_uring_sqe *sqe = (struct io_uring_sqe*) getSQE();
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = userData;
+    return true;
+}
+
+int IOURing::submit()
+{
+    if (mBufRing) {
+        __atomic_store_n(&((struct io_uring_buf_ring*) mBufRing)->tail, mBufTail, __ATOMIC_RELEASE);
+    }
+
+    unsigned count = mSQPending;
+    if (!count) {
+        return 0;
+    }
+    __atomic_store_n(mSQTail, *mSQTail + count, __ATOMIC_RELEASE);
+    mSQPending = 0;
+
+    return syscall(__NR_io_uring_enter, mFd, count, 0, 0, 0, 0);
+}
+
+bool IOURing::reap(Completion &c)
+{
+    if (mCQLocalHead == __atomic_load_n(mCQTail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    const struct io_uring_cqe &cqe = ((struct io_uring_cqe*) mCQEs)[mCQLocalHead & *mCQMask];
+    c.userData = cqe.user_data;
+    c.result = cqe.res;
+    c.more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+    c.hasBuffer = (cqe.flags & IORING_CQE_F_BUFFER) != 0;
+    c.bufferId = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    mCQLocalHead++;
+    return true;
+}
+
+void IOURing::finishReaping()
+{
+    __atomic_store_n(mCQHead, mCQLocalHead, __ATOMIC_RELEASE);
+}
+
+#else  // !HAVE_IO_URING
+
+IOURing::~IOURing() {}
+bool IOURing::init(unsigned entries) { return false; }
+bool IOURing::addBuffers(uint16_t group, unsigned count, unsigned size) { return false; }
+void IOURing::recycleBuffer(unsigned id) {}
+void *IOURing::getSQE() { return 0; }
+bool IOURing::prepAcceptMultishot(int fd, uint64_t userData) { return false; }
+bool IOURing::prepRecvMultishot(int fd, uint16_t group, uint64_t userData) { return false; }
+int IOURing::submit() { return -1; }
+bool IOURing::reap(Completion &c) { return false; }
+void IOURing::finishReaping() {}
+
+#endif
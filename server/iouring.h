@@ -0,0 +1,99 @@
+/*
+ * Minimal io_uring wrapper, for batched socket I/O on Linux
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+
+
+/*
+ * Talks to the kernel directly, so there's no dependency on liburing. The ring's
+ * file descriptor becomes readable when completions are waiting, so it can be
+ * watched from the libev loop alongside everything else.
+ *
+ * On other platforms, or kernels without multishot operations and provided buffer
+ * rings, init() fails and callers use their ordinary libev code instead.
+ */
+
+class IOURing
+{
+public:
+    struct Completion {
+        uint64_t userData;
+        int32_t result;         // Bytes or new fd, or a negative errno
+        bool more;              // Multishot request is still armed
+        bool hasBuffer;
+        unsigned bufferId;
+    };
+
+    IOURing();
+    ~IOURing();
+
+    bool init(unsigned entries);
+    int fd() const { return mFd; }
+
+    // Register a group of equal-sized buffers that receives pick from
+    bool addBuffers(uint16_t group, unsigned count, unsigned size);
+    uint8_t *buffer(unsigned id) { return mBuffers + id * mBufferSize; }
+
+    // Give a buffer back to the kernel. Takes effect at the next submit().
+    void recycleBuffer(unsigned id);
+
+    // Queue requests. These fail only if the submission queue is full and can't be flushed.
+    bool prepAcceptMultishot(int fd, uint64_t userData);
+    bool prepRecvMultishot(int fd, uint16_t group, uint64_t userData);
+
+    // Send everything queued so far, in one system call
+    int submit();
+
+    // Take the next completion, if any. Call finishReaping() after a batch.
+    bool reap(Completion &c);
+    void finishReaping();
+
+private:
+    int mFd;
+
+    // Submission queue
+    uint8_t *mSQRing;
+    unsigned mSQRingSize;
+    unsigned *mSQHead, *mSQTail, *mSQMask, *mSQArray;
+    void *mSQEs;
+    unsigned mSQEntries;
+    unsigned mSQPending;
+
+    // Completion queue
+    uint8_t *mCQRing;
+    unsigned mCQRingSize;
+    unsigned *mCQHead, *mCQTail, *mCQMask;
+    void *mCQEs;
+    unsigned mCQLocalHead;
+
+    // Provided buffers
+    void *mBufRing;
+    unsigned mBufRingSize;
+    unsigned mBufCount;
+    unsigned mBufferSize;
+    uint16_t mBufTail;
+    uint8_t *mBuffers;
+
+    void *getSQE();
+};
@@ -0,0 +1,158 @@
+/*
+ * Per-stage frame latency histograms, and an optional Chrome trace of each frame.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "latencytracer.h"
+#include "util.h"
+#include <algorithm>
+
+
+LatencyTracer::LatencyTracer()
+    : mStartTime(monotonicTime()),
+      mTraceFile(0),
+      mTraceFramesLeft(0),
+      mTraceFirstEvent(true)
+{}
+
+LatencyTracer::~LatencyTracer()
+{
+    closeTrace();
+}
+
+const char *LatencyTracer::stageName(Stage stage)
+{
+    switch (stage) {
+        case STAGE_HOLD:        return "hold";
+        case STAGE_QUEUE:       return "queue";
+        case STAGE_USB:         return "usb";
+        case STAGE_DEVICE:      return "device";
+        case STAGE_INTERPOLATE: return "interpolate";
+        case STAGE_TOTAL:       return "total";
+        default:                return "unknown";
+    }
+}
+
+bool LatencyTracer::openTrace(const char *path, unsigned maxFrames)
+{
+    /*
+     * The trace is a JSON array of events, in the format chrome://tracing loads.
+     * It's written as frames finish, and flushed after each one, so the file is
+     * useful even if the server never exits cleanly. The trace viewer accepts
+     * an array that's missing its closing bracket.
+     */
+
+    closeTrace();
+
+    mTraceFile = fopen(path, "w");
+    if (!mTraceFile) {
+        return false;
+    }
+
+    fputs("[\n", mTraceFile);
+    mTraceFramesLeft = std::max(1u, maxFrames);
+    mTraceFirstEvent = true;
+    return true;
+}
+
+void LatencyTracer::closeTrace()
+{
+    if (mTraceFile) {
+        fputs("\n]\n", mTraceFile);
+        fclose(mTraceFile);
+        mTraceFile = 0;
+    }
+}
+
+unsigned LatencyTracer::sourceIndex(const void *source)
+{
+    std::vector<const void*>::iterator i = std::find(mSources.begin(), mSources.end(), source);
+    if (i != mSources.end()) {
+        return i - mSources.begin();
+    }
+    mSources.push_back(source);
+    return mSources.size() - 1;
+}
+
+void LatencyTracer::nameSource(const void *source, const std::string &name)
+{
+    // Each device shows up in the trace as a separate process
+    unsigned pid = sourceIndex(source) + 1;
+
+    if (mTraceFile) {
+        fprintf(mTraceFile, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"",
+            mTraceFirstEvent ? "" : ",\n", pid);
+        for (std::string::const_iterator c = name.begin(); c != name.end(); ++c) {
+            if (*c == '"' || *c == '\\') {
+                fputc('\\', mTraceFile);
+            }
+            fputc(*c, mTraceFile);
+        }
+        fputs("\"}}", mTraceFile);
+        mTraceFirstEvent = false;
+    }
+}
+
+void LatencyTracer::record(const void *source, Stage stage, unsigned sequence, double begin, double end)
+{
+    double seconds = std::max(0.0, end - begin);
+    mStages[stage].add(seconds);
+
+    if (!mTraceFile) {
+        return;
+    }
+
+    if (stage == STAGE_TOTAL) {
+        // Totals are implied by the stages; they just count frames
+        if (!--mTraceFramesLeft) {
+            closeTrace();
+        } else {
+            fflush(mTraceFile);
+        }
+        return;
+    }
+
+    /*
+     * Async events, with one ID per frame. The viewer gives each frame its own row,
+     * since frames overlap as they move through the pipeline.
+     */
+
+    unsigned pid = sourceIndex(source) + 1;
+    unsigned id = (pid << 16) | (sequence & 0xFFFF);
+    const char *name = stageName(stage);
+
+    fprintf(mTraceFile,
+        "%s{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"b\",\"id\":%u,\"pid\":%u,\"tid\":1,\"ts\":%.1f,\"args\":{\"sequence\":%u}},\n"
+        "{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"e\",\"id\":%u,\"pid\":%u,\"tid\":1,\"ts\":%.1f}",
+        mTraceFirstEvent ? "" : ",\n",
+        name, id, pid, (begin - mStartTime) * 1e6, sequence,
+        name, id, pid, (begin + seconds - mStartTime) * 1e6);
+    mTraceFirstEvent = false;
+}
+
+void LatencyTracer::writeStatus(StatusWriter &w)
+{
+    for (unsigned s = 0; s < NUM_STAGES; ++s) {
+        w.String(stageName(Stage(s))).StartObject();
+        mStages[s].writeStatus(w);
+        w.EndObject();
+    }
+}
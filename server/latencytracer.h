@@ -0,0 +1,77 @@
+/*
+ * Per-stage frame latency histograms, and an optional Chrome trace of each frame.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "histogram.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+
+class LatencyTracer
+{
+public:
+    typedef Histogram::StatusWriter StatusWriter;
+
+    /*
+     * Stages in the life of a frame. Devices report each stage a frame passes
+     * through, with start and end times from monotonicTime().
+     */
+    enum Stage {
+        STAGE_HOLD,             // OPC message received, until its frame is queued for USB
+        STAGE_QUEUE,            // Queued, until submitted to libusb
+        STAGE_USB,              // Submitted, until the transfer completes
+        STAGE_DEVICE,           // Transfer complete, until the device presents the frame
+        STAGE_INTERPOLATE,      // Presented, until the next frame is. The device fades to it meanwhile.
+        STAGE_TOTAL,            // OPC message received, until presented (or completed, without frame status)
+        NUM_STAGES
+    };
+
+    LatencyTracer();
+    ~LatencyTracer();
+
+    // Write every stage of the next 'maxFrames' frames to a Chrome trace file
+    bool openTrace(const char *path, unsigned maxFrames);
+
+    // Name a device, for the trace
+    void nameSource(const void *source, const std::string &name);
+
+    void record(const void *source, Stage stage, unsigned sequence, double begin, double end);
+
+    // Write JSON object members with a histogram for each stage
+    void writeStatus(StatusWriter &w);
+
+private:
+    static const char *stageName(Stage stage);
+    unsigned sourceIndex(const void *source);
+    void closeTrace();
+
+    Histogram mStages[NUM_STAGES];
+    std::vector<const void*> mSources;
+    double mStartTime;
+
+    FILE *mTraceFile;
+    unsigned mTraceFramesLeft;
+    bool mTraceFirstEvent;
+};
@@ -23,12 +23,55 @@
 
 #include "rapidjson/document.h"
 #include "rapidjson/reader.h"
-#include "rapidjson/filestream.h"
 #include "fcserver.h"
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <cstdio>
 
+
+static char *mapConfigFile(const char *path)
+{
+    /*
+     * Map the config file copy-on-write, so it can be parsed in place and the
+     * parsed strings can keep pointing into it for the life of the server.
+     * The file is mapped over a slightly larger anonymous region, so there's
+     * always a page of zeroes following it to terminate the string.
+     */
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return 0;
+    }
+
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t fileSize = st.st_size;
+    size_t mapSize = (fileSize / pageSize + 1) * pageSize;
+
+    void *text = mmap(0, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (text == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+
+    if (fileSize && mmap(text, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(text, mapSize);
+        close(fd);
+        return 0;
+    }
+
+    close(fd);
+    return (char*) text;
+}
+
 int main(int argc, char **argv)
 {
     if (argc != 2) {
@@ -44,15 +87,14 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    FILE *configFile = fopen(argv[1], "r");
-    if (!configFile) {
+    char *configText = mapConfigFile(argv[1]);
+    if (!configText) {
         perror("Error opening config file");
         return 2;
     }
 
-    rapidjson::FileStream istr(configFile);
     rapidjson::Document config;
-    config.ParseStream<0>(istr);
+    config.ParseInsitu<0>(configText);
     if (config.HasParseError()) {
         fprintf(stderr, "Parse error at character %d: %s\n",
             int(config.GetErrorOffset()), config.GetParseError());
@@ -61,7 +103,7 @@ int main(int argc, char **argv)
 
     FCServer server(config);
     if (server.hasError()) {
-        fprintf(stderr, "Configuration errors:\n%s", server.errorText());
+        fprintf(stderr, "Configuration errors:\n%s", server.errorText().c_str());
         return 5;
     }
 
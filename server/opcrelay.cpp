@@ -0,0 +1,491 @@
+/*
+ * Forwards OPC messages to an upstream server
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "opcrelay.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+
+OPCRelay::OPCRelay(bool verbose)
+    : mVerbose(verbose),
+      mAddr(0),
+      mCompress(false),
+      mPingInterval(1.0),
+      mLoop(0),
+      mFd(-1),
+      mConnected(false),
+      mQueueHead(0),
+      mBytesQueued(0),
+      mBytesSent(0),
+      mReplyPos(0),
+      mReplyLength(0),
+      mPingTime(0),
+      mPingsLate(0),
+      mMessages(0),
+      mDropped(0),
+      mBytesIn(0),
+      mPingsLost(0),
+      mConnects(0)
+{
+    // Default is to forward every channel
+    for (unsigned i = 0; i < NUM_CHANNELS; ++i) {
+        mChannels[i] = true;
+    }
+}
+
+OPCRelay::~OPCRelay()
+{
+    if (mLoop) {
+        disconnect();
+        ev_timer_stop(mLoop, &mTimer);
+    }
+    if (mAddr) {
+        freeaddrinfo(mAddr);
+    }
+}
+
+void OPCRelay::parse(const Value &config, std::ostream &error)
+{
+    /*
+     * One entry in the 'relays' list:
+     *
+     *   "connect": [host, port] of the upstream OPC server
+     *   "channels": Optional. List of channels to forward. Channel 0, the broadcast
+     *               channel, is always forwarded. Default is every channel.
+     *   "compress": Optional. true to send pixels as deltas from the previous frame.
+     *   "pingInterval": Optional. Seconds between round trip measurements, and
+     *                   between attempts to reconnect. Default is 1.
+     */
+
+    if (!config.IsObject()) {
+        error << "Each item in 'relays' must be a JSON object.\n";
+        return;
+    }
+
+    const Value &connect = config["connect"];
+    const Value &channels = config["channels"];
+    const Value &compress = config["compress"];
+    const Value &interval = config["pingInterval"];
+
+    if (connect.IsArray() && connect.Size() == 2 && connect[0u].IsString() && connect[1].IsUint()) {
+        std::ostringstream port;
+        port << connect[1].GetUint();
+        mName = std::string(connect[0u].GetString()) + ":" + port.str();
+
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = PF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        if (getaddrinfo(connect[0u].GetString(), port.str().c_str(), &hints, &mAddr) || !mAddr) {
+            error << "Failed to resolve relay hostname '" << connect[0u].GetString() << "'\n";
+            mAddr = 0;
+        }
+    } else {
+        error << "Each relay needs a 'connect' address, as a [host, port] list.\n";
+    }
+
+    if (channels.IsArray()) {
+        for (unsigned i = 1; i < NUM_CHANNELS; ++i) {
+            mChannels[i] = false;
+        }
+        for (unsigned i = 0; i < channels.Size(); ++i) {
+            if (!(channels[i].IsUint() && channels[i].GetUint() < NUM_CHANNELS)) {
+                error << "Relay 'channels' must be a list of channel numbers from 0 to 255.\n";
+                break;
+            }
+            mChannels[channels[i].GetUint()] = true;
+        }
+    } else if (!channels.IsNull()) {
+        error << "Relay 'channels' must be a list of channel numbers from 0 to 255.\n";
+    }
+
+    if (compress.IsBool()) {
+        mCompress = compress.IsTrue();
+    } else if (!compress.IsNull()) {
+        error << "Relay 'compress' must be true or false.\n";
+    }
+
+    if (interval.IsNumber() && interval.GetDouble() > 0) {
+        mPingInterval = interval.GetDouble();
+    } else if (!interval.IsNull()) {
+        error << "Relay 'pingInterval' must be a positive number of seconds.\n";
+    }
+}
+
+void OPCRelay::start(struct ev_loop *loop)
+{
+    mLoop = loop;
+    ev_init(&mIOWrite, cbWrite);
+    ev_init(&mIORead, cbRead);
+    ev_prepare_init(&mFlush, cbFlush);
+
+    // The first timeout is immediate, and connects
+    ev_timer_init(&mTimer, cbTimer, 0, mPingInterval);
+    ev_timer_start(loop, &mTimer);
+}
+
+void OPCRelay::connect()
+{
+    if (!mAddr) {
+        return;
+    }
+
+    mFd = socket(mAddr->ai_family, SOCK_STREAM, 0);
+    if (mFd < 0) {
+        perror("socket");
+        return;
+    }
+
+    int arg = 1;
+    setsockopt(mFd, IPPROTO_TCP, TCP_NODELAY, &arg, sizeof arg);
+    fcntl(mFd, F_SETFL, fcntl(mFd, F_GETFL) | O_NONBLOCK);
+
+    // Finishes in cbWrite
+    if (::connect(mFd, mAddr->ai_addr, mAddr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(mFd);
+        mFd = -1;
+        return;
+    }
+
+    ev_io_set(&mIOWrite, mFd, EV_WRITE);
+    ev_io_start(mLoop, &mIOWrite);
+}
+
+void OPCRelay::disconnect()
+{
+    if (mFd < 0) {
+        return;
+    }
+
+    if (mConnected && mVerbose) {
+        std::clog << "Relay to " << mName << " disconnected\n";
+    }
+
+    ev_io_stop(mLoop, &mIOWrite);
+    ev_io_stop(mLoop, &mIORead);
+    ev_prepare_stop(mLoop, &mFlush);
+    close(mFd);
+    mFd = -1;
+    mConnected = false;
+
+    // Anything unsent is stale by the time we reconnect
+    mQueue.clear();
+    mQueueHead = 0;
+    mQueueTimes.clear();
+    mBytesQueued = mBytesSent;
+    mPingTime = 0;
+    mPingsLate = 0;
+}
+
+void OPCRelay::forward(const OPCSink::Message &msg)
+{
+    if (!mChannels[msg.channel]) {
+        return;
+    }
+
+    // Nothing is kept for later. A frame that can't go now is replaced by the next one.
+    if (!mConnected || mQueue.size() - mQueueHead > MAX_QUEUED) {
+        mDropped++;
+        return;
+    }
+
+    mMessages++;
+    mBytesIn += offsetof(OPCSink::Message, data) + msg.length();
+
+    if (!(mCompress && msg.command == OPCSink::SetPixelColors && queueDelta(msg))) {
+        queueMessage(msg.channel, msg.command, msg.data, msg.length(), msg.receiveTime);
+    }
+}
+
+void OPCRelay::queueMessage(uint8_t channel, uint8_t command, const uint8_t *data,
+    unsigned length, double receiveTime)
+{
+    uint8_t header[offsetof(OPCSink::Message, data)] = { channel, command, uint8_t(length >> 8), uint8_t(length) };
+    mQueue.insert(mQueue.end(), header, header + sizeof header);
+    mQueue.insert(mQueue.end(), data, data + length);
+
+    mBytesQueued += sizeof header + length;
+    if (receiveTime) {
+        mQueueTimes.push_back(std::make_pair(mBytesQueued, receiveTime));
+    }
+    wantFlush();
+}
+
+bool OPCRelay::queueDelta(const OPCSink::Message &msg)
+{
+    /*
+     * Encode pixels as runs against the last frame we sent on this channel. Each run
+     * starts with a byte: 0x00-0x7F for 1-128 new bytes that follow, 0x80-0xFF for
+     * 1-128 unchanged bytes. Bytes past the end of the last frame compare against
+     * zero, and a trailing unchanged run is left off.
+     *
+     * Returns false without queueing anything if the result isn't smaller.
+     */
+
+    const unsigned length = msg.length();
+    const uint8_t *data = msg.data;
+    std::vector<uint8_t> &base = mBase[msg.channel];
+
+    if (base.size() < length) {
+        base.resize(length, 0);
+    }
+
+    uint8_t buffer[sizeof msg.data];
+    unsigned limit = length - std::min(length, OPCSink::SYSEX_ID_LENGTH + 2);
+    unsigned out = 0, end = 0;
+    unsigned i = 0;
+
+    while (i < length && out < limit) {
+        unsigned n = 1;
+
+        if (data[i] == base[i]) {
+            while (i + n < length && n < 128 && data[i + n] == base[i + n]) {
+                n++;
+            }
+            buffer[out++] = 0x7F + n;
+        } else {
+            // Keep going through single unchanged bytes; a run costs as much
+            while (i + n < length && n < 128 && out + n < limit &&
+                !(data[i + n] == base[i + n] && (i + n + 1 == length || data[i + n + 1] == base[i + n + 1]))) {
+                n++;
+            }
+            buffer[out++] = n - 1;
+            memcpy(buffer + out, data + i, n);
+            out += n;
+            end = out;
+        }
+        i += n;
+    }
+
+    unsigned sysexLength = OPCSink::SYSEX_ID_LENGTH + 2 + end;
+    if (i < length || sysexLength >= length) {
+        return false;
+    }
+
+    uint8_t prefix[] = {
+        msg.channel, OPCSink::SystemExclusive, uint8_t(sysexLength >> 8), uint8_t(sysexLength),
+        0, 0, 0, 0, uint8_t(length >> 8), uint8_t(length)
+    };
+    OPCSink::putSysExId(prefix + 4, OPCSink::FCDeltaPixelColors);
+    mQueue.insert(mQueue.end(), prefix, prefix + sizeof prefix);
+    mQueue.insert(mQueue.end(), buffer, buffer + end);
+
+    mBytesQueued += sizeof prefix + end;
+    mQueueTimes.push_back(std::make_pair(mBytesQueued, msg.receiveTime));
+    wantFlush();
+
+    base.assign(data, data + length);
+    return true;
+}
+
+void OPCRelay::wantFlush()
+{
+    // Unless we're already waiting for the socket to drain
+    if (!ev_is_active(&mFlush) && !ev_is_active(&mIOWrite)) {
+        ev_prepare_start(mLoop, &mFlush);
+    }
+}
+
+void OPCRelay::flush()
+{
+    while (mQueueHead < mQueue.size()) {
+        ssize_t r = send(mFd, &mQueue[mQueueHead], mQueue.size() - mQueueHead, MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (mVerbose) {
+                std::clog << "Relay to " << mName << ": " << strerror(errno) << "\n";
+            }
+            disconnect();
+            return;
+        }
+        mQueueHead += r;
+        mBytesSent += r;
+    }
+
+    // Messages are done once the kernel has all of them
+    double now = monotonicTime();
+    while (!mQueueTimes.empty() && mQueueTimes.front().first <= mBytesSent) {
+        mQueueLatency.add(now - mQueueTimes.front().second);
+        mQueueTimes.pop_front();
+    }
+
+    if (mQueueHead == mQueue.size()) {
+        mQueue.clear();
+        mQueueHead = 0;
+        ev_io_stop(mLoop, &mIOWrite);
+    } else {
+        if (mQueueHead > mQueue.size() / 2) {
+            mQueue.erase(mQueue.begin(), mQueue.begin() + mQueueHead);
+            mQueueHead = 0;
+        }
+        ev_io_start(mLoop, &mIOWrite);
+    }
+}
+
+void OPCRelay::receiveReplies(const uint8_t *data, unsigned length)
+{
+    /*
+     * Keep the header and first four data bytes of each reply, which is enough to
+     * recognize Query Status, and skip the rest.
+     */
+
+    while (length) {
+        if (mReplyPos < sizeof mReplyHeader) {
+            mReplyHeader[mReplyPos++] = *data++;
+            length--;
+        } else {
+            unsigned n = std::min(length, 4 + mReplyLength - mReplyPos);
+            mReplyPos += n;
+            data += n;
+            length -= n;
+        }
+
+        if (mReplyPos == 4) {
+            mReplyLength = mReplyHeader[3] | (unsigned(mReplyHeader[2]) << 8);
+        }
+        if (mReplyPos < 4 || mReplyPos < 4 + mReplyLength) {
+            continue;
+        }
+
+        if (mReplyHeader[1] == OPCSink::SystemExclusive && mReplyLength >= OPCSink::SYSEX_ID_LENGTH &&
+            OPCSink::sysExId(mReplyHeader + 4) == OPCSink::FCQueryStatus) {
+            if (mPingsLate) {
+                // Replies come in order, so this one belongs to a ping we gave up on
+                mPingsLate--;
+            } else if (mPingTime) {
+                mRoundTrip.add(monotonicTime() - mPingTime);
+                mPingTime = 0;
+            }
+        }
+        mReplyPos = 0;
+    }
+}
+
+void OPCRelay::cbWrite(struct ev_loop *loop, struct ev_io *watcher, int revents)
+{
+    OPCRelay *self = container_of(watcher, OPCRelay, mIOWrite);
+
+    if (!self->mConnected) {
+        int err = 0;
+        socklen_t len = sizeof err;
+        getsockopt(watcher->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            // Try again on the next timer
+            self->disconnect();
+            return;
+        }
+
+        self->mConnected = true;
+        self->mConnects++;
+        self->mReplyPos = 0;
+        for (unsigned i = 0; i < NUM_CHANNELS; ++i) {
+            // The upstream server has no frames from this connection yet
+            self->mBase[i].clear();
+        }
+
+        ev_io_set(&self->mIORead, watcher->fd, EV_READ);
+        ev_io_start(loop, &self->mIORead);
+
+        if (self->mVerbose) {
+            std::clog << "Relay connected to " << self->mName << "\n";
+        }
+    }
+
+    self->flush();
+}
+
+void OPCRelay::cbRead(struct ev_loop *loop, struct ev_io *watcher, int revents)
+{
+    OPCRelay *self = container_of(watcher, OPCRelay, mIORead);
+    uint8_t buffer[4096];
+
+    ssize_t r = recv(watcher->fd, buffer, sizeof buffer, 0);
+    if (r > 0) {
+        self->receiveReplies(buffer, r);
+    } else if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        self->disconnect();
+    }
+}
+
+void OPCRelay::cbTimer(struct ev_loop *loop, struct ev_timer *watcher, int revents)
+{
+    OPCRelay *self = container_of(watcher, OPCRelay, mTimer);
+
+    if (self->mFd < 0) {
+        self->connect();
+        return;
+    }
+
+    if (self->mPingTime && monotonicTime() - self->mPingTime > PING_TIMEOUT * self->mPingInterval) {
+        // Lost, or the upstream server doesn't answer Query Status. Don't wait on it forever.
+        self->mPingsLost++;
+        self->mPingsLate++;
+        self->mPingTime = 0;
+    }
+
+    if (self->mConnected && !self->mPingTime) {
+        // Query Status, queued behind any frames, so the round trip includes their wait
+        uint8_t query[OPCSink::SYSEX_ID_LENGTH];
+        OPCSink::putSysExId(query, OPCSink::FCQueryStatus);
+        self->queueMessage(0, OPCSink::SystemExclusive, query, sizeof query, 0);
+        self->mPingTime = monotonicTime();
+    }
+}
+
+void OPCRelay::cbFlush(struct ev_loop *loop, struct ev_prepare *watcher, int revents)
+{
+    OPCRelay *self = container_of(watcher, OPCRelay, mFlush);
+    ev_prepare_stop(loop, watcher);
+    self->flush();
+}
+
+void OPCRelay::writeStatus(StatusWriter &w)
+{
+    w.String("upstream").String(mName.c_str());
+    w.String("connected").Bool(mConnected);
+    w.String("connects").Uint(mConnects);
+    w.String("messages").Uint64(mMessages);
+    w.String("dropped").Uint64(mDropped);
+    w.String("bytesIn").Uint64(mBytesIn);
+    w.String("bytesOut").Uint64(mBytesSent);
+    w.String("pingsLost").Uint64(mPingsLost);
+    w.String("queue").StartObject();
+    mQueueLatency.writeStatus(w);
+    w.EndObject();
+    w.String("roundTrip").StartObject();
+    mRoundTrip.writeStatus(w);
+    w.EndObject();
+}
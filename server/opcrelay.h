@@ -0,0 +1,128 @@
+/*
+ * Forwards OPC messages to an upstream server
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "rapidjson/document.h"
+#include "opcsink.h"
+#include "histogram.h"
+#include <ev.h>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+#include <netdb.h>
+
+
+/*
+ * One entry in the 'relays' list. Messages on the relay's channels are copied
+ * to another OPC server over a TCP connection that stays open, and reconnects
+ * if it drops. Everything queued during one pass through the event loop goes
+ * out in a single send.
+ *
+ * With compression, Set Pixel Colors messages are sent as a delta against the
+ * previous frame on that channel, in a Fadecandy SysEx message. Upstream
+ * servers decode these in OPCSink.
+ *
+ * The relay also sends a Query Status message periodically, and times the
+ * reply to measure the round trip through the upstream server.
+ */
+
+class OPCRelay
+{
+public:
+    typedef rapidjson::Value Value;
+    typedef Histogram::StatusWriter StatusWriter;
+
+    OPCRelay(bool verbose);
+    ~OPCRelay();
+
+    // Check the configuration, appending any errors
+    void parse(const Value &config, std::ostream &error);
+
+    void start(struct ev_loop *loop);
+
+    // Queue a copy of the message, if it's on one of this relay's channels
+    void forward(const OPCSink::Message &msg);
+
+    // Write JSON object members describing the connection
+    void writeStatus(StatusWriter &w);
+
+private:
+    static const unsigned NUM_CHANNELS = 256;
+    static const unsigned MAX_QUEUED = 1 << 20;    // Bytes waiting to send, before we drop messages
+    static const unsigned PING_TIMEOUT = 4;        // Ping intervals without a reply, before we count it lost
+
+    bool mVerbose;
+    struct addrinfo *mAddr;
+    std::string mName;                  // host:port, for messages
+    bool mChannels[NUM_CHANNELS];
+    bool mCompress;
+    double mPingInterval;
+
+    struct ev_loop *mLoop;
+    int mFd;
+    bool mConnected;
+    struct ev_io mIOWrite;
+    struct ev_io mIORead;
+    struct ev_timer mTimer;             // Reconnects and pings
+    struct ev_prepare mFlush;           // Sends the queue, before the event loop sleeps
+
+    // Outgoing bytes, and the receive time of each message in them
+    std::vector<uint8_t> mQueue;
+    unsigned mQueueHead;
+    uint64_t mBytesQueued;
+    uint64_t mBytesSent;
+    std::deque< std::pair<uint64_t, double> > mQueueTimes;
+
+    // Last frame sent on each channel, the reference for deltas
+    std::vector<uint8_t> mBase[NUM_CHANNELS];
+
+    // Replies from upstream. We only look at each header and the start of its data.
+    uint8_t mReplyHeader[8];
+    unsigned mReplyPos;
+    unsigned mReplyLength;
+    double mPingTime;                   // Outstanding Query Status, or 0
+    unsigned mPingsLate;                // Replies still owed for pings that timed out
+
+    Histogram mQueueLatency;
+    Histogram mRoundTrip;
+    uint64_t mMessages;
+    uint64_t mDropped;
+    uint64_t mBytesIn;
+    uint64_t mPingsLost;
+    unsigned mConnects;
+
+    void connect();
+    void disconnect();
+    void queueMessage(uint8_t channel, uint8_t command, const uint8_t *data, unsigned length, double receiveTime);
+    bool queueDelta(const OPCSink::Message &msg);
+    void wantFlush();
+    void flush();
+    void receiveReplies(const uint8_t *data, unsigned length);
+
+    static void cbWrite(struct ev_loop *loop, struct ev_io *watcher, int revents);
+    static void cbRead(struct ev_loop *loop, struct ev_io *watcher, int revents);
+    static void cbTimer(struct ev_loop *loop, struct ev_timer *watcher, int revents);
+    static void cbFlush(struct ev_loop *loop, struct ev_prepare *watcher, int revents);
+};
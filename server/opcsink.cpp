@@ -26,25 +26,46 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <iostream>
+#include <algorithm>
 
 
+struct OPCSink::DatagramArena {
+    Message messages[DATAGRAM_BATCH];
+    unsigned lengths[DATAGRAM_BATCH];
+    struct sockaddr_storage addrs[DATAGRAM_BATCH];
+    socklen_t addrLens[DATAGRAM_BATCH];
+#ifdef __linux__
+    struct iovec iov[DATAGRAM_BATCH];
+    struct mmsghdr headers[DATAGRAM_BATCH];
+#endif
+};
+
 OPCSink::OPCSink(callback_t cb, void *context, bool verbose)
-    : mVerbose(verbose), mCallback(cb), mContext(context) {}
+    : mVerbose(verbose), mReusePort(false), mMulticast(false), mCallback(cb), mContext(context), mLoop(0), mReplyFd(-1), mReplyAddr(0),
+      mReplyAddrLen(0), mReplyClient(0), mRing(0), mBatchCallback(0), mArena(0) {}
+
+OPCSink::~OPCSink()
+{
+    delete mRing;
+    delete mArena;
+}
 
-void OPCSink::start(struct ev_loop *loop, struct addrinfo *listenAddr)
+void OPCSink::start(struct ev_loop *loop, struct addrinfo *listenAddr, bool ioUring)
 {
+    mLoop = loop;
+
     int sock = socket(PF_INET, SOCK_STREAM, 0);
     if (sock < 0) {
         perror("socket");
         return;
     }
 
-    int arg = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &arg, sizeof arg);
+    setSocketOptions(sock);
 
     if (bind(sock, listenAddr->ai_addr, listenAddr->ai_addrlen)) {
         perror("bind");
@@ -56,41 +77,95 @@ void OPCSink::start(struct ev_loop *loop, struct addrinfo *listenAddr)
         return;
     }
 
-    // Get a callback when we're ready to accept a new connection
-    ev_io_init(&mIOAccept, cbAccept, sock, EV_READ);
-    ev_io_start(loop, &mIOAccept);
-
     if (mVerbose) {
         struct sockaddr_in *sin = (struct sockaddr_in*) listenAddr->ai_addr;
         std::clog << "Listening on " << inet_ntoa(sin->sin_addr) << ":" << ntohs(sin->sin_port) << "\n";
     }
+
+    if (ioUring) {
+        if (startIOUring(loop, sock)) {
+            return;
+        }
+        if (mVerbose) {
+            std::clog << "io_uring isn't available, using ordinary sockets\n";
+        }
+    }
+
+    // Get a callback when we're ready to accept a new connection
+    ev_io_init(&mIOAccept, cbAccept, sock, EV_READ);
+    ev_io_start(loop, &mIOAccept);
 }
 
-void OPCSink::cbAccept(struct ev_loop *loop, struct ev_io *watcher, int revents)
+void OPCSink::setSocketOptions(int sock)
 {
-    OPCSink *self = container_of(watcher, OPCSink, mIOAccept);
-    struct sockaddr_in clientAddr;
-    socklen_t clientAddrLen = sizeof clientAddr;
+    int arg = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &arg, sizeof arg);
 
-    int sock = accept(watcher->fd, (struct sockaddr *)&clientAddr, &clientAddrLen);
-    if (sock < 0) {
-        perror("accept");
-        return;
+    if (mReusePort) {
+#ifdef SO_REUSEPORT
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &arg, sizeof arg) < 0) {
+            perror("SO_REUSEPORT");
+        }
+#else
+        std::clog << "SO_REUSEPORT isn't supported on this platform\n";
+#endif
     }
+}
 
+void OPCSink::setMulticast(struct in_addr group, struct in_addr interface)
+{
+    mMulticast = true;
+    mMulticastRequest.imr_multiaddr = group;
+    mMulticastRequest.imr_interface = interface;
+}
+
+OPCSink::Client *OPCSink::newClient(struct ev_loop *loop, int sock)
+{
     int arg = 1;
     setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &arg, sizeof arg);
 
     Client *cli = new Client();
     cli->bufferPos = 0;
-    cli->self = self;
-
+    cli->self = this;
+    cli->delta = 0;
     ev_io_init(&cli->ioRead, cbRead, sock, EV_READ);
-    ev_io_start(loop, &cli->ioRead);
+    ev_io_init(&cli->ioWrite, cbWrite, sock, EV_WRITE);
 
-    if (self->mVerbose) {
+    if (mVerbose) {
+        struct sockaddr_in clientAddr;
+        socklen_t clientAddrLen = sizeof clientAddr;
+        getpeername(sock, (struct sockaddr *)&clientAddr, &clientAddrLen);
         std::clog << "Client connected from " << inet_ntoa(clientAddr.sin_addr) << "\n";
     }
+
+    return cli;
+}
+
+void OPCSink::closeClient(struct ev_loop *loop, Client *cli)
+{
+    if (mVerbose) {
+        std::clog << "Client disconnected\n";
+    }
+
+    ev_io_stop(loop, &cli->ioRead);
+    ev_io_stop(loop, &cli->ioWrite);
+    close(cli->ioRead.fd);
+    delete cli->delta;
+    delete cli;
+}
+
+void OPCSink::cbAccept(struct ev_loop *loop, struct ev_io *watcher, int revents)
+{
+    OPCSink *self = container_of(watcher, OPCSink, mIOAccept);
+
+    int sock = accept(watcher->fd, 0, 0);
+    if (sock < 0) {
+        perror("accept");
+        return;
+    }
+
+    Client *cli = self->newClient(loop, sock);
+    ev_io_start(loop, &cli->ioRead);
 }
 
 void OPCSink::cbRead(struct ev_loop *loop, struct ev_io *watcher, int revents)
@@ -98,8 +173,9 @@ void OPCSink::cbRead(struct ev_loop *loop, struct ev_io *watcher, int revents)
     Client *cli = container_of(watcher, Client, ioRead);
     OPCSink *self = cli->self;
 
+    const unsigned bufferSize = offsetof(Message, data) + sizeof cli->buffer.data;
     int r = recv(watcher->fd, cli->bufferPos + (uint8_t*)&cli->buffer,
-        sizeof(cli->buffer) - cli->bufferPos, 0);
+        bufferSize - cli->bufferPos, 0);
 
     if (r < 0) {
         perror("read error");
@@ -108,28 +184,425 @@ void OPCSink::cbRead(struct ev_loop *loop, struct ev_io *watcher, int revents)
 
     if (r == 0) {
         // Client disconnecting
-
-        if (self->mVerbose) {
-            std::clog << "Client disconnected\n";
-        }
-
-        ev_io_stop(loop, watcher);
-        delete cli;
+        self->closeClient(loop, cli);
         return;
     }
 
     cli->bufferPos += r;
-    if (cli->bufferPos >= offsetof(Message, data)) {
+    self->dispatch(cli);
+}
+
+void OPCSink::receive(Client *cli, const uint8_t *data, unsigned length)
+{
+    /*
+     * Append data that was received elsewhere to the client's buffer. The buffer
+     * always has room for at least the rest of the message in progress.
+     */
+
+    const unsigned bufferSize = offsetof(Message, data) + sizeof cli->buffer.data;
+
+    while (length) {
+        unsigned chunk = std::min(length, bufferSize - cli->bufferPos);
+        memcpy(cli->bufferPos + (uint8_t*)&cli->buffer, data, chunk);
+        cli->bufferPos += chunk;
+        data += chunk;
+        length -= chunk;
+        dispatch(cli);
+    }
+}
+
+void OPCSink::dispatch(Client *cli)
+{
+    // Handle every complete message in the buffer
+
+    while (cli->bufferPos >= offsetof(Message, data)) {
         // We have a header, at least.
 
         unsigned length = offsetof(Message, data) + cli->buffer.length();
-        if (cli->bufferPos >= length) {
-            // Complete packet.
-            self->mCallback(cli->buffer, self->mContext);
+        if (cli->bufferPos < length) {
+            break;
+        }
+
+        // Complete packet.
+        cli->buffer.receiveTime = monotonicTime();
+        mReplyFd = cli->ioRead.fd;
+        mReplyClient = cli;
+        if (!decodeDelta(cli)) {
+            mCallback(cli->buffer, mContext);
+        }
+        mReplyFd = -1;
+        mReplyClient = 0;
+
+        // Save any part of the following packet we happened to grab.
+        memmove(&cli->buffer, length + (uint8_t*)&cli->buffer, cli->bufferPos - length);
+        cli->bufferPos -= length;
+    }
+}
+
+bool OPCSink::decodeDelta(Client *cli)
+{
+    /*
+     * Delta Pixel Colors, from another server's relay. Rebuild the Set Pixel Colors
+     * message it stands for, from the last frame this client sent on the channel,
+     * and pass that on instead. Returns false for any other message.
+     *
+     * After the SysEx header is the frame length, then runs that each start with
+     * a byte: 0x00-0x7F for 1-128 new bytes that follow, 0x80-0xFF for 1-128
+     * unchanged bytes.
+     */
+
+    const Message &in = cli->buffer;
+    const unsigned inLength = in.length();
+
+    if (sysExId(in) != FCDeltaPixelColors || inLength < SYSEX_ID_LENGTH + 2) {
+        return false;
+    }
+
+    if (!cli->delta) {
+        cli->delta = new DeltaState();
+    }
+
+    Message &out = cli->delta->message;
+    std::vector<uint8_t> &base = cli->delta->base[in.channel];
+    const unsigned length = (unsigned(in.data[SYSEX_ID_LENGTH]) << 8) | in.data[SYSEX_ID_LENGTH + 1];
+    const uint8_t *p = in.data + SYSEX_ID_LENGTH + 2;
+    const uint8_t *end = in.data + inLength;
+    unsigned pos = 0;
+
+    base.resize(length, 0);
+
+    while (p < end) {
+        unsigned n = (*p & 0x7F) + 1;
+        bool literal = !(*p++ & 0x80);
+
+        if (pos + n > length || (literal && unsigned(end - p) < n)) {
+            if (mVerbose) {
+                std::clog << "Dropping corrupted Delta Pixel Colors message\n";
+            }
+            return true;
+        }
+        if (literal) {
+            memcpy(&base[pos], p, n);
+            p += n;
+        }
+        pos += n;
+    }
+
+    out.channel = in.channel;
+    out.command = SetPixelColors;
+    out.lenHigh = in.data[SYSEX_ID_LENGTH];
+    out.lenLow = in.data[SYSEX_ID_LENGTH + 1];
+    out.receiveTime = in.receiveTime;
+    if (length) {
+        memcpy(out.data, &base[0], length);
+    }
+
+    mCallback(out, mContext);
+    return true;
+}
+
+bool OPCSink::startIOUring(struct ev_loop *loop, int sock)
+{
+    mRing = new IOURing();
+
+    if (!mRing->init(RING_ENTRIES) ||
+        !mRing->addBuffers(RECV_BUFFER_GROUP, RECV_BUFFERS, RECV_BUFFER_SIZE) ||
+        !mRing->prepAcceptMultishot(sock, ACCEPT_TAG) ||
+        mRing->submit() < 0) {
+        delete mRing;
+        mRing = 0;
+        return false;
+    }
+
+    // Completions make the ring readable
+    ev_io_init(&mIORing, cbRing, mRing->fd(), EV_READ);
+    ev_io_start(loop, &mIORing);
+    ev_io_init(&mIOAccept, cbAccept, sock, EV_READ);
+
+    if (mVerbose) {
+        std::clog << "Using io_uring for OPC sockets\n";
+    }
+    return true;
+}
+
+void OPCSink::cbRing(struct ev_loop *loop, struct ev_io *watcher, int revents)
+{
+    /*
+     * Handle every completion that's waiting, then rearm anything that stopped,
+     * recycle the buffers we used, and submit it all at once.
+     */
+
+    OPCSink *self = container_of(watcher, OPCSink, mIORing);
+    IOURing *ring = self->mRing;
+    IOURing::Completion c;
+
+    while (ring->reap(c)) {
+        if (c.userData == ACCEPT_TAG) {
+            if (c.result >= 0) {
+                Client *cli = self->newClient(loop, c.result);
+                if (!ring->prepRecvMultishot(cli->ioRead.fd, RECV_BUFFER_GROUP, uint64_t(uintptr_t(cli)))) {
+                    ev_io_start(loop, &cli->ioRead);
+                }
+            } else if (self->mVerbose) {
+                std::clog << "accept: " << strerror(-c.result) << "\n";
+            }
+
+            if (!c.more && (c.result == -EINVAL || !ring->prepAcceptMultishot(self->mIOAccept.fd, ACCEPT_TAG))) {
+                // Kernel doesn't do multishot accept after all
+                ev_io_start(loop, &self->mIOAccept);
+            }
+            continue;
+        }
+
+        Client *cli = reinterpret_cast<Client*>(uintptr_t(c.userData));
+
+        if (c.result > 0 && c.hasBuffer) {
+            self->receive(cli, ring->buffer(c.bufferId), c.result);
+            ring->recycleBuffer(c.bufferId);
+            if (!c.more && !ring->prepRecvMultishot(cli->ioRead.fd, RECV_BUFFER_GROUP, c.userData)) {
+                ev_io_start(loop, &cli->ioRead);
+            }
+
+        } else if (c.result == -ENOBUFS) {
+            // We fell behind and ran out of buffers. They're recycled by the time this is submitted.
+            if (!ring->prepRecvMultishot(cli->ioRead.fd, RECV_BUFFER_GROUP, c.userData)) {
+                ev_io_start(loop, &cli->ioRead);
+            }
+
+        } else if (c.result == -EINVAL) {
+            // No multishot receive. Read this client the ordinary way.
+            ev_io_start(loop, &cli->ioRead);
+
+        } else {
+            if (c.result < 0 && self->mVerbose) {
+                std::clog << "read error: " << strerror(-c.result) << "\n";
+            }
+            self->closeClient(loop, cli);
+        }
+    }
+
+    ring->finishReaping();
+    ring->submit();
+}
+
+void OPCSink::startDatagram(struct ev_loop *loop, struct addrinfo *listenAddr)
+{
+    mLoop = loop;
+
+    int sock = socket(PF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return;
+    }
 
-            // Save any part of the following packet we happened to grab.
-            memmove(&cli->buffer, length + (uint8_t*)&cli->buffer, cli->bufferPos - length);
-            cli->bufferPos -= length;
+    setSocketOptions(sock);
+
+    // Room for a burst of datagrams between wakeups
+    int arg = 1 << 20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &arg, sizeof arg);
+
+    if (bind(sock, listenAddr->ai_addr, listenAddr->ai_addrlen)) {
+        perror("bind");
+        return;
+    }
+
+    if (mMulticast && setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+        &mMulticastRequest, sizeof mMulticastRequest) < 0) {
+        perror("IP_ADD_MEMBERSHIP");
+    }
+
+    mArena = new DatagramArena();
+
+#ifdef __linux__
+    for (unsigned i = 0; i < DATAGRAM_BATCH; ++i) {
+        mArena->iov[i].iov_base = &mArena->messages[i];
+        mArena->iov[i].iov_len = offsetof(Message, data) + sizeof mArena->messages[i].data;
+        memset(&mArena->headers[i], 0, sizeof mArena->headers[i]);
+        mArena->headers[i].msg_hdr.msg_iov = &mArena->iov[i];
+        mArena->headers[i].msg_hdr.msg_iovlen = 1;
+        mArena->headers[i].msg_hdr.msg_name = &mArena->addrs[i];
+    }
+#endif
+
+    ev_io_init(&mIODatagram, cbDatagram, sock, EV_READ);
+    ev_io_start(loop, &mIODatagram);
+
+    if (mVerbose) {
+        struct sockaddr_in *sin = (struct sockaddr_in*) listenAddr->ai_addr;
+        std::clog << "Listening for datagrams on " << inet_ntoa(sin->sin_addr) << ":" << ntohs(sin->sin_port) << "\n";
+    }
+}
+
+int OPCSink::receiveDatagrams(int fd)
+{
+    /*
+     * Fill the arena with as many waiting datagrams as it holds, without blocking.
+     * Returns the number received. On Linux that's one system call.
+     */
+
+    DatagramArena *a = mArena;
+
+#ifdef __linux__
+    for (unsigned i = 0; i < DATAGRAM_BATCH; ++i) {
+        a->headers[i].msg_hdr.msg_namelen = sizeof a->addrs[i];
+    }
+
+    int count = recvmmsg(fd, a->headers, DATAGRAM_BATCH, MSG_DONTWAIT, 0);
+    for (int i = 0; i < count; ++i) {
+        a->lengths[i] = a->headers[i].msg_len;
+        a->addrLens[i] = a->headers[i].msg_hdr.msg_namelen;
+    }
+    return count;
+#else
+    int count = 0;
+    while (count < int(DATAGRAM_BATCH)) {
+        a->addrLens[count] = sizeof a->addrs[count];
+        ssize_t r = recvfrom(fd, &a->messages[count], offsetof(Message, data) + sizeof a->messages[count].data,
+            MSG_DONTWAIT, (struct sockaddr*) &a->addrs[count], &a->addrLens[count]);
+        if (r < 0) {
+            break;
         }
+        a->lengths[count++] = r;
+    }
+    return count;
+#endif
+}
+
+void OPCSink::cbDatagram(struct ev_loop *loop, struct ev_io *watcher, int revents)
+{
+    OPCSink *self = container_of(watcher, OPCSink, mIODatagram);
+    DatagramArena *a = self->mArena;
+    bool batchStarted = false;
+
+    for (unsigned round = 0; round < DATAGRAM_ROUNDS; ++round) {
+        int count = self->receiveDatagrams(watcher->fd);
+        if (count <= 0) {
+            break;
+        }
+
+        if (!batchStarted && self->mBatchCallback) {
+            self->mBatchCallback(true, self->mContext);
+            batchStarted = true;
+        }
+
+        double now = monotonicTime();
+        for (int i = 0; i < count; ++i) {
+            Message &msg = a->messages[i];
+
+            if (a->lengths[i] < offsetof(Message, data) ||
+                a->lengths[i] < offsetof(Message, data) + msg.length()) {
+                if (self->mVerbose) {
+                    std::clog << "Dropping truncated OPC datagram\n";
+                }
+                continue;
+            }
+
+            msg.receiveTime = now;
+            self->mReplyFd = watcher->fd;
+            self->mReplyAddr = (const struct sockaddr*) &a->addrs[i];
+            self->mReplyAddrLen = a->addrLens[i];
+            self->mCallback(msg, self->mContext);
+            self->mReplyFd = -1;
+            self->mReplyAddr = 0;
+        }
+
+        if (count < int(DATAGRAM_BATCH)) {
+            break;
+        }
+    }
+
+    if (batchStarted) {
+        self->mBatchCallback(false, self->mContext);
+    }
+}
+
+void OPCSink::reply(uint8_t channel, uint8_t command, const void *data, unsigned length)
+{
+    /*
+     * Send without blocking. Datagram replies the socket can't take are lost, like
+     * any datagram. On a stream, whatever the socket doesn't take is queued and
+     * finished from cbWrite(), since half a message would throw off the client's
+     * framing for good. Replies to a client that has stopped reading are dropped
+     * whole once its queue is full.
+     */
+
+    if (mReplyFd < 0) {
+        return;
+    }
+    if (length > MAX_REPLY) {
+        if (mVerbose) {
+            std::clog << "OPC reply of " << length << " bytes is too long for one message\n";
+        }
+        return;
+    }
+
+    uint8_t header[offsetof(Message, data)] = { channel, command, uint8_t(length >> 8), uint8_t(length) };
+    const uint8_t *bytes = static_cast<const uint8_t*>(data);
+    Client *cli = mReplyClient;
+
+    if (cli && !cli->outbox.empty()) {
+        // Keep replies in order behind the ones already waiting
+        if (cli->outbox.size() + sizeof header + length > MAX_OUTBOX) {
+            if (mVerbose) {
+                std::clog << "OPC client isn't reading replies, dropping one\n";
+            }
+            return;
+        }
+        cli->outbox.insert(cli->outbox.end(), header, header + sizeof header);
+        cli->outbox.insert(cli->outbox.end(), bytes, bytes + length);
+        return;
+    }
+
+    struct iovec iov[2] = {
+        { header, sizeof header },
+        { const_cast<void*>(data), length },
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_name = const_cast<struct sockaddr*>(mReplyAddr);
+    msg.msg_namelen = mReplyAddr ? mReplyAddrLen : 0;
+
+    ssize_t r = sendmsg(mReplyFd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (r == ssize_t(sizeof header + length)) {
+        return;
+    }
+
+    if (!cli || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        if (mVerbose) {
+            std::clog << "Couldn't send reply to OPC client\n";
+        }
+        return;
+    }
+
+    // Queue the rest, and finish sending when the socket has room
+    size_t sent = r < 0 ? 0 : r;
+    for (unsigned i = 0; i < 2; ++i) {
+        const uint8_t *base = static_cast<const uint8_t*>(iov[i].iov_base);
+        size_t skip = std::min(sent, iov[i].iov_len);
+        cli->outbox.insert(cli->outbox.end(), base + skip, base + iov[i].iov_len);
+        sent -= skip;
+    }
+    ev_io_start(mLoop, &cli->ioWrite);
+}
+
+void OPCSink::cbWrite(struct ev_loop *loop, struct ev_io *watcher, int revents)
+{
+    Client *cli = container_of(watcher, Client, ioWrite);
+
+    ssize_t r = send(watcher->fd, &cli->outbox[0], cli->outbox.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (r < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        // Connection is going away. The read side will notice and close it.
+        cli->outbox.clear();
+    } else {
+        cli->outbox.erase(cli->outbox.begin(), cli->outbox.begin() + r);
+    }
+
+    if (cli->outbox.empty()) {
+        ev_io_stop(loop, watcher);
     }
 }
@@ -22,11 +22,13 @@
  */
 
 #pragma once
+#include "iouring.h"
 #include <ev.h>
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <vector>
 
 
 class OPCSink {
@@ -39,7 +41,11 @@ public:
     // SysEx system and command IDs
     enum SysEx {
         FCSetGlobalColorCorrection = 0x00010001,
-        FCSetFirmwareConfiguration = 0x00010002
+        FCSetFirmwareConfiguration = 0x00010002,
+        FCQueryStatus = 0x00010003,
+        FCDeltaPixelColors = 0x00010004,
+        FCCommitFrame = 0x00010005,
+        FCTestPattern = 0x00010006
     };
 
     struct Message
@@ -50,29 +56,134 @@ public:
         uint8_t lenLow;
         uint8_t data[0xFFFF];
 
+        // When the last byte arrived, from monotonicTime(). Not part of the wire format.
+        double receiveTime;
+
         unsigned length() const {
             return lenLow | (unsigned(lenHigh) << 8);
         }
     };
 
+    // System ID and SysEx ID, at the start of a System Exclusive message's data
+    static const unsigned SYSEX_ID_LENGTH = 4;
+
+    static unsigned sysExId(const uint8_t *data) {
+        return (unsigned(data[0]) << 24) | (unsigned(data[1]) << 16) | (unsigned(data[2]) << 8) | data[3];
+    }
+
+    static void putSysExId(uint8_t *data, unsigned id) {
+        data[0] = id >> 24;
+        data[1] = id >> 16;
+        data[2] = id >> 8;
+        data[3] = id;
+    }
+
+    // ID of a System Exclusive message, or 0 for any other message
+    static unsigned sysExId(const Message &msg) {
+        return msg.command == SystemExclusive && msg.length() >= SYSEX_ID_LENGTH ? sysExId(msg.data) : 0;
+    }
+
     typedef void (*callback_t)(Message &msg, void *context);
 
+    // Called before and after each batch of messages that arrived together
+    typedef void (*batch_callback_t)(bool begin, void *context);
+
     OPCSink(callback_t cb, void *context, bool verbose = false);
-    void start(struct ev_loop *loop, struct addrinfo *listenAddr);
+    ~OPCSink();
+
+    // Optionally receive through io_uring. Falls back on libev if the kernel can't.
+    void start(struct ev_loop *loop, struct addrinfo *listenAddr, bool ioUring = false);
+
+    // Receive one message per UDP datagram, instead of a TCP stream
+    void startDatagram(struct ev_loop *loop, struct addrinfo *listenAddr);
+    void setBatchCallback(batch_callback_t cb) { mBatchCallback = cb; }
+
+    // Let other processes bind the same address and port. Call before starting.
+    void setReusePort(bool enable) { mReusePort = enable; }
+
+    // Join an IPv4 multicast group on a local interface, when starting a datagram socket
+    void setMulticast(struct in_addr group, struct in_addr interface);
+
+    // During a message callback, send a message back to the client it came from
+    void reply(uint8_t channel, uint8_t command, const void *data, unsigned length);
+
+    // Largest reply that fits in one message
+    static const unsigned MAX_REPLY = 0xFFFF;
 
 private:
     bool mVerbose;
+    bool mReusePort;
+    bool mMulticast;
+    struct ip_mreq mMulticastRequest;
     callback_t mCallback;
     void *mContext;
     struct ev_io mIOAccept;
+    struct ev_loop *mLoop;
+    int mReplyFd;
+    const struct sockaddr *mReplyAddr;     // Datagram sender, or NULL
+    socklen_t mReplyAddrLen;
+
+    // Decoded Delta Pixel Colors messages, and the last frame on each channel
+    struct DeltaState {
+        Message message;
+        std::vector<uint8_t> base[256];
+    };
 
     struct Client {
         struct ev_io ioRead;
+        struct ev_io ioWrite;
         Message buffer;
         unsigned bufferPos;
         OPCSink *self;
+        DeltaState *delta;          // Allocated for clients that send deltas
+        std::vector<uint8_t> outbox;    // Reply bytes the socket hasn't taken yet
     };
 
+    // Replies queued for a client that isn't reading. Past this, whole replies are dropped.
+    static const unsigned MAX_OUTBOX = 1 << 20;
+
+    Client *mReplyClient;           // Stream client being dispatched, or NULL
+
+    /*
+     * io_uring backend. One multishot accept, and a multishot receive per client,
+     * stay armed in the ring. Received data lands in a shared ring of provided
+     * buffers, and each wakeup handles every completion that's waiting.
+     */
+    static const unsigned RING_ENTRIES = 64;
+    static const unsigned RECV_BUFFERS = 64;
+    static const unsigned RECV_BUFFER_SIZE = 16384;
+    static const uint16_t RECV_BUFFER_GROUP = 0;
+    static const uint64_t ACCEPT_TAG = 0;
+
+    IOURing *mRing;
+    struct ev_io mIORing;
+
+    /*
+     * Datagrams. Each wakeup drains the socket a batch at a time, straight into a
+     * preallocated arena of messages, and everything drained goes out as one frame.
+     */
+    static const unsigned DATAGRAM_BATCH = 32;
+    static const unsigned DATAGRAM_ROUNDS = 8;     // Batches per wakeup, at most
+    struct DatagramArena;
+
+    batch_callback_t mBatchCallback;
+    DatagramArena *mArena;
+    struct ev_io mIODatagram;
+
+    int receiveDatagrams(int fd);
+
+    bool startIOUring(struct ev_loop *loop, int sock);
+    Client *newClient(struct ev_loop *loop, int sock);
+    void closeClient(struct ev_loop *loop, Client *cli);
+    void receive(Client *cli, const uint8_t *data, unsigned length);
+    void dispatch(Client *cli);
+    bool decodeDelta(Client *cli);
+
+    void setSocketOptions(int sock);
+
     static void cbAccept(struct ev_loop *loop, struct ev_io *watcher, int revents);
     static void cbRead(struct ev_loop *loop, struct ev_io *watcher, int revents);
+    static void cbWrite(struct ev_loop *loop, struct ev_io *watcher, int revents);
+    static void cbRing(struct ev_loop *loop, struct ev_io *watcher, int revents);
+    static void cbDatagram(struct ev_loop *loop, struct ev_io *watcher, int revents);
 };
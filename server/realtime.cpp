@@ -0,0 +1,262 @@
+/*
+ * Realtime scheduling and memory locking for the event loop
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "realtime.h"
+#include "util.h"
+#include <sched.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <iostream>
+
+#ifdef __linux__
+#  include <dirent.h>
+#  include <malloc.h>
+#  include <unistd.h>
+#  include <sys/syscall.h>
+#endif
+
+
+Realtime::Realtime()
+    : mEnabled(false),
+      mPriority(0),
+      mLockMemory(false),
+      mJitterInterval(0.01),
+      mNextTick(0)
+{}
+
+void Realtime::parse(const Value &config, std::ostream &error)
+{
+    /*
+     * The 'realtime' object, all keys optional:
+     *
+     *   "cpus": List of CPU numbers for the server's threads
+     *   "priority": SCHED_FIFO priority for the event loop, from 1 to 99
+     *   "lockMemory": true to lock all memory, and fault it in up front
+     *   "jitterInterval": Seconds between event loop jitter measurements
+     */
+
+    if (config.IsNull()) {
+        return;
+    }
+    if (!config.IsObject()) {
+        error << "The 'realtime' configuration key must be an object.\n";
+        return;
+    }
+    mEnabled = true;
+
+    const Value &cpus = config["cpus"];
+    const Value &priority = config["priority"];
+    const Value &lock = config["lockMemory"];
+    const Value &interval = config["jitterInterval"];
+
+    if (cpus.IsArray()) {
+        for (unsigned i = 0; i < cpus.Size(); ++i) {
+            if (!cpus[i].IsUint()) {
+                error << "Realtime 'cpus' must be a list of CPU numbers.\n";
+                break;
+            }
+            mCPUs.push_back(cpus[i].GetUint());
+        }
+    } else if (!cpus.IsNull()) {
+        error << "Realtime 'cpus' must be a list of CPU numbers.\n";
+    }
+
+    if (priority.IsUint() && priority.GetUint() >= 1 && priority.GetUint() <= 99) {
+        mPriority = priority.GetUint();
+    } else if (!priority.IsNull()) {
+        error << "Realtime 'priority' must be an integer from 1 to 99.\n";
+    }
+
+    if (lock.IsBool()) {
+        mLockMemory = lock.IsTrue();
+    } else if (!lock.IsNull()) {
+        error << "Realtime 'lockMemory' must be true or false.\n";
+    }
+
+    if (interval.IsNumber() && interval.GetDouble() > 0) {
+        mJitterInterval = interval.GetDouble();
+    } else if (!interval.IsNull()) {
+        error << "Realtime 'jitterInterval' must be a positive number of seconds.\n";
+    }
+}
+
+void Realtime::start(struct ev_loop *loop, bool verbose)
+{
+    if (!mEnabled) {
+        return;
+    }
+
+    if (!mCPUs.empty()) {
+        setAffinity(verbose);
+    }
+    if (mPriority) {
+        setPriority(verbose);
+    }
+    if (mLockMemory) {
+        lockMemory(verbose);
+    }
+
+    ev_timer_init(&mJitterTimer, cbJitter, mJitterInterval, mJitterInterval);
+    mJitterTimer.data = this;
+    resync(loop);
+}
+
+void Realtime::resync(struct ev_loop *loop)
+{
+    /*
+     * Start the timer over from now. The loop's idea of now can be stale, by all
+     * of startup the first time, so update it. Our clock is read first, so the
+     * timer can't come due before mNextTick.
+     */
+
+    mNextTick = monotonicTime() + mJitterInterval;
+    ev_now_update(loop);
+    ev_timer_again(loop, &mJitterTimer);
+}
+
+void Realtime::setAffinity(bool verbose)
+{
+    /*
+     * Every thread that exists now gets the same CPUs, including the event loop
+     * and any libusb created. Threads we start later inherit them.
+     */
+
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (unsigned i = 0; i < mCPUs.size(); ++i) {
+        CPU_SET(mCPUs[i], &set);
+    }
+
+    DIR *tasks = opendir("/proc/self/task");
+    if (!tasks) {
+        perror("Can't list threads for CPU affinity");
+        return;
+    }
+
+    unsigned count = 0;
+    while (struct dirent *d = readdir(tasks)) {
+        pid_t tid = atoi(d->d_name);
+        if (tid <= 0) {
+            continue;
+        }
+        if (sched_setaffinity(tid, sizeof set, &set) < 0) {
+            perror("Can't set CPU affinity");
+            break;
+        }
+        count++;
+    }
+    closedir(tasks);
+
+    if (verbose) {
+        std::clog << "Pinned " << count << " threads to " << mCPUs.size() << " CPUs\n";
+    }
+#else
+    std::clog << "CPU affinity isn't supported on this platform\n";
+#endif
+}
+
+void Realtime::setPriority(bool verbose)
+{
+    // Only the event loop runs at realtime priority. Usually needs root or CAP_SYS_NICE.
+
+    struct sched_param param;
+    memset(&param, 0, sizeof param);
+    param.sched_priority = mPriority;
+
+    int r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (r) {
+        std::clog << "Can't use SCHED_FIFO priority " << mPriority << ": " << strerror(r) << "\n";
+    } else if (verbose) {
+        std::clog << "Event loop running with SCHED_FIFO priority " << mPriority << "\n";
+    }
+}
+
+void Realtime::lockMemory(bool verbose)
+{
+    /*
+     * Lock everything mapped now and in the future. Locking faults in every page,
+     * including framebuffers for the devices we already have. Later mappings,
+     * such as buffers for hotplugged devices, are faulted in as they're created.
+     */
+
+#ifdef __linux__
+    // Keep freed heap memory, rather than giving it back and faulting it in again
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+#endif
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        perror("Can't lock memory");
+        return;
+    }
+    prefaultStack();
+
+    if (verbose) {
+        std::clog << "Memory locked\n";
+    }
+}
+
+void Realtime::prefaultStack()
+{
+    volatile uint8_t stack[PREFAULT_STACK];
+    for (unsigned i = 0; i < sizeof stack; i += 4096) {
+        stack[i] = 0;
+    }
+}
+
+void Realtime::cbJitter(struct ev_loop *loop, ev_timer *w, int revents)
+{
+    /*
+     * Jitter is how late the event loop was in running this timer. That includes
+     * time spent on other events, as well as time the whole process was preempted.
+     */
+
+    Realtime *self = static_cast<Realtime*>(w->data);
+    double now = monotonicTime();
+
+    if (now < self->mNextTick) {
+        // The loop's clock and ours disagree. That isn't jitter; line them back up.
+        self->resync(loop);
+        return;
+    }
+
+    self->mJitter.add(now - self->mNextTick);
+    self->mNextTick += self->mJitterInterval;
+
+    if (now > self->mNextTick) {
+        // Missed ticks entirely. Count the late one, then start fresh.
+        self->resync(loop);
+    }
+}
+
+void Realtime::writeStatus(StatusWriter &w)
+{
+    w.String("jitterInterval").Double(mJitterInterval);
+    w.String("jitter").StartObject();
+    mJitter.writeStatus(w);
+    w.EndObject();
+}
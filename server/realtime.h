@@ -0,0 +1,79 @@
+/*
+ * Realtime scheduling and memory locking for the event loop
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "rapidjson/document.h"
+#include "histogram.h"
+#include <ev.h>
+#include <ostream>
+#include <vector>
+
+
+/*
+ * Optional 'realtime' configuration. Pins the server's threads to chosen CPUs,
+ * runs the event loop with SCHED_FIFO priority, and locks all memory so nothing
+ * we touch while handling a frame has to be paged in. A periodic timer measures
+ * how late the event loop wakes up, so the effect can be checked.
+ */
+
+class Realtime
+{
+public:
+    typedef rapidjson::Value Value;
+    typedef Histogram::StatusWriter StatusWriter;
+
+    Realtime();
+
+    // Check the configuration, appending any errors
+    void parse(const Value &config, std::ostream &error);
+
+    bool enabled() const { return mEnabled; }
+    bool locksMemory() const { return mEnabled && mLockMemory; }
+
+    // Apply settings from the event loop thread, once everything else is running
+    void start(struct ev_loop *loop, bool verbose);
+
+    // Write JSON object members with jitter statistics
+    void writeStatus(StatusWriter &w);
+
+private:
+    // Stack we touch up front, so it's already mapped and locked
+    static const unsigned PREFAULT_STACK = 256 * 1024;
+
+    bool mEnabled;
+    std::vector<unsigned> mCPUs;
+    int mPriority;              // SCHED_FIFO priority, or 0 for normal scheduling
+    bool mLockMemory;
+
+    ev_timer mJitterTimer;
+    double mJitterInterval;
+    double mNextTick;
+    Histogram mJitter;
+
+    void setAffinity(bool verbose);
+    void setPriority(bool verbose);
+    void lockMemory(bool verbose);
+    static void prefaultStack();
+    void resync(struct ev_loop *loop);
+    static void cbJitter(struct ev_loop *loop, ev_timer *w, int revents);
+};
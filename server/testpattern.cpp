@@ -0,0 +1,266 @@
+/*
+ * Built-in test patterns, rendered at a fixed frame rate
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "testpattern.h"
+#include "util.h"
+#include <string.h>
+
+static const struct {
+    TestPattern::Kind kind;
+    const char *name;
+} kPatternNames[] = {
+    { TestPattern::OFF, "off" },
+    { TestPattern::CHASE, "chase" },
+    { TestPattern::STROBE, "strobe" },
+    { TestPattern::WHITE, "white" },
+    { TestPattern::EVERY_OTHER, "everyOther" },
+    { TestPattern::MEASURING_STICK, "measuringStick" },
+    { TestPattern::CROSSTALK, "crosstalk" },
+};
+
+
+TestPattern::TestPattern(callback_t cb, void *context)
+    : mCallback(cb),
+      mContext(context),
+      mLoop(0),
+      mKind(OFF),
+      mChannel(-1),
+      mHasSerial(false),
+      mPixels(512),
+      mRate(100),
+      mStep(1),
+      mFrame(0),
+      mNextFrame(0),
+      mStartTime(0)
+{}
+
+TestPattern::~TestPattern()
+{
+    if (mLoop) {
+        ev_timer_stop(mLoop, &mTimer);
+    }
+}
+
+bool TestPattern::parse(const Value &config, std::ostream &error)
+{
+    /*
+     * One test pattern:
+     *
+     *   "pattern": Name of the pattern, or "off"
+     *   "serial": Optional. Device to draw on. Default is every Fadecandy device.
+     *   "channel": Optional. OPC channel to send the pattern on, instead of a device.
+     *   "pixels": Optional. Number of pixels. Default is 512.
+     *   "rate": Optional. Frames per second. Default is 100.
+     *   "step": Optional. Frames for each step of the animation. Default is 1.
+     */
+
+    if (!config.IsObject()) {
+        error << "Each test pattern must be a JSON object.\n";
+        return false;
+    }
+
+    const Value &pattern = config["pattern"];
+    const Value &serial = config["serial"];
+    const Value &channel = config["channel"];
+    const Value &pixels = config["pixels"];
+    const Value &rate = config["rate"];
+    const Value &step = config["step"];
+    bool ok = true;
+
+    bool found = false;
+    if (pattern.IsString()) {
+        for (unsigned i = 0; i < sizeof kPatternNames / sizeof kPatternNames[0]; ++i) {
+            if (!strcmp(pattern.GetString(), kPatternNames[i].name)) {
+                mKind = kPatternNames[i].kind;
+                found = true;
+            }
+        }
+    }
+    if (!found) {
+        error << "Test 'pattern' must be one of: chase, strobe, white, everyOther, measuringStick, crosstalk, off.\n";
+        ok = false;
+    }
+
+    if (serial.IsString()) {
+        mHasSerial = true;
+        mSerial = serial.GetString();
+    } else if (!serial.IsNull()) {
+        error << "Test pattern 'serial' must be a string.\n";
+        ok = false;
+    }
+
+    if (channel.IsUint() && channel.GetUint() <= 255 && !mHasSerial) {
+        mChannel = channel.GetUint();
+    } else if (!channel.IsNull()) {
+        error << "Test pattern 'channel' must be a number from 0 to 255, and can't be used with 'serial'.\n";
+        ok = false;
+    }
+
+    if (pixels.IsUint() && pixels.GetUint() >= 1 && pixels.GetUint() <= 0xFFFF / 3) {
+        mPixels = pixels.GetUint();
+    } else if (!pixels.IsNull()) {
+        error << "Test pattern 'pixels' must be a number from 1 to " << 0xFFFF / 3 << ".\n";
+        ok = false;
+    }
+
+    if (rate.IsNumber() && rate.GetDouble() > 0 && rate.GetDouble() <= MAX_RATE) {
+        mRate = rate.GetDouble();
+    } else if (!rate.IsNull()) {
+        error << "Test pattern 'rate' must be a number of frames per second, up to " << MAX_RATE << ".\n";
+        ok = false;
+    }
+
+    if (step.IsUint() && step.GetUint() >= 1) {
+        mStep = step.GetUint();
+    } else if (!step.IsNull()) {
+        error << "Test pattern 'step' must be a positive number of frames.\n";
+        ok = false;
+    }
+
+    return ok;
+}
+
+void TestPattern::start(struct ev_loop *loop)
+{
+    if (mKind == OFF) {
+        return;
+    }
+
+    mLoop = loop;
+    mStartTime = mNextFrame = monotonicTime();
+
+    ev_timer_init(&mTimer, cbTimer, 0, 1.0 / mRate);
+    ev_timer_start(loop, &mTimer);
+}
+
+void TestPattern::cbTimer(struct ev_loop *loop, struct ev_timer *watcher, int revents)
+{
+    /*
+     * High rates are faster than the event loop's timer resolution. Each wakeup
+     * renders every frame that came due since the last one. If we fall far
+     * behind, skip ahead instead of racing to catch up.
+     */
+
+    TestPattern *self = container_of(watcher, TestPattern, mTimer);
+    double now = monotonicTime();
+    unsigned count = 0;
+
+    while (self->mNextFrame <= now && count++ < MAX_CATCHUP) {
+        self->mCallback(*self, self->mContext);
+        self->mFrame++;
+        self->mNextFrame += 1.0 / self->mRate;
+    }
+
+    if (self->mNextFrame <= now) {
+        self->mNextFrame = now;
+    }
+}
+
+void TestPattern::pixel(unsigned index, uint8_t *rgb) const
+{
+    static const uint8_t black[3] = { 0, 0, 0 };
+    static const uint8_t white[3] = { 255, 255, 255 };
+    static const uint8_t gray[3] = { 128, 128, 128 };
+    static const uint8_t tick[3] = { 128, 255, 128 };
+    static const uint8_t background[3] = { 40, 40, 40 };
+    static const uint8_t highlight[3] = { 100, 100, 100 };
+    static const uint8_t bits[2][3] = { { 40, 0, 0 }, { 0, 255, 0 } };
+
+    const uint64_t step = mFrame / mStep;
+    const unsigned strip = index / 64;
+    const unsigned led = index % 64;
+    const uint8_t *color = black;
+
+    switch (mKind) {
+
+        case OFF:
+            break;
+
+        case CHASE:
+            // One white pixel, moving along
+            color = index == step % mPixels ? white : black;
+            break;
+
+        case STROBE:
+            color = step & 1 ? black : white;
+            break;
+
+        case WHITE:
+            color = white;
+            break;
+
+        case EVERY_OTHER:
+            color = index & 1 ? black : white;
+            break;
+
+        case MEASURING_STICK:
+            // Gray, with a green tick every 10 pixels along each strip
+            color = led % 10 == 0 && led <= 60 ? tick : gray;
+            break;
+
+        case CROSSTALK:
+            // Each strip in turn gets every other pixel brightened. The first 3 pixels label the strip in binary.
+            if (led < 3) {
+                color = bits[(strip >> (2 - led)) & 1];
+            } else if (strip == step % 8 && !(led & 1)) {
+                color = highlight;
+            } else {
+                color = background;
+            }
+            break;
+    }
+
+    rgb[0] = color[0];
+    rgb[1] = color[1];
+    rgb[2] = color[2];
+}
+
+bool TestPattern::sameTarget(const TestPattern &other) const
+{
+    return mChannel == other.mChannel && mHasSerial == other.mHasSerial && mSerial == other.mSerial;
+}
+
+const char *TestPattern::kindName(Kind kind)
+{
+    for (unsigned i = 0; i < sizeof kPatternNames / sizeof kPatternNames[0]; ++i) {
+        if (kPatternNames[i].kind == kind) {
+            return kPatternNames[i].name;
+        }
+    }
+    return "unknown";
+}
+
+void TestPattern::writeStatus(StatusWriter &w) const
+{
+    double elapsed = monotonicTime() - mStartTime;
+
+    w.String("pattern").String(kindName(mKind));
+    if (hasChannel()) {
+        w.String("channel").Uint(mChannel);
+    } else if (mHasSerial) {
+        w.String("serial").String(mSerial.c_str());
+    }
+    w.String("rate").Double(mRate);
+    w.String("frames").Uint64(mFrame);
+    w.String("frameRate").Double(mFrame && elapsed > 0 ? mFrame / elapsed : 0.0);
+}
@@ -0,0 +1,110 @@
+/*
+ * Built-in test patterns, rendered at a fixed frame rate
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "rapidjson/document.h"
+#include "histogram.h"
+#include <ev.h>
+#include <ostream>
+#include <string>
+#include <stdint.h>
+
+
+/*
+ * The patterns from the Python scripts in tools/, generated in the server so
+ * they can run as fast as the USB link will carry them. A pattern either goes
+ * straight into the framebuffers of Fadecandy devices, skipping the mapping,
+ * or onto an OPC channel, as if a client had sent it.
+ *
+ * Each frame advances the animation by one step, so the frame rate sets the
+ * speed of chase, strobe, and crosstalk.
+ */
+
+class TestPattern
+{
+public:
+    typedef rapidjson::Value Value;
+    typedef Histogram::StatusWriter StatusWriter;
+
+    // Called for each frame. Render it with pixel().
+    typedef void (*callback_t)(TestPattern &pattern, void *context);
+
+    enum Kind {
+        OFF,
+        CHASE,              // chase.py
+        STROBE,             // strobe.py
+        WHITE,              // solid-white.py
+        EVERY_OTHER,        // every-other-white.py
+        MEASURING_STICK,    // measuring-stick.py
+        CROSSTALK           // crosstalk-test.py
+    };
+
+    TestPattern(callback_t cb, void *context);
+    ~TestPattern();
+
+    // Check a pattern object, from the config file or a Test Pattern SysEx, appending any errors
+    bool parse(const Value &config, std::ostream &error);
+
+    void start(struct ev_loop *loop);
+
+    // Color of one pixel in the current frame
+    void pixel(unsigned index, uint8_t *rgb) const;
+
+    Kind kind() const { return mKind; }
+    unsigned pixelCount() const { return mPixels; }
+
+    // Either a channel number, or the serial number of a device (NULL for every device)
+    bool hasChannel() const { return mChannel >= 0; }
+    unsigned channel() const { return mChannel; }
+    const char *serial() const { return mHasSerial ? mSerial.c_str() : 0; }
+
+    // Would this pattern replace the other one?
+    bool sameTarget(const TestPattern &other) const;
+
+    // Write JSON object members describing the pattern and its progress
+    void writeStatus(StatusWriter &w) const;
+
+private:
+    static const unsigned MAX_RATE = 100000;
+    static const unsigned MAX_CATCHUP = 64;
+
+    callback_t mCallback;
+    void *mContext;
+    struct ev_loop *mLoop;
+    ev_timer mTimer;
+
+    Kind mKind;
+    int mChannel;               // -1 for devices
+    bool mHasSerial;
+    std::string mSerial;
+    unsigned mPixels;
+    double mRate;               // Frames per second
+    unsigned mStep;             // Frames per step of the animation
+
+    uint64_t mFrame;
+    double mNextFrame;
+    double mStartTime;
+
+    static const char *kindName(Kind kind);
+    static void cbTimer(struct ev_loop *loop, struct ev_timer *watcher, int revents);
+};
@@ -22,17 +22,83 @@
  */
 
 #include "usbdevice.h"
+#include "usbscheduler.h"
+#include "util.h"
+#include <stdlib.h>
+#include <string.h>
 #include <iostream>
+#include <algorithm>
 
 
-USBDevice::USBDevice(libusb_device *device, bool verbose)
-    : mDevice(libusb_ref_device(device)),
+const double USBDevice::MIN_BACKOFF = 0.01;
+const double USBDevice::MAX_BACKOFF = 1.0;
+
+USBDevice::USBDevice(libusb_device *device, const char *type, bool verbose)
+    : mDevice(device ? libusb_ref_device(device) : 0),
       mHandle(0),
-      mVerbose(verbose)
-{}
+      mType(type),
+      mVerbose(verbose),
+      mTracer(0),
+      mBatching(false),
+      mBatchChanged(false),
+      mLink(0),
+      mLoop(0),
+      mRecovery(RECOVERY_NONE),
+      mErrorCount(0),
+      mClearHalt(0),
+      mResetRunning(false),
+      mResetResult(0),
+      mTransferErrors(0),
+      mHaltsCleared(0),
+      mResets(0)
+{
+    mSerial[0] = '\0';
+    memset(mQueued, 0, sizeof mQueued);
+
+    ev_timer_init(&mBackoffTimer, cbBackoff, 0, 0);
+    mBackoffTimer.data = this;
+    ev_async_init(&mResetDone, cbResetDone);
+    mResetDone.data = this;
+}
 
 USBDevice::~USBDevice()
 {
+    /*
+     * If we have pending transfers, cancel them and jettison them
+     * from the USBDevice. The Transfer objects themselves will be freed
+     * once libusb completes them. Queued transfers were never submitted.
+     */
+
+    if (mLink) {
+        mLink->remove(this);
+    }
+
+    if (mResetRunning) {
+        // Only if we're unplugged mid-reset; libusb fails the reset promptly.
+        pthread_join(mResetThread, 0);
+    }
+    if (mLoop) {
+        ev_timer_stop(mLoop, &mBackoffTimer);
+        ev_async_stop(mLoop, &mResetDone);
+    }
+    if (mClearHalt) {
+        mClearHalt->user_data = 0;
+        libusb_cancel_transfer(mClearHalt);
+    }
+
+    for (std::set<Transfer*>::iterator i = mPending.begin(), e = mPending.end(); i != e; ++i) {
+        Transfer *t = *i;
+        libusb_cancel_transfer(t->transfer);
+        t->device = 0;
+        if (t->holdsLinkSlot) {
+            mLink->release();
+        }
+    }
+
+    for (unsigned c = 0; c < NUM_CLASSES; ++c) {
+        delete mQueued[c];
+    }
+
     if (mHandle) {
         libusb_close(mHandle);
     }
@@ -52,51 +118,431 @@ void USBDevice::writeColorCorrection(const Value &color)
     // Optional. By default, ignore color correction messages.
 }
 
-bool USBDevice::matchConfigurationWithTypeAndSerial(const Value &config, const char *type, const char *serial)
+void USBDevice::writeStatus(StatusWriter &w)
+{
+    static const char *recoveryNames[] = { "none", "clearHalt", "backoff", "reset", "gone" };
+
+    std::string name = getName();
+    w.String("type").String(mType);
+    w.String("serial").String(mSerial);
+    w.String("name").String(name.c_str());
+    w.String("recovery").String(recoveryNames[mRecovery]);
+    w.String("transferErrors").Uint64(mTransferErrors);
+    w.String("haltsCleared").Uint64(mHaltsCleared);
+    w.String("resets").Uint64(mResets);
+}
+
+uint8_t *USBDevice::allocTransferMemory(size_t size, bool &deviceMemory)
+{
+    uint8_t *mem = 0;
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    // Fails cleanly on platforms and kernels without usbfs mmap support
+    if (mHandle) {
+        mem = libusb_dev_mem_alloc(mHandle, size);
+    }
+#endif
+
+    deviceMemory = mem != 0;
+    if (!mem) {
+        mem = (uint8_t*) malloc(size);
+    }
+    if (mem) {
+        memset(mem, 0, size);
+    }
+    return mem;
+}
+
+void USBDevice::freeTransferMemory(uint8_t *mem, size_t size, bool deviceMemory)
 {
-    if (!config.IsObject()) {
-        return false;
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    if (deviceMemory) {
+        libusb_dev_mem_free(mHandle, mem, size);
+        return;
     }
+#endif
 
-    const Value &vtype = config["type"];
-    const Value &vserial = config["serial"];
+    free(mem);
+}
+
+USBDevice::Transfer::Transfer(USBDevice *device, unsigned char endpoint, void *buffer, int length,
+    TransferClass cls, void *context)
+    : transfer(libusb_alloc_transfer(0)),
+      device(device),
+      cls(cls),
+      context(context),
+      holdsLinkSlot(false),
+      submitTime(0)
+{
+    libusb_fill_bulk_transfer(transfer, device->mHandle,
+        endpoint, (uint8_t*) buffer, length, USBDevice::completeTransfer, this, 2000);
+}
+
+USBDevice::Transfer::~Transfer()
+{
+    libusb_free_transfer(transfer);
+}
+
+void USBDevice::submitTransfer(Transfer *t)
+{
+    Transfer *&slot = mQueued[t->cls];
 
-    if (!vtype.IsString() || strcmp(vtype.GetString(), type)) {
-        // Wrong type
-        return false;
+    if (slot) {
+        // Superseded before it was ever sent
+        Transfer *old = slot;
+        slot = 0;
+        old->transfer->status = LIBUSB_TRANSFER_CANCELLED;
+        finishTransfer(old);
     }
 
-    if (!vserial.IsNull()) {
-        // Not a wildcard serial number?
-        // If a serial was not specified, it matches any device.
+    slot = t;
+    pumpTransfers();
+}
+
+void USBDevice::pumpTransfers()
+{
+    /*
+     * Submit queued transfers, highest priority first, until we're at our limit.
+     * Frames also need a slot on the shared link; if there isn't one, the frame
+     * stays queued and the link wakes us up later. Nothing is sent while we're
+     * recovering from an error.
+     */
 
-        if (!vserial.IsString()) {
-            // Non-string serial number. Bad form.
-            return false;
+    while (mRecovery == RECOVERY_NONE && mPending.size() < MAX_PENDING) {
+        Transfer *t = 0;
+
+        for (unsigned c = 0; c < NUM_CLASSES && !t; ++c) {
+            if (!mQueued[c]) {
+                continue;
+            }
+            if (c == CLASS_FRAME && mLink) {
+                if (!mLink->acquire(this)) {
+                    continue;
+                }
+                mQueued[c]->holdsLinkSlot = true;
+            }
+            t = mQueued[c];
+            mQueued[c] = 0;
+        }
+        if (!t) {
+            return;
         }
 
-        if (strcmp(vserial.GetString(), serial)) {
-            // Not a match
-            return false;
+        t->submitTime = monotonicTime();
+        int r = submitToDevice(t);
+
+        if (r < 0) {
+            if (mVerbose && r != LIBUSB_ERROR_PIPE) {
+                std::clog << "Error submitting USB transfer: " << libusb_strerror(libusb_error(r)) << "\n";
+            }
+            t->transfer->status = r == LIBUSB_ERROR_PIPE ? LIBUSB_TRANSFER_STALL :
+                r == LIBUSB_ERROR_NO_DEVICE ? LIBUSB_TRANSFER_NO_DEVICE : LIBUSB_TRANSFER_ERROR;
+            transferFailed(t->transfer->status, t->transfer->endpoint);
+            finishTransfer(t);
+        } else {
+            mPending.insert(t);
         }
     }
+}
 
-    return true;
+int USBDevice::submitToDevice(Transfer *t)
+{
+    return libusb_submit_transfer(t->transfer);
+}
+
+void USBDevice::emulatedTransferDone(Transfer *t, libusb_transfer_status status)
+{
+    // Finish the same way libusb would have
+    t->transfer->status = status;
+    t->transfer->actual_length = status == LIBUSB_TRANSFER_COMPLETED ? t->transfer->length : 0;
+    completeTransfer(t->transfer);
+}
+
+void USBDevice::finishTransfer(Transfer *t)
+{
+    transferFinished(t);
+    if (t->holdsLinkSlot) {
+        mLink->release();
+    }
+    delete t;
+}
+
+void USBDevice::linkReady()
+{
+    pumpTransfers();
+}
+
+void USBDevice::writeTestPattern(const TestPattern &pattern)
+{
+    // Optional. By default, test patterns only reach this device through mapped channels.
+}
+
+void USBDevice::writeCanvas(const Canvas &canvas)
+{
+    // Optional. By default, the device has no canvas mapping.
+}
+
+void USBDevice::transferFinished(Transfer *t)
+{
+    // Optional. By default, nothing to clean up.
+}
+
+void USBDevice::deviceWasReset()
+{
+    // Optional. By default, the device has no state to restore.
+}
+
+void USBDevice::writeFrame()
+{
+    // Optional. By default, the device has no frames.
+}
+
+void USBDevice::frameChanged()
+{
+    if (mBatching) {
+        mBatchChanged = true;
+    } else {
+        writeFrame();
+    }
 }
 
+void USBDevice::endBatch()
+{
+    mBatching = false;
+    if (mBatchChanged) {
+        mBatchChanged = false;
+        writeFrame();
+    }
+}
+
+void USBDevice::completeTransfer(struct libusb_transfer *transfer)
+{
+    /*
+     * Transfer complete. The USBDevice may or may not still exist; if the device was unplugged,
+     * t->device will be set to 0 by ~USBDevice().
+     */
+
+    Transfer *t = static_cast<Transfer*>(transfer->user_data);
+    USBDevice *self = t->device;
+
+    if (self) {
+        self->mPending.erase(t);
+
+        switch (transfer->status) {
+            case LIBUSB_TRANSFER_COMPLETED:
+                self->mErrorCount = 0;
+                break;
+            case LIBUSB_TRANSFER_CANCELLED:
+                break;
+            default:
+                self->transferFailed(transfer->status, transfer->endpoint);
+                break;
+        }
+
+        self->finishTransfer(t);
+        self->launchReset();
+        self->pumpTransfers();
+    } else {
+        delete t;
+    }
+}
+
+void USBDevice::transferFailed(libusb_transfer_status status, unsigned char endpoint)
+{
+    /*
+     * Decide how to recover from a failed transfer. Other transfers that were in flight
+     * often fail the same way, so only the first failure starts recovery.
+     */
+
+    mTransferErrors++;
+
+    if (status == LIBUSB_TRANSFER_NO_DEVICE) {
+        // Nothing to do but wait for the hotplug event
+        if (mRecovery == RECOVERY_BACKOFF) {
+            ev_timer_stop(mLoop, &mBackoffTimer);
+        }
+        mRecovery = RECOVERY_GONE;
+        return;
+    }
+
+    if (mRecovery != RECOVERY_NONE) {
+        return;
+    }
+
+    mErrorCount++;
+
+    if (mVerbose) {
+        std::clog << "USB device " << getName() << ": transfer on endpoint " << unsigned(endpoint)
+            << (status == LIBUSB_TRANSFER_STALL ? " stalled" :
+                status == LIBUSB_TRANSFER_TIMED_OUT ? " timed out" : " failed")
+            << " (" << mErrorCount << " in a row)\n";
+    }
+
+    if (mErrorCount >= RESET_THRESHOLD) {
+        startReset();
+    } else if (status == LIBUSB_TRANSFER_STALL) {
+        startClearHalt(endpoint);
+    } else {
+        startBackoff();
+    }
+}
+
+void USBDevice::startClearHalt(unsigned char endpoint)
+{
+    /*
+     * libusb_clear_halt() blocks, so we send the CLEAR_FEATURE(ENDPOINT_HALT) request
+     * ourselves as an asynchronous control transfer. If the data toggle is out of step
+     * afterward, the device drops one packet and they're back in step.
+     */
+
+    uint8_t *setup = (uint8_t*) malloc(LIBUSB_CONTROL_SETUP_SIZE);
+    libusb_fill_control_setup(setup,
+        LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_ENDPOINT,
+        LIBUSB_REQUEST_CLEAR_FEATURE, 0, endpoint, 0);
+
+    mClearHalt = libusb_alloc_transfer(0);
+    libusb_fill_control_transfer(mClearHalt, mHandle, setup, cbClearHalt, this, 1000);
+    mClearHalt->flags = LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER;
+    mRecovery = RECOVERY_CLEAR_HALT;
+
+    if (libusb_submit_transfer(mClearHalt) < 0) {
+        libusb_free_transfer(mClearHalt);
+        mClearHalt = 0;
+        startBackoff();
+    }
+}
+
+void USBDevice::cbClearHalt(struct libusb_transfer *transfer)
+{
+    USBDevice *self = static_cast<USBDevice*>(transfer->user_data);
+    if (!self) {
+        // Device was closed while this was in flight
+        return;
+    }
+
+    self->mClearHalt = 0;
+    if (self->mRecovery != RECOVERY_CLEAR_HALT) {
+        return;
+    }
 
-const USBDevice::Value *USBDevice::findConfigMap(const Value &config)
+    if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+        self->mHaltsCleared++;
+        self->recoveryDone();
+        return;
+    }
+
+    self->mTransferErrors++;
+    if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+        self->mRecovery = RECOVERY_GONE;
+    } else if (++self->mErrorCount >= RESET_THRESHOLD) {
+        self->startReset();
+    } else {
+        self->startBackoff();
+    }
+}
+
+void USBDevice::startBackoff()
+{
+    // Wait before trying again, longer with each consecutive error
+    unsigned doublings = std::min(mErrorCount ? mErrorCount - 1 : 0, 16u);
+    double delay = MIN_BACKOFF * (1 << doublings);
+
+    mRecovery = RECOVERY_BACKOFF;
+    ev_timer_set(&mBackoffTimer, std::min(delay, MAX_BACKOFF), 0);
+    ev_timer_start(mLoop, &mBackoffTimer);
+}
+
+void USBDevice::cbBackoff(struct ev_loop *loop, ev_timer *w, int revents)
+{
+    USBDevice *self = static_cast<USBDevice*>(w->data);
+    self->recoveryDone();
+}
+
+void USBDevice::startReset()
+{
+    /*
+     * Too many errors; reset the device. Cancel everything in flight first, and
+     * start the reset once all of it has come back.
+     */
+
+    if (mVerbose) {
+        std::clog << "USB device " << getName() << ": resetting\n";
+    }
+
+    mRecovery = RECOVERY_RESET;
+    for (std::set<Transfer*>::iterator i = mPending.begin(), e = mPending.end(); i != e; ++i) {
+        libusb_cancel_transfer((*i)->transfer);
+    }
+    launchReset();
+}
+
+void USBDevice::launchReset()
 {
-    const Value &vmap = config["map"];
+    /*
+     * libusb_reset_device() blocks until the device has been reset and reconfigured,
+     * so it runs on its own thread. We hear back through an ev_async watcher.
+     */
 
-    if (vmap.IsArray()) {
-        // The map is optional, but if it exists it needs to be an array.
-        return &vmap;
+    if (mRecovery != RECOVERY_RESET || mResetRunning || !mPending.empty() || mClearHalt) {
+        return;
     }
-    
-    if (!vmap.IsNull() && mVerbose) {
-        std::clog << "Device configuration 'map' must be an array.\n";
+
+    ev_async_start(mLoop, &mResetDone);
+    mResetRunning = true;
+
+    if (pthread_create(&mResetThread, 0, resetThread, this)) {
+        mResetRunning = false;
+        ev_async_stop(mLoop, &mResetDone);
+        startBackoff();
     }
+}
 
+void *USBDevice::resetThread(void *context)
+{
+    USBDevice *self = static_cast<USBDevice*>(context);
+    self->mResetResult = libusb_reset_device(self->mHandle);
+    ev_async_send(self->mLoop, &self->mResetDone);
     return 0;
 }
+
+void USBDevice::cbResetDone(struct ev_loop *loop, ev_async *w, int revents)
+{
+    USBDevice *self = static_cast<USBDevice*>(w->data);
+    int r = self->mResetResult;
+
+    pthread_join(self->mResetThread, 0);
+    self->mResetRunning = false;
+    ev_async_stop(loop, w);
+    self->mResets++;
+
+    if (self->mRecovery != RECOVERY_RESET) {
+        // Disconnected while we were resetting
+        return;
+    }
+
+    if (r == 0) {
+        self->mErrorCount = 0;
+        self->deviceWasReset();
+        self->recoveryDone();
+
+    } else if (r == LIBUSB_ERROR_NOT_FOUND || r == LIBUSB_ERROR_NO_DEVICE) {
+        // The device re-enumerated. Hotplug will replace us with a new USBDevice.
+        if (self->mVerbose) {
+            std::clog << "USB device " << self->getName() << ": re-enumerating after reset\n";
+        }
+        self->mRecovery = RECOVERY_GONE;
+
+    } else {
+        if (self->mVerbose) {
+            std::clog << "USB device " << self->getName() << ": reset failed, "
+                << libusb_strerror(libusb_error(r)) << "\n";
+        }
+        self->startBackoff();
+    }
+}
+
+void USBDevice::recoveryDone()
+{
+    mRecovery = RECOVERY_NONE;
+    pumpTransfers();
+}
@@ -23,17 +23,41 @@
 
 #pragma once
 #include "rapidjson/document.h"
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
 #include "opcsink.h"
+#include "latencytracer.h"
+#include "canvas.h"
 #include <libusb.h>
+#include <ev.h>
+#include <pthread.h>
 #include <string>
+#include <vector>
+#include <set>
+
+class USBLink;
+class TestPattern;
 
 
 class USBDevice
 {
 public:
     typedef rapidjson::Value Value;
+    typedef rapidjson::Writer<rapidjson::StringBuffer> StatusWriter;
+
+    /*
+     * One entry from the 'devices' list, checked and compiled once when the
+     * configuration is loaded. Strings point into the in-situ parsed config text.
+     */
+    struct Config {
+        const char *type;
+        const char *serial;                 // NULL matches any serial number
+        std::vector<const Value*> maps;     // Mapping table for each listener, NULL if none
+        const Value *value;                 // Original JSON object, for device-specific keys
+        std::vector<CanvasMap*> canvases;   // Compiled canvas instructions from any of the maps
+    };
 
-    USBDevice(libusb_device *device, bool verbose);
+    USBDevice(libusb_device *device, const char *type, bool verbose);
     virtual ~USBDevice();
 
     // Must be opened before any other methods are called.
@@ -42,24 +66,171 @@ public:
     // Some drivers can't determine whether this is a supported device prior to open()
     virtual bool probeAfterOpening();
 
-    // Check a configuration. If it describes this device, load it and return true. If not, return false.
-    virtual bool matchConfiguration(const Value &config) = 0;
+    // Load a configuration that was matched to this device by type and serial number
+    virtual void loadConfiguration(const Config &config) = 0;
 
-    // Handle an incoming OPC message
-    virtual void writeMessage(const OPCSink::Message &msg) = 0;
+    // Handle an incoming OPC message, from the numbered listener
+    virtual void writeMessage(const OPCSink::Message &msg, unsigned listener) = 0;
 
     // Write color LUT from parsed JSON
     virtual void writeColorCorrection(const Value &color);
 
+    // Draw the current frame of a test pattern, skipping the mapping. Ignored by devices without framebuffers.
+    virtual void writeTestPattern(const TestPattern &pattern);
+
+    // Sample an image that didn't come over OPC, through the default map's canvas instructions
+    virtual void writeCanvas(const Canvas &canvas);
+
+    // Write JSON object members describing this device's state
+    virtual void writeStatus(StatusWriter &w);
+
     virtual std::string getName() = 0;
     libusb_device *getDevice() { return mDevice; };
+    const char *getType() { return mType; }
+    const char *getSerial() { return mSerial; }
+
+    // Frames are only sent when the shared USB link has room for them
+    void setLink(USBLink *link) { mLink = link; }
+    USBLink *getLink() { return mLink; }
+
+    // Called by our USBLink when a frame slot may be available
+    void linkReady();
+
+    // Error recovery uses timers and runs device resets in the background
+    void setEventLoop(struct ev_loop *loop) { mLoop = loop; }
+
+    // Frame latency is reported here, if set
+    void setTracer(LatencyTracer *tracer) { mTracer = tracer; }
+
+    // Messages between beginBatch() and endBatch() make up one frame, sent at the end
+    void beginBatch() { mBatching = true; }
+    void endBatch();
 
 protected:
+    /*
+     * Transfer classes, in priority order. When there's room for another transfer
+     * in flight, the highest priority queued transfer goes first.
+     */
+    enum TransferClass {
+        CLASS_CONFIG,
+        CLASS_LUT,
+        CLASS_FRAME,
+        NUM_CLASSES
+    };
+
+    struct Transfer {
+        Transfer(USBDevice *device, unsigned char endpoint, void *buffer, int length,
+            TransferClass cls, void *context = 0);
+        ~Transfer();
+        libusb_transfer *transfer;
+        USBDevice *device;
+        TransferClass cls;
+        void *context;
+        bool holdsLinkSlot;
+        double submitTime;      // When it went to libusb, 0 if it never did
+    };
+
+    // Limit on transfers in flight per device
+    static const unsigned MAX_PENDING = 2;
+
     libusb_device *mDevice;
     libusb_device_handle *mHandle;
+    const char *mType;
+    char mSerial[256];
     bool mVerbose;
+    LatencyTracer *mTracer;
+
+    // From setEventLoop(), or NULL if it hasn't been called
+    struct ev_loop *eventLoop() const { return mLoop; }
+
+    /*
+     * Memory for transfer buffers. Where the kernel supports it, this is usbfs memory
+     * mapped into our process, which the host controller can DMA from directly instead
+     * of copying each transfer at submit time. Otherwise it's ordinary heap memory.
+     * Requires an open device handle.
+     */
+    uint8_t *allocTransferMemory(size_t size, bool &deviceMemory);
+    void freeTransferMemory(uint8_t *mem, size_t size, bool deviceMemory);
+
+    /*
+     * Queue an asynchronous transfer. At most one transfer of each class waits in
+     * the queue; a newer one supersedes it, since it carries more recent data.
+     * The Transfer object is guaranteed to be freed eventually.
+     */
+    void submitTransfer(Transfer *t);
+
+    // Called when a transfer completes, fails, or is superseded. Check transfer->status.
+    virtual void transferFinished(Transfer *t);
+
+    // Called after the device was reset by error recovery, to restore any state it lost
+    virtual void deviceWasReset();
+
+    // Send the frame built up by pixel messages so far
+    virtual void writeFrame();
+
+    // Call after each message that changes the frame. Sends it now, unless we're batching.
+    void frameChanged();
+
+    /*
+     * Hand a transfer to the device. By default that's libusb_submit_transfer().
+     * Emulated devices override this, and report each transfer they take with
+     * emulatedTransferDone() once they're finished with it.
+     */
+    virtual int submitToDevice(Transfer *t);
+    void emulatedTransferDone(Transfer *t, libusb_transfer_status status);
+
+private:
+    /*
+     * Error recovery. A stalled endpoint gets its halt cleared, other errors back off
+     * for a while before we try again, and if errors keep happening we reset the
+     * device. No new transfers are submitted while any of this is in progress.
+     */
+    enum RecoveryState {
+        RECOVERY_NONE,
+        RECOVERY_CLEAR_HALT,
+        RECOVERY_BACKOFF,
+        RECOVERY_RESET,
+        RECOVERY_GONE           // Device disconnected or re-enumerated; waiting for hotplug
+    };
+
+    // Consecutive errors before we reset the device
+    static const unsigned RESET_THRESHOLD = 4;
+
+    // Backoff doubles with each consecutive error, between these limits
+    static const double MIN_BACKOFF;
+    static const double MAX_BACKOFF;
+
+    std::set<Transfer*> mPending;
+    Transfer *mQueued[NUM_CLASSES];
+    bool mBatching;
+    bool mBatchChanged;
+    USBLink *mLink;
+    struct ev_loop *mLoop;
+
+    RecoveryState mRecovery;
+    unsigned mErrorCount;
+    libusb_transfer *mClearHalt;
+    ev_timer mBackoffTimer;
+    ev_async mResetDone;
+    pthread_t mResetThread;
+    bool mResetRunning;
+    int mResetResult;
+    uint64_t mTransferErrors;
+    uint64_t mHaltsCleared;
+    uint64_t mResets;
+
+    void pumpTransfers();
+    void finishTransfer(Transfer *t);
+    static void completeTransfer(struct libusb_transfer *transfer);
 
-    // Utilities
-    bool matchConfigurationWithTypeAndSerial(const Value &config, const char *type, const char *serial);
-    const Value *findConfigMap(const Value &config);
+    void transferFailed(libusb_transfer_status status, unsigned char endpoint);
+    void startClearHalt(unsigned char endpoint);
+    void startBackoff();
+    void startReset();
+    void launchReset();
+    void recoveryDone();
+    static void cbClearHalt(struct libusb_transfer *transfer);
+    static void cbBackoff(struct ev_loop *loop, ev_timer *w, int revents);
+    static void cbResetDone(struct ev_loop *loop, ev_async *w, int revents);
+    static void *resetThread(void *context);
 };
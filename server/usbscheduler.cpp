@@ -0,0 +1,155 @@
+/*
+ * Output scheduling across devices that share a USB link.
+ * 
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "usbscheduler.h"
+#include "usbdevice.h"
+#include <algorithm>
+#include <sstream>
+#include <iostream>
+
+
+USBLink::USBLink(const std::string &name, unsigned budget)
+    : mName(name),
+      mBudget(budget),
+      mInFlight(0)
+{}
+
+bool USBLink::acquire(USBDevice *dev)
+{
+    if (mInFlight < mBudget) {
+        mInFlight++;
+        return true;
+    }
+
+    if (std::find(mWaiting.begin(), mWaiting.end(), dev) == mWaiting.end()) {
+        mWaiting.push_back(dev);
+    }
+    return false;
+}
+
+void USBLink::release()
+{
+    if (mInFlight) {
+        mInFlight--;
+    }
+
+    /*
+     * Offer the free slot to waiting devices in order. A device may turn it down
+     * if it's at its own transfer limit; it'll ask again when it has room.
+     */
+
+    while (mInFlight < mBudget && !mWaiting.empty()) {
+        USBDevice *dev = mWaiting.front();
+        mWaiting.pop_front();
+        dev->linkReady();
+    }
+}
+
+void USBLink::remove(USBDevice *dev)
+{
+    mWaiting.erase(std::remove(mWaiting.begin(), mWaiting.end(), dev), mWaiting.end());
+}
+
+USBScheduler::USBScheduler(bool verbose)
+    : mVerbose(verbose)
+{}
+
+USBScheduler::~USBScheduler()
+{
+    for (std::map<std::string, USBLink*>::iterator i = mLinks.begin(), e = mLinks.end(); i != e; ++i) {
+        delete i->second;
+    }
+}
+
+USBLink *USBScheduler::linkForDevice(libusb_device *device)
+{
+    /*
+     * Find the full-speed segment this device's frames actually cross.
+     *
+     * A full-speed device behind a high-speed hub shares that hub's transaction
+     * translator with its neighbors, no matter how many full-speed hubs sit in
+     * between. A single-TT hub has one translator for all of its ports; a multi-TT
+     * hub has one for each downstream port. With no high-speed hub on the way up,
+     * the device shares its root port's 12 Mbps with everything else plugged into it.
+     *
+     * High-speed devices skip the translators and share the root port at 480 Mbps,
+     * so their budget is scaled up to match.
+     */
+
+    uint8_t ports[8];
+    int numPorts = libusb_get_port_numbers(device, ports, sizeof ports);
+    unsigned bus = libusb_get_bus_number(device);
+    int speed = libusb_get_device_speed(device);
+    std::ostringstream key;
+    unsigned budget = LINK_BUDGET;
+
+    key << "bus " << bus;
+
+    if (numPorts < 1) {
+        // Unknown topology; don't share a budget with anyone.
+        key << " device " << unsigned(libusb_get_device_address(device));
+
+    } else if (speed >= LIBUSB_SPEED_HIGH) {
+        key << " port " << unsigned(ports[0]);
+        budget = LINK_BUDGET * (speed >= LIBUSB_SPEED_SUPER ? 5000 : 480) / FULL_SPEED_MBPS;
+
+    } else {
+        // Nearest high-speed hub above us, not counting the root hub
+        int depth = numPorts - 1;
+        libusb_device *hub = libusb_get_parent(device);
+        bool found = false;
+
+        while (hub && libusb_get_parent(hub) && depth > 0) {
+            if (libusb_get_device_speed(hub) >= LIBUSB_SPEED_HIGH) {
+                found = true;
+                break;
+            }
+            hub = libusb_get_parent(hub);
+            depth--;
+        }
+
+        if (found) {
+            libusb_device_descriptor dd;
+            bool multiTT = libusb_get_device_descriptor(hub, &dd) == 0 && dd.bDeviceProtocol == MULTI_TT_PROTOCOL;
+
+            key << " tt ";
+            for (int i = 0; i < depth; ++i) {
+                key << (i ? "." : "") << unsigned(ports[i]);
+            }
+            if (multiTT) {
+                key << " port " << unsigned(ports[depth]);
+            }
+        } else {
+            key << " port " << unsigned(ports[0]);
+        }
+    }
+
+    USBLink *&link = mLinks[key.str()];
+    if (!link) {
+        link = new USBLink(key.str(), budget);
+        if (mVerbose) {
+            std::clog << "New USB link: " << key.str() << ", " << budget << " frames in flight\n";
+        }
+    }
+    return link;
+}
@@ -0,0 +1,83 @@
+/*
+ * Output scheduling across devices that share a USB link.
+ * 
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <libusb.h>
+#include <string>
+#include <deque>
+#include <map>
+
+class USBDevice;
+
+
+/*
+ * Full-speed devices behind one transaction translator, or on one root port with
+ * no high-speed hub in between, share 12 Mbps. A USBLink limits how many frames its
+ * devices may have in flight at once. Devices that are refused a slot wait in
+ * FIFO order, so when the link is saturated every device gets its turn and frame
+ * rates degrade evenly.
+ */
+class USBLink
+{
+public:
+    USBLink(const std::string &name, unsigned budget);
+
+    const std::string &getName() const { return mName; }
+
+    // Try to take a frame slot. If none is free, the device is queued and woken later.
+    bool acquire(USBDevice *dev);
+
+    // Give back a slot, and offer free slots to waiting devices.
+    void release();
+
+    // Device is going away
+    void remove(USBDevice *dev);
+
+private:
+    std::string mName;
+    unsigned mBudget;
+    unsigned mInFlight;
+    std::deque<USBDevice*> mWaiting;
+};
+
+
+class USBScheduler
+{
+public:
+    USBScheduler(bool verbose);
+    ~USBScheduler();
+
+    // Frames in flight allowed on each shared full-speed segment. Faster links get proportionally more.
+    static const unsigned LINK_BUDGET = 2;
+    static const unsigned FULL_SPEED_MBPS = 12;
+
+    // bDeviceProtocol of a high-speed hub with one transaction translator per port
+    static const uint8_t MULTI_TT_PROTOCOL = 2;
+
+    // Find or create the link this device shares with its siblings
+    USBLink *linkForDevice(libusb_device *device);
+
+private:
+    bool mVerbose;
+    std::map<std::string, USBLink*> mLinks;
+};
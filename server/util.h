@@ -32,3 +32,13 @@
      const typeof( ((type *)0)->member ) *__mptr = (ptr); \
      (type *)( (char *)__mptr - offsetof(type,member) );})
 #endif
+
+#include <time.h>
+
+// Seconds on a monotonic clock, for measuring intervals
+static inline double monotonicTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
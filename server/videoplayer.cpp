@@ -0,0 +1,524 @@
+/*
+ * Raw video file playback onto canvas-mapped devices
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "videoplayer.h"
+#include "util.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <algorithm>
+
+// Chroma for monochrome video
+static const uint8_t kNeutralChroma[1] = { 128 };
+
+
+VideoPlayer::VideoPlayer(callback_t cb, void *context)
+    : mCallback(cb),
+      mContext(context),
+      mLoop(0),
+      mData(0),
+      mSize(0),
+      mPageSize(sysconf(_SC_PAGESIZE)),
+      mY4M(false),
+      mFrameBytes(0),
+      mFirstFrame(0),
+      mFrameRate(0),
+      mRepeat(true),
+      mOffset(0),
+      mIndex(0),
+      mShown(false),
+      mFinished(false),
+      mStartTime(0),
+      mReleased(0),
+      mAdviceFailed(false),
+      mFramesShown(0),
+      mFramesSkipped(0),
+      mLoops(0)
+{
+    memset(&mCanvas, 0, sizeof mCanvas);
+}
+
+VideoPlayer::~VideoPlayer()
+{
+    if (mLoop) {
+        ev_timer_stop(mLoop, &mTimer);
+    }
+    if (mData) {
+        munmap((void*) mData, mSize);
+    }
+}
+
+bool VideoPlayer::parse(const Value &config, std::ostream &error)
+{
+    /*
+     * One entry in the 'videos' list:
+     *
+     *   "file": Name of the video file
+     *   "canvas": Channel number of the canvas instructions to play it on
+     *   "format": Optional. "y4m" or "rgb". Default is "y4m" if the file has a
+     *             YUV4MPEG2 header.
+     *   "size": [width, height] of each frame. Required for "rgb".
+     *   "frameRate": Frames per second. Required for "rgb". Overrides the
+     *                rate in a y4m header.
+     *   "loop": Optional. false to stop on the last frame. Default is true.
+     */
+
+    if (!config.IsObject()) {
+        error << "Each item in 'videos' must be a JSON object.\n";
+        return false;
+    }
+
+    const Value &file = config["file"];
+    const Value &canvas = config["canvas"];
+    const Value &format = config["format"];
+    const Value &size = config["size"];
+    const Value &rate = config["frameRate"];
+    const Value &repeat = config["loop"];
+
+    if (!file.IsString()) {
+        error << "Each video needs a 'file' name.\n";
+        return false;
+    }
+    mPath = file.GetString();
+
+    if (!(canvas.IsUint() && canvas.GetUint() <= 255)) {
+        error << "Video 'canvas' must be a channel number from 0 to 255.\n";
+        return false;
+    }
+    mCanvas.channel = canvas.GetUint();
+
+    if (repeat.IsBool()) {
+        mRepeat = repeat.IsTrue();
+    } else if (!repeat.IsNull()) {
+        error << "Video 'loop' must be true or false.\n";
+        return false;
+    }
+
+    if (rate.IsNumber() && rate.GetDouble() > 0) {
+        mFrameRate = rate.GetDouble();
+    } else if (!rate.IsNull()) {
+        error << "Video 'frameRate' must be a positive number of frames per second.\n";
+        return false;
+    }
+
+    if (!openFile(error)) {
+        return false;
+    }
+
+    static const char y4mMagic[] = "YUV4MPEG2 ";
+    bool hasY4MHeader = mSize >= sizeof y4mMagic - 1 && !memcmp(mData, y4mMagic, sizeof y4mMagic - 1);
+
+    if ((format.IsNull() && hasY4MHeader) || (format.IsString() && !strcmp(format.GetString(), "y4m"))) {
+        if (!parseY4M(error)) {
+            return false;
+        }
+
+    } else if (format.IsString() && !strcmp(format.GetString(), "rgb")) {
+        if (!(size.IsArray() && size.Size() == 2 && size[0u].IsUint() && size[1].IsUint() &&
+                size[0u].GetUint() >= 1 && size[1].GetUint() >= 1)) {
+            error << "Raw RGB video '" << mPath << "' needs a 'size' of [width, height].\n";
+            return false;
+        }
+        if (!mFrameRate) {
+            error << "Raw RGB video '" << mPath << "' needs a 'frameRate'.\n";
+            return false;
+        }
+
+        mCanvas.format = Canvas::RGB;
+        mCanvas.width = size[0u].GetUint();
+        mCanvas.height = size[1].GetUint();
+        mCanvas.stride = mCanvas.width * 3;
+        mFrameBytes = size_t(mCanvas.stride) * mCanvas.height;
+        mFirstFrame = 0;
+
+    } else {
+        error << "Video 'format' must be \"y4m\" or \"rgb\". Raw RGB files need it set.\n";
+        return false;
+    }
+
+    const uint8_t *pixels;
+    size_t next;
+    if (!frameAt(mFirstFrame, pixels, next)) {
+        error << "Video '" << mPath << "' has no complete frames.\n";
+        return false;
+    }
+
+    mOffset = mFirstFrame;
+    return true;
+}
+
+bool VideoPlayer::openFile(std::ostream &error)
+{
+    int fd = open(mPath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error << "Can't open video '" << mPath << "': " << strerror(errno) << "\n";
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        error << "Video '" << mPath << "' is empty.\n";
+        close(fd);
+        return false;
+    }
+
+    void *mem = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (mem == MAP_FAILED) {
+        error << "Can't map video '" << mPath << "': " << strerror(errno) << "\n";
+        return false;
+    }
+
+    mData = (const uint8_t*) mem;
+    mSize = st.st_size;
+
+    // Ask for aggressive readahead, and for pages behind us to go first
+    if (madvise(mem, mSize, MADV_SEQUENTIAL) < 0) {
+        perror("Video madvise");
+        mAdviceFailed = true;
+    }
+    return true;
+}
+
+bool VideoPlayer::parseY4M(std::ostream &error)
+{
+    /*
+     * The stream header is one line of space-separated tags:
+     *
+     *   YUV4MPEG2 W640 H480 F30000:1001 Ip A1:1 C420jpeg
+     *
+     * We need the size, the frame rate, and the chroma subsampling. Other tags,
+     * like interlacing and aspect ratio, don't matter for sampling.
+     */
+
+    const uint8_t *end = (const uint8_t*) memchr(mData, '\n', std::min<size_t>(mSize, MAX_HEADER));
+    if (!end) {
+        error << "Video '" << mPath << "' doesn't start with a YUV4MPEG2 header.\n";
+        return false;
+    }
+
+    std::string header((const char*) mData, end - mData);
+    std::string colorspace = "420jpeg";
+    unsigned width = 0, height = 0;
+    double rate = 0;
+
+    for (size_t pos = header.find(' '); pos != std::string::npos; pos = header.find(' ', pos + 1)) {
+        const char *tag = header.c_str() + pos + 1;
+        switch (tag[0]) {
+            case 'W':
+                width = atoi(tag + 1);
+                break;
+            case 'H':
+                height = atoi(tag + 1);
+                break;
+            case 'F': {
+                unsigned num = atoi(tag + 1);
+                const char *colon = strchr(tag, ':');
+                unsigned den = colon ? atoi(colon + 1) : 0;
+                rate = den ? double(num) / den : 0;
+                break;
+            }
+            case 'C':
+                colorspace = std::string(tag + 1, strcspn(tag + 1, " "));
+                break;
+        }
+    }
+
+    if (!width || !height) {
+        error << "Video '" << mPath << "' has no frame size in its header.\n";
+        return false;
+    }
+    if (!mFrameRate) {
+        mFrameRate = rate;
+    }
+    if (!mFrameRate) {
+        error << "Video '" << mPath << "' has no frame rate in its header. Set 'frameRate'.\n";
+        return false;
+    }
+
+    mY4M = true;
+    mCanvas.format = Canvas::YUV;
+    mCanvas.width = width;
+    mCanvas.height = height;
+    mCanvas.stride = width;
+    mFirstFrame = end + 1 - mData;
+
+    unsigned chromaWidth, chromaHeight;
+
+    if (colorspace == "420" || colorspace == "420jpeg" || colorspace == "420paldv" || colorspace == "420mpeg2") {
+        mCanvas.chromaShiftX = mCanvas.chromaShiftY = 1;
+        chromaWidth = (width + 1) / 2;
+        chromaHeight = (height + 1) / 2;
+    } else if (colorspace == "422") {
+        mCanvas.chromaShiftX = 1;
+        mCanvas.chromaShiftY = 0;
+        chromaWidth = (width + 1) / 2;
+        chromaHeight = height;
+    } else if (colorspace == "444") {
+        mCanvas.chromaShiftX = mCanvas.chromaShiftY = 0;
+        chromaWidth = width;
+        chromaHeight = height;
+    } else if (colorspace == "mono") {
+        // Every chroma sample is the one neutral value
+        mCanvas.chromaShiftX = mCanvas.chromaShiftY = 31;
+        mCanvas.u = mCanvas.v = kNeutralChroma;
+        chromaWidth = chromaHeight = 0;
+    } else {
+        error << "Video '" << mPath << "' has unsupported colorspace C" << colorspace
+            << ". Use 8-bit 420, 422, 444, or mono.\n";
+        return false;
+    }
+
+    mCanvas.chromaStride = chromaWidth;
+    mFrameBytes = size_t(width) * height + 2 * size_t(chromaWidth) * chromaHeight;
+    return true;
+}
+
+bool VideoPlayer::frameAt(size_t offset, const uint8_t *&pixels, size_t &next) const
+{
+    /*
+     * Find the pixels of the frame starting at 'offset', and where the next one
+     * starts. False if there isn't a whole frame there.
+     */
+
+    size_t start = offset;
+
+    if (mY4M) {
+        // Each frame has its own header line, usually just "FRAME"
+        if (offset >= mSize || mSize - offset < 6 || memcmp(mData + offset, "FRAME", 5)) {
+            return false;
+        }
+        const uint8_t *end = (const uint8_t*) memchr(mData + offset, '\n', std::min<size_t>(mSize - offset, MAX_HEADER));
+        if (!end) {
+            return false;
+        }
+        start = end + 1 - mData;
+    }
+
+    if (start > mSize || mSize - start < mFrameBytes) {
+        return false;
+    }
+
+    pixels = mData + start;
+    next = start + mFrameBytes;
+    return true;
+}
+
+void VideoPlayer::start(struct ev_loop *loop)
+{
+    if (!mData) {
+        return;
+    }
+
+    mLoop = loop;
+    mStartTime = monotonicTime();
+
+    ev_timer_init(&mTimer, cbTimer, 0, 1.0 / mFrameRate);
+    ev_timer_start(loop, &mTimer);
+}
+
+void VideoPlayer::cbTimer(struct ev_loop *loop, struct ev_timer *watcher, int revents)
+{
+    VideoPlayer *self = container_of(watcher, VideoPlayer, mTimer);
+    self->tick();
+}
+
+void VideoPlayer::tick()
+{
+    /*
+     * The frame the clock says should be up now. Ticks land right on frame
+     * boundaries, so round to the nearest one; timer jitter alone shouldn't
+     * cost us a frame.
+     */
+    uint64_t due = uint64_t((monotonicTime() - mStartTime) * mFrameRate + 0.5);
+
+    if (due > mIndex) {
+        seek(due);
+        if (mFinished) {
+            return;
+        }
+    }
+
+    if (!mShown) {
+        const uint8_t *pixels;
+        size_t next;
+        if (frameAt(mOffset, pixels, next)) {
+            show(pixels);
+            readahead(next);
+        }
+    }
+}
+
+void VideoPlayer::seek(uint64_t index)
+{
+    /*
+     * Move forward to a later frame, counting frames we pass without showing.
+     * Frame headers in y4m files can vary in length, but almost never do, so
+     * we try jumping straight there before stepping through them one by one.
+     */
+
+    const uint8_t *pixels;
+    size_t next;
+    if (!frameAt(mOffset, pixels, next)) {
+        return;
+    }
+
+    const size_t frameSize = next - mOffset;
+    const uint64_t distance = index - mIndex;
+
+    if (distance <= (mSize - mOffset) / frameSize) {
+        size_t target = mOffset + distance * frameSize;
+        if (frameAt(target, pixels, next)) {
+            mFramesSkipped += distance - (mShown ? 1 : 0);
+            mOffset = target;
+            mIndex = index;
+            mShown = false;
+            return;
+        }
+    }
+
+    while (mIndex < index) {
+        frameAt(mOffset, pixels, next);
+
+        const uint8_t *nextPixels;
+        size_t after;
+        if (!frameAt(next, nextPixels, after)) {
+            // End of the file
+            if (!mRepeat) {
+                if (!mShown) {
+                    show(pixels);
+                }
+                ev_timer_stop(mLoop, &mTimer);
+                mFinished = true;
+                return;
+            }
+
+            if (!mShown) {
+                mFramesSkipped++;
+            }
+            mLoops++;
+            mOffset = mFirstFrame;
+            mIndex = 0;
+            mShown = false;
+            mStartTime = monotonicTime();
+            mReleased = 0;
+            return;
+        }
+
+        if (!mShown) {
+            mFramesSkipped++;
+        }
+        mOffset = next;
+        mIndex++;
+        mShown = false;
+    }
+}
+
+void VideoPlayer::show(const uint8_t *pixels)
+{
+    Canvas frame = mCanvas;
+    frame.pixels = pixels;
+
+    if (mY4M && mCanvas.chromaStride) {
+        size_t chromaBytes = (mFrameBytes - size_t(mCanvas.width) * mCanvas.height) / 2;
+        frame.u = pixels + size_t(mCanvas.width) * mCanvas.height;
+        frame.v = frame.u + chromaBytes;
+    }
+
+    mShown = true;
+    mFramesShown++;
+    mCallback(frame, mContext);
+}
+
+void VideoPlayer::readahead(size_t next)
+{
+    /*
+     * Ask for the next few frames now, so they're read while we wait. Pages
+     * we've already passed can go, so a long video doesn't fill memory.
+     */
+
+    const size_t pageMask = ~(mPageSize - 1);
+    const size_t frameSize = next - mOffset;
+
+    size_t begin = next & pageMask;
+    size_t end = std::min(mSize, next + frameSize * READAHEAD_FRAMES);
+    if (end > begin && madvise((void*) (mData + begin), end - begin, MADV_WILLNEED) < 0 && !mAdviceFailed) {
+        perror("Video readahead");
+        mAdviceFailed = true;
+    }
+
+    size_t done = mOffset & pageMask;
+    if (done > mReleased) {
+        if (madvise((void*) (mData + mReleased), done - mReleased, MADV_DONTNEED) < 0 && !mAdviceFailed) {
+            perror("Video release");
+            mAdviceFailed = true;
+        }
+        mReleased = done;
+    }
+}
+
+void VideoPlayer::beforeMemoryLock()
+{
+    /*
+     * mlockall() doesn't fault in pages it can't read, so the mapping goes
+     * inaccessible while memory is locked. Afterwards it's readable again, and
+     * unlocked, so pages are read ahead and dropped as the video plays.
+     */
+
+    if (mData && mprotect((void*) mData, mSize, PROT_NONE) < 0) {
+        perror("Video mprotect");
+    }
+}
+
+void VideoPlayer::afterMemoryLock()
+{
+    if (!mData) {
+        return;
+    }
+    if (mprotect((void*) mData, mSize, PROT_READ) < 0) {
+        perror("Video mprotect");
+    }
+    if (munlock(mData, mSize) < 0) {
+        perror("Video munlock");
+    }
+}
+
+void VideoPlayer::writeStatus(StatusWriter &w) const
+{
+    w.String("file").String(mPath.c_str());
+    w.String("canvas").Uint(mCanvas.channel);
+    w.String("width").Uint(mCanvas.width);
+    w.String("height").Uint(mCanvas.height);
+    w.String("frameRate").Double(mFrameRate);
+    w.String("frame").Uint64(mIndex);
+    w.String("framesShown").Uint64(mFramesShown);
+    w.String("framesSkipped").Uint64(mFramesSkipped);
+    w.String("loops").Uint64(mLoops);
+    w.String("finished").Bool(mFinished);
+}
@@ -0,0 +1,113 @@
+/*
+ * Raw video file playback onto canvas-mapped devices
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "rapidjson/document.h"
+#include "histogram.h"
+#include "canvas.h"
+#include <ev.h>
+#include <ostream>
+#include <string>
+#include <stdint.h>
+
+
+/*
+ * One entry in the 'videos' list. Plays an uncompressed video file, either
+ * YUV4MPEG2 (.y4m) or bare RGB frames, onto a canvas channel. Each frame goes
+ * to the canvas instructions in device maps without passing through OPC, so
+ * frames can be any size.
+ *
+ * The file is memory mapped. The kernel reads ahead sequentially, we ask for
+ * the next few frames early, and frames already shown are dropped again.
+ * Playback follows the clock: if we fall behind, frames are skipped, not
+ * shown late. When the server locks its memory, the file is left out, so it
+ * isn't read in and pinned all at once.
+ */
+
+class VideoPlayer
+{
+public:
+    typedef rapidjson::Value Value;
+    typedef Histogram::StatusWriter StatusWriter;
+
+    // Called with each frame to show
+    typedef void (*callback_t)(const Canvas &frame, void *context);
+
+    VideoPlayer(callback_t cb, void *context);
+    ~VideoPlayer();
+
+    // Check the configuration and open the file, appending any errors
+    bool parse(const Value &config, std::ostream &error);
+
+    void start(struct ev_loop *loop);
+
+    // Around mlockall(), which would otherwise fault in and lock the whole file
+    void beforeMemoryLock();
+    void afterMemoryLock();
+
+    // Write JSON object members describing playback
+    void writeStatus(StatusWriter &w) const;
+
+private:
+    static const unsigned READAHEAD_FRAMES = 8;
+    static const unsigned MAX_HEADER = 1024;
+
+    callback_t mCallback;
+    void *mContext;
+    struct ev_loop *mLoop;
+    ev_timer mTimer;
+
+    std::string mPath;
+    const uint8_t *mData;
+    size_t mSize;
+    size_t mPageSize;
+
+    bool mY4M;                  // Each frame starts with a FRAME line
+    Canvas mCanvas;             // Shape of every frame. Plane pointers are set for each one.
+    size_t mFrameBytes;         // Pixel data in each frame
+    size_t mFirstFrame;         // Offset of frame 0
+    double mFrameRate;
+    bool mRepeat;
+
+    // Playback position
+    size_t mOffset;             // Start of the current frame, including its header
+    uint64_t mIndex;            // Frame number since playback last started over
+    bool mShown;                // Current frame has been shown
+    bool mFinished;
+    double mStartTime;
+    size_t mReleased;           // Pages before this have been dropped
+    bool mAdviceFailed;         // madvise() error already reported
+
+    uint64_t mFramesShown;
+    uint64_t mFramesSkipped;
+    uint64_t mLoops;
+
+    bool openFile(std::ostream &error);
+    bool parseY4M(std::ostream &error);
+    bool frameAt(size_t offset, const uint8_t *&pixels, size_t &next) const;
+    void seek(uint64_t index);
+    void show(const uint8_t *pixels);
+    void readahead(size_t next);
+    void tick();
+    static void cbTimer(struct ev_loop *loop, struct ev_timer *watcher, int revents);
+};
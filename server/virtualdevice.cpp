@@ -0,0 +1,276 @@
+/*
+ * Emulated Fadecandy, rendering to shared memory instead of LEDs
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "virtualdevice.h"
+#include "util.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <iostream>
+#include <sstream>
+
+static const size_t OUTPUT_SIZE = sizeof(VirtualFCDevice::OutputHeader) + FCEmulator::NUM_CHANNELS;
+
+
+VirtualFCDevice::VirtualFCDevice(struct ev_loop *loop, const char *serial, bool verbose)
+    : FCDevice(0, verbose),
+      mLoop(loop),
+      mClosing(false),
+      mOutputFile(-1),
+      mOutput(0),
+      mBootTime(0),
+      mNextRefresh(0),
+      mRefreshes(0),
+      mFirstRefresh(0)
+{
+    strncpy(mSerial, serial, sizeof mSerial - 1);
+    mSerial[sizeof mSerial - 1] = '\0';
+    memset(mPixels, 0, sizeof mPixels);
+    ev_init(&mRefreshTimer, cbRefresh);
+    mRefreshTimer.data = this;
+}
+
+VirtualFCDevice::~VirtualFCDevice()
+{
+    /*
+     * These transfers never went to libusb, so ~USBDevice can't cancel them.
+     * Finish them here instead. Anything they'd submit in turn fails right away.
+     */
+
+    mClosing = true;
+    ev_timer_stop(mLoop, &mRefreshTimer);
+
+    while (!mInbox.empty()) {
+        std::vector<Transfer*> inbox;
+        inbox.swap(mInbox);
+        for (unsigned i = 0; i < inbox.size(); ++i) {
+            emulatedTransferDone(inbox[i], LIBUSB_TRANSFER_CANCELLED);
+        }
+    }
+
+    closeOutput();
+}
+
+int VirtualFCDevice::open()
+{
+    // Pretend to be the first firmware with frame status
+    memset(&mDD, 0, sizeof mDD);
+    mDD.idVendor = 0x1d50;
+    mDD.idProduct = 0x607a;
+    mDD.bcdDevice = FRAME_STATUS_VERSION;
+
+    if (!allocFramebuffers()) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    mBootTime = monotonicTime();
+    ev_timer_set(&mRefreshTimer, 0, mEmulator.refreshInterval());
+    ev_timer_again(mLoop, &mRefreshTimer);
+    return 0;
+}
+
+void VirtualFCDevice::loadConfiguration(const Config &config)
+{
+    const Value &output = (*config.value)["output"];
+
+    if (output.IsString()) {
+        openOutput(output.GetString());
+    } else if (output.IsNull()) {
+        openOutput((std::string("/dev/shm/fadecandy-") + mSerial).c_str());
+    } else if (!output.IsFalse()) {
+        std::clog << "Virtual device output must be a file name, or false for none.\n";
+    }
+
+    FCDevice::loadConfiguration(config);
+}
+
+bool VirtualFCDevice::openOutput(const char *path)
+{
+    /*
+     * A plain file, mapped shared. In /dev/shm it never touches a disk, and
+     * viewers can find it by name without any extra libraries.
+     */
+
+    int fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror(path);
+        return false;
+    }
+
+    if (ftruncate(fd, OUTPUT_SIZE) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return false;
+    }
+
+    void *mem = mmap(0, OUTPUT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return false;
+    }
+
+    mOutputPath = path;
+    mOutputFile = fd;
+    mOutput = (uint8_t*) mem;
+    memset(mOutput, 0, OUTPUT_SIZE);
+
+    OutputHeader *header = (OutputHeader*) mOutput;
+    memcpy(header->magic, "FCvd", 4);
+    header->version = OUTPUT_VERSION;
+    return true;
+}
+
+void VirtualFCDevice::closeOutput()
+{
+    if (mOutput) {
+        munmap(mOutput, OUTPUT_SIZE);
+        mOutput = 0;
+    }
+    if (mOutputFile >= 0) {
+        close(mOutputFile);
+        mOutputFile = -1;
+    }
+}
+
+int VirtualFCDevice::submitToDevice(Transfer *t)
+{
+    if (mClosing) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+
+    // Like the firmware, we only look at USB between refreshes
+    mInbox.push_back(t);
+    return 0;
+}
+
+void VirtualFCDevice::handleTransfers(uint32_t millis)
+{
+    /*
+     * Completing a transfer can submit the next one, so take the current inbox
+     * first. Newly submitted transfers wait for the next refresh, the same as
+     * packets that arrive while the firmware is busy drawing.
+     */
+
+    std::vector<Transfer*> inbox;
+    inbox.swap(mInbox);
+
+    for (unsigned i = 0; i < inbox.size(); ++i) {
+        Transfer *t = inbox[i];
+        const uint8_t *data = t->transfer->buffer;
+        unsigned length = t->transfer->length;
+
+        for (unsigned offset = 0; offset + FCEmulator::PACKET_SIZE <= length; offset += FCEmulator::PACKET_SIZE) {
+            if (mEmulator.handlePacket(data + offset, millis) && (mEmulator.flags() & FCEmulator::CFLAG_FRAME_STATUS)) {
+                framePresented(mEmulator.frameSequence(), uint32_t(monotonicTime() * 1e6));
+            }
+        }
+
+        emulatedTransferDone(t, LIBUSB_TRANSFER_COMPLETED);
+    }
+}
+
+void VirtualFCDevice::refresh(double now)
+{
+    // The firmware's clock starts when it boots
+    uint32_t millis = uint32_t((now - mBootTime) * 1e3);
+
+    handleTransfers(millis);
+    mEmulator.draw(millis, mPixels);
+
+    if (!mRefreshes) {
+        mFirstRefresh = now;
+    }
+    mRefreshes++;
+
+    if (mOutput) {
+        // Sequence lock. Odd while we write, so readers know to try again.
+        OutputHeader *header = (OutputHeader*) mOutput;
+        uint32_t sequence = header->sequence;
+
+        __atomic_store_n(&header->sequence, sequence + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        header->activeLength = mEmulator.activeLength();
+        header->activeStrips = mEmulator.activeStrips();
+        header->refreshes = mRefreshes;
+        header->timestamp = uint64_t(now * 1e6);
+        memcpy(mOutput + sizeof *header, mPixels, sizeof mPixels);
+
+        __atomic_store_n(&header->sequence, sequence + 2, __ATOMIC_RELEASE);
+    }
+}
+
+void VirtualFCDevice::cbRefresh(struct ev_loop *loop, struct ev_timer *watcher, int revents)
+{
+    /*
+     * Refreshes are shorter than the event loop's timer resolution, so each
+     * wakeup runs every refresh that came due since the last one. Dithering
+     * depends on the refresh count, so the rate matters, not just the timing.
+     * If we fall far behind, skip ahead instead of racing to catch up.
+     */
+
+    VirtualFCDevice *self = static_cast<VirtualFCDevice*>(watcher->data);
+    double now = monotonicTime();
+    unsigned count = 0;
+
+    if (!self->mNextRefresh) {
+        self->mNextRefresh = now;
+    }
+
+    while (self->mNextRefresh <= now && count++ < MAX_CATCHUP) {
+        self->refresh(self->mNextRefresh);
+        self->mNextRefresh += self->mEmulator.refreshInterval();
+    }
+
+    if (self->mNextRefresh <= now) {
+        self->mNextRefresh = now;
+    }
+
+    // Strip length can change at any time over OPC
+    watcher->repeat = self->mEmulator.refreshInterval();
+    ev_timer_again(loop, watcher);
+}
+
+void VirtualFCDevice::writeStatus(StatusWriter &w)
+{
+    FCDevice::writeStatus(w);
+
+    double elapsed = mRefreshes > 1 ? monotonicTime() - mFirstRefresh : 0;
+
+    w.String("virtual").Bool(true);
+    w.String("refreshes").Uint64(mRefreshes);
+    w.String("refreshRate").Double(elapsed > 0 ? (mRefreshes - 1) / elapsed : 0.0);
+    if (mOutput) {
+        w.String("output").String(mOutputPath.c_str());
+    }
+}
+
+std::string VirtualFCDevice::getName()
+{
+    std::ostringstream s;
+    s << "Virtual Fadecandy (Serial# " << mSerial << ")";
+    return s.str();
+}
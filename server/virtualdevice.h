@@ -0,0 +1,96 @@
+/*
+ * Emulated Fadecandy, rendering to shared memory instead of LEDs
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include "fcdevice.h"
+#include "fcemulator.h"
+#include <ev.h>
+
+
+/*
+ * A Fadecandy with no hardware. Everything above the USB transfers is the real
+ * FCDevice, so mapping, frame pacing, and frame status all behave as they would
+ * with a board attached. The transfers go to an FCEmulator, which refreshes at
+ * the rate real strips of the configured length would.
+ *
+ * Each refresh is written to a file that viewers can map, normally in /dev/shm.
+ * See OutputHeader for the layout.
+ */
+
+class VirtualFCDevice : public FCDevice
+{
+public:
+    VirtualFCDevice(struct ev_loop *loop, const char *serial, bool verbose);
+    virtual ~VirtualFCDevice();
+
+    virtual int open();
+    virtual void loadConfiguration(const Config &config);
+    virtual void writeStatus(StatusWriter &w);
+    virtual std::string getName();
+
+    /*
+     * Start of the output file. Pixels follow, 3 bytes each, by strip and then
+     * position. Readers copy the pixels between two reads of 'sequence', and
+     * try again if it changed or was odd.
+     */
+    struct OutputHeader {
+        char magic[4];              // "FCvd"
+        uint32_t version;           // OUTPUT_VERSION
+        uint32_t sequence;          // Odd while a refresh is being written
+        uint16_t activeLength;      // LEDs per strip the firmware is driving
+        uint16_t activeStrips;
+        uint64_t refreshes;
+        uint64_t timestamp;         // Microseconds, CLOCK_MONOTONIC
+    };
+
+    static const uint32_t OUTPUT_VERSION = 1;
+
+protected:
+    // Most refreshes we'll run at once after the event loop was busy
+    static const unsigned MAX_CATCHUP = 64;
+
+    virtual int submitToDevice(Transfer *t);
+
+private:
+    struct ev_loop *mLoop;
+    ev_timer mRefreshTimer;
+    FCEmulator mEmulator;
+    std::vector<Transfer*> mInbox;      // Taken by submitToDevice(), handled at the next refresh
+    bool mClosing;
+
+    std::string mOutputPath;
+    int mOutputFile;
+    uint8_t *mOutput;
+    uint8_t mPixels[FCEmulator::NUM_CHANNELS];
+
+    double mBootTime;
+    double mNextRefresh;
+    uint64_t mRefreshes;
+    double mFirstRefresh;
+
+    bool openOutput(const char *path);
+    void closeOutput();
+    void handleTransfers(uint32_t millis);
+    void refresh(double now);
+    static void cbRefresh(struct ev_loop *loop, struct ev_timer *watcher, int revents);
+};
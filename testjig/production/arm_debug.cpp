@@ -161,22 +161,15 @@ bool ARMDebug::memStoreAndVerify(uint32_t addr, uint32_t data)
     return memStoreAndVerify(addr, &data, 1);
 }
 
-bool ARMDebug::memStoreAndVerify(uint32_t addr, uint32_t *data, unsigned count)
+bool ARMDebug::memStoreAndVerify(uint32_t addr, const uint32_t *data, unsigned count)
 {
     if (!memStore(addr, data, count))
         return false;
 
-    if (!memWait())
-        return false;
-    if (!apWrite(MEM_TAR, addr))
-        return false;
-
     while (count) {
         uint32_t readback;
 
-        if (!memWait())
-            return false;
-        if (!apRead(MEM_DRW, readback))
+        if (!memLoad(addr, readback))
             return false;
 
         log(readback == *data ? LOG_TRACE_MEM : LOG_ERROR,
@@ -186,30 +179,45 @@ bool ARMDebug::memStoreAndVerify(uint32_t addr, uint32_t *data, unsigned count)
             return false;
 
         data++;
-        addr++;
+        addr += 4;
         count--;
     }
 
     return true;    
 }
 
-bool ARMDebug::memStore(uint32_t addr, uint32_t *data, unsigned count)
+bool ARMDebug::memSetAddress(uint32_t addr, bool first)
 {
+    /*
+     * The MEM-AP only guarantees TAR auto-increment within a 1 kB block.
+     * Load TAR at the start of each transfer and again at every block boundary.
+     */
+
+    if (!first && (addr & 0x3FF))
+        return true;
+
     if (!memWait())
         return false;
-    if (!apWrite(MEM_TAR, addr))
-        return false;
+    return apWrite(MEM_TAR, addr);
+}
+
+bool ARMDebug::memStore(uint32_t addr, const uint32_t *data, unsigned count)
+{
+    bool first = true;
 
     while (count) {
         log(LOG_TRACE_MEM, "MEM Store [%08x] %08x", addr, *data);
 
+        if (!memSetAddress(addr, first))
+            return false;
         if (!memWait())
             return false;
         if (!apWrite(MEM_DRW, *data))
             return false;
 
+        first = false;
         data++;
-        addr++;
+        addr += 4;
         count--;
     }
 
@@ -218,12 +226,11 @@ bool ARMDebug::memStore(uint32_t addr, uint32_t *data, unsigned count)
 
 bool ARMDebug::memLoad(uint32_t addr, uint32_t *data, unsigned count)
 {
-    if (!memWait())
-        return false;
-    if (!apWrite(MEM_TAR, addr))
-        return false;
+    bool first = true;
 
     while (count) {
+        if (!memSetAddress(addr, first))
+            return false;
         if (!memWait())
             return false;
         if (!apRead(MEM_DRW, *data))
@@ -231,8 +238,9 @@ bool ARMDebug::memLoad(uint32_t addr, uint32_t *data, unsigned count)
 
         log(LOG_TRACE_MEM, "MEM Load  [%08x] %08x", addr, *data);
 
+        first = false;
         data++;
-        addr++;
+        addr += 4;
         count--;
     }
 
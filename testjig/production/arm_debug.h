@@ -51,13 +51,13 @@ public:
 
     // Memory operations (AHB bus)
     bool memStore(uint32_t addr, uint32_t data);
-    bool memStore(uint32_t addr, uint32_t *data, unsigned count);
+    bool memStore(uint32_t addr, const uint32_t *data, unsigned count);
     bool memLoad(uint32_t addr, uint32_t &data);
     bool memLoad(uint32_t addr, uint32_t *data, unsigned count);
 
     // Write with verify
     bool memStoreAndVerify(uint32_t addr, uint32_t data);
-    bool memStoreAndVerify(uint32_t addr, uint32_t *data, unsigned count);
+    bool memStoreAndVerify(uint32_t addr, const uint32_t *data, unsigned count);
 
     // Poll for an expected value
     bool memPoll(unsigned addr, uint32_t &data, uint32_t mask, uint32_t expected, unsigned retries = DEFAULT_RETRIES);
@@ -102,6 +102,9 @@ protected:
     // Poll for MEM-AP not busy
     bool memWait();
 
+    // Point TAR at 'addr' if this is the first word or a new 1 kB block
+    bool memSetAddress(uint32_t addr, bool first);
+
     // Poll for an expected value
     bool dpReadPoll(unsigned addr, uint32_t &data, uint32_t mask, uint32_t expected, unsigned retries = DEFAULT_RETRIES);
     bool apReadPoll(unsigned addr, uint32_t &data, uint32_t mask, uint32_t expected, unsigned retries = DEFAULT_RETRIES);
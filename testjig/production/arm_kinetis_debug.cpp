@@ -128,8 +128,15 @@ bool ARMKinetisDebug::flashMassErase()
     if (!apWrite(REG_MDM_CONTROL, REG_MDM_CONTROL_CORE_HOLD_RESET | REG_MDM_CONTROL_MASS_ERASE))
         return false;
 
-    // Wait for the mass erase to complete
-    if (!apReadPoll(REG_MDM_STATUS, status, REG_MDM_STATUS_FLASH_ERASE_ACK, 0, 10000)) {
+    // Wait for the mass erase to begin (ACK bit set)
+    if (!apReadPoll(REG_MDM_STATUS, status, REG_MDM_STATUS_FLASH_ERASE_ACK, -1, 10000)) {
+        log(LOG_ERROR, "FLASH: Timed out waiting for mass erase to begin");
+        return false;
+    }
+
+    // Wait for it to complete (CONTROL bit cleared)
+    uint32_t control;
+    if (!apReadPoll(REG_MDM_CONTROL, control, REG_MDM_CONTROL_MASS_ERASE, 0, 10000)) {
         log(LOG_ERROR, "FLASH: Timed out waiting for mass erase to complete");
         return false;
     }
@@ -141,3 +148,170 @@ bool ARMKinetisDebug::flashMassErase()
 
     return true;
 }
+
+/*
+ * RAM-resident flash loader, hand-assembled Thumb code. It spins on each
+ * descriptor in turn; when the jig marks a buffer READY, it programs it one
+ * longword at a time with the FTFL "Program Longword" command, then hands
+ * the buffer back by marking it FREE. On error it stores (0x100 | FSTAT) in
+ * the status word and halts on a breakpoint.
+ *
+ *  start:      ldr   r4, =LOADER_DESC
+ *              ldr   r5, =REG_FTFL_FSTAT
+ *              movs  r6, r4
+ *  wait:       ldr   r0, [r6, #DESC_STATUS]
+ *              cmp   r0, #DESC_READY
+ *              bne   wait
+ *              ldr   r1, [r6, #DESC_ADDRESS]
+ *              ldr   r2, [r6, #DESC_COUNT]
+ *              ldr   r3, [r6, #DESC_SOURCE]
+ *  word_loop:  cmp   r2, #0
+ *              beq   buf_done
+ *              movs  r0, #0x70             @ Clear stale error flags
+ *              strb  r0, [r5, #0]
+ *              movs  r0, #6                @ PGM4 command in FCCOB0
+ *              lsls  r0, r0, #24
+ *              orrs  r0, r1                @ Address in FCCOB1-3
+ *              str   r0, [r5, #4]
+ *              ldr   r0, [r3, #0]          @ Data in FCCOB4-7
+ *              str   r0, [r5, #8]
+ *              movs  r0, #0x80             @ Launch
+ *              strb  r0, [r5, #0]
+ *  ccif_wait:  ldrb  r0, [r5, #0]
+ *              lsls  r7, r0, #24
+ *              bpl   ccif_wait
+ *              movs  r7, #0x71             @ MGSTAT0 | FPVIOL | ACCERR | RDCOLERR
+ *              tst   r0, r7
+ *              bne   error
+ *              adds  r1, #4
+ *              adds  r3, #4
+ *              subs  r2, #1
+ *              b     word_loop
+ *  buf_done:   movs  r0, #DESC_FREE
+ *              str   r0, [r6, #DESC_STATUS]
+ *              adds  r6, #DESC_SIZE
+ *              subs  r0, r6, r4
+ *              cmp   r0, #(DESC_SIZE * LOADER_NUM_BUFFERS)
+ *              bne   wait
+ *              movs  r6, r4
+ *              b     wait
+ *  error:      movs  r7, #1
+ *              lsls  r7, r7, #8
+ *              orrs  r0, r7
+ *              str   r0, [r6, #DESC_STATUS]
+ *              bkpt  #0
+ */
+static const uint32_t flashLoaderCode[] = {
+    0x4d164c15, 0x68f00026, 0xd1fc2801, 0x68726831,
+    0x2a0068b3, 0x2070d013, 0x20067028, 0x43080600,
+    0x68186068, 0x208060a8, 0x78287028, 0xd5fc0607,
+    0x42382771, 0x3104d10b, 0x3a013304, 0x2000e7e9,
+    0x361060f0, 0x28201b30, 0x0026d1dd, 0x2701e7db,
+    0x4338023f, 0xbe0060f0, 0x20000100, 0x40020000,
+};
+
+bool ARMKinetisDebug::coreRegWrite(unsigned num, uint32_t data)
+{
+    // Write DCRDR, then select the register with REGWnR set, and wait for S_REGRDY.
+    uint32_t dhcsr;
+    return memStore(REG_SCB_DCRDR, data) &&
+           memStore(REG_SCB_DCRSR, num | (1 << 16)) &&
+           memPoll(REG_SCB_DHCSR, dhcsr, 1 << 16, -1);
+}
+
+bool ARMKinetisDebug::flashLoaderStart()
+{
+    // Load the loader, and reset all descriptors to FREE
+    if (!memStoreAndVerify(LOADER_CODE, flashLoaderCode, sizeof flashLoaderCode / sizeof flashLoaderCode[0]))
+        return false;
+
+    for (unsigned i = 0; i < LOADER_NUM_BUFFERS; i++) {
+        uint32_t desc[4] = { 0, 0, LOADER_BUFFER + i * LOADER_BUFFER_WORDS * 4, DESC_FREE };
+        if (!memStoreAndVerify(LOADER_DESC + i * DESC_SIZE, desc, 4))
+            return false;
+    }
+    loaderNextBuffer = 0;
+
+    // Point the halted core at the loader: PC, SP at the top of SRAM, and xPSR with only the Thumb bit.
+    if (!coreRegWrite(15, LOADER_CODE))
+        return false;
+    if (!coreRegWrite(13, 0x20001FF0))
+        return false;
+    if (!coreRegWrite(16, 0x01000000))
+        return false;
+
+    // Mask interrupts while halted, then let the core run with C_MASKINTS still set.
+    if (!memStore(REG_SCB_DHCSR, 0xA05F000B))
+        return false;
+    if (!memStore(REG_SCB_DHCSR, 0xA05F0009))
+        return false;
+
+    log(LOG_NORMAL, "FLASH: Loader running");
+    return true;
+}
+
+bool ARMKinetisDebug::loaderWaitForBuffer(unsigned index)
+{
+    // Wait for the loader to hand a buffer back. Programming 1 kB takes tens of milliseconds.
+    // Stop as soon as it reports an error, rather than waiting out the timeout.
+    unsigned retries = 10000;
+    uint32_t status;
+
+    do {
+        if (!memLoad(LOADER_DESC + index * DESC_SIZE + DESC_STATUS, status))
+            return false;
+        if (status == DESC_FREE)
+            return true;
+        if (status & DESC_ERROR) {
+            log(LOG_ERROR, "FLASH: Loader reported an error (FSTAT: %02x)", status & 0xFF);
+            return false;
+        }
+    } while (retries--);
+
+    log(LOG_ERROR, "FLASH: Timed out waiting for loader");
+    return false;
+}
+
+bool ARMKinetisDebug::flashProgram(uint32_t address, const uint32_t *data, unsigned numWords)
+{
+    log(LOG_NORMAL, "FLASH: Programming %u words at %08x", numWords, address);
+
+    while (numWords) {
+        unsigned index = loaderNextBuffer;
+        unsigned chunk = numWords < LOADER_BUFFER_WORDS ? numWords : LOADER_BUFFER_WORDS;
+        uint32_t desc = LOADER_DESC + index * DESC_SIZE;
+        uint32_t header[2] = { address, chunk };
+
+        // The other buffer may still be programming while we fill this one.
+        if (!loaderWaitForBuffer(index))
+            return false;
+        if (!memStore(LOADER_BUFFER + index * LOADER_BUFFER_WORDS * 4, data, chunk))
+            return false;
+        if (!memStore(desc + DESC_ADDRESS, header, 2))
+            return false;
+        if (!memStore(desc + DESC_STATUS, DESC_READY))
+            return false;
+
+        loaderNextBuffer = (index + 1) % LOADER_NUM_BUFFERS;
+        address += chunk * 4;
+        data += chunk;
+        numWords -= chunk;
+    }
+
+    return true;
+}
+
+bool ARMKinetisDebug::flashLoaderFinish()
+{
+    // Drain both buffers, then halt the core again.
+    for (unsigned i = 0; i < LOADER_NUM_BUFFERS; i++) {
+        if (!loaderWaitForBuffer(i))
+            return false;
+    }
+
+    if (!memStore(REG_SCB_DHCSR, 0xA05F0003))
+        return false;
+
+    log(LOG_NORMAL, "FLASH: Programming complete");
+    return true;
+}
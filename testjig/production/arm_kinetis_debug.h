@@ -33,4 +33,49 @@ public:
 
     // Flash mass-erase operation. Works even on protected devices.
     bool flashMassErase();
+
+    /*
+     * Flash programming. A small loader is copied into target RAM and run
+     * on the (halted) core. We stream the image into a pair of RAM buffers;
+     * the loader programs one buffer while we fill the other.
+     *
+     * Call flashLoaderStart() once after startup() and flashMassErase(), then
+     * flashProgram() for each image, then flashLoaderFinish() to wait for the
+     * last buffer and halt the core again. 'address' must be word aligned and
+     * the destination must already be erased.
+     */
+    bool flashLoaderStart();
+    bool flashProgram(uint32_t address, const uint32_t *data, unsigned numWords);
+    bool flashLoaderFinish();
+
+    // Write a core register while the CPU is halted
+    bool coreRegWrite(unsigned num, uint32_t data);
+
+private:
+    // Loader memory layout, in the upper SRAM bank
+    static const uint32_t LOADER_CODE = 0x20000000;
+    static const uint32_t LOADER_DESC = 0x20000100;
+    static const uint32_t LOADER_BUFFER = 0x20000400;
+    static const unsigned LOADER_BUFFER_WORDS = 256;
+    static const unsigned LOADER_NUM_BUFFERS = 2;
+
+    // Per-buffer descriptor, shared with the loader
+    enum LoaderDescField {
+        DESC_ADDRESS = 0x0,
+        DESC_COUNT = 0x4,
+        DESC_SOURCE = 0x8,
+        DESC_STATUS = 0xC,
+        DESC_SIZE = 0x10
+    };
+
+    // Descriptor status values. Errors are reported as (DESC_ERROR | FSTAT).
+    enum LoaderStatus {
+        DESC_FREE = 0,
+        DESC_READY = 1,
+        DESC_ERROR = 0x100
+    };
+
+    unsigned loaderNextBuffer;
+
+    bool loaderWaitForBuffer(unsigned index);
 };
@@ -0,0 +1,184 @@
+/*
+ * Flash images for the production test jig.
+ * Generated by make_images.py, do not edit.
+ */
+
+#pragma once
+#include <stdint.h>
+
+// fc-boot-v101.hex
+static const uint32_t fcBootAddress = 0x00000000;
+static const unsigned fcBootWords = 953;
+static const uint32_t fcBootData[] = {
+    0x20001ffc, 0x000000f9, 0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203,
+    0x1fffe203, 0x1fffe201, 0x1fffe201, 0x1fffe201, 0x1fffe201, 0x1fffe203,
+    0x1fffe203, 0x1fffe201, 0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203,
+    0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203,
+    0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203,
+    0x1fffe203, 0x1fffe203, 0x1fffe709, 0x1fffe203, 0x1fffe203, 0x1fffe203,
+    0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203,
+    0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203,
+    0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe245, 0x1fffe203, 0x1fffe203,
+    0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203, 0x1fffe203,
+    0x1fffe203, 0x1fffe203, 0xf24c4b43, 0xf64d5220, 0x801a1028, 0xbf008018,
+    0x21d3bf00, 0x1c0ef823, 0x20072200, 0x41a6f44f, 0xf823811a, 0x4a3b0c0a,
+    0x1c08f823, 0x4b3b483a, 0x601a493b, 0x780a6058, 0x0308f002, 0xb118b2d8,
+    0xf042780a, 0x700b0308, 0x4b374836, 0x7001210a, 0x21a02224, 0xf803701a,
+    0x48341c01, 0xf0027802, 0xb2d90302, 0xd0f82900, 0x78024830, 0x0310f002,
+    0x2900b2d9, 0x482dd1f8, 0xf0027802, 0x2b08030c, 0x482bd1f9, 0x22402103,
+    0x23007001, 0x4a297042, 0x18984929, 0xd2044288, 0x58584928, 0x33045098,
+    0x4827e7f5, 0x42984b27, 0x0300f04f, 0xf840d202, 0xe7f73b04, 0x4a254824,
+    0x50995819, 0xf5b33304, 0xd1f77f80, 0x60024822, 0x78114a18, 0x0320f001,
+    0x2800b2d8, 0x4a15d0f8, 0xf0017811, 0xb2d80340, 0xd0f82800, 0x491c4a1b,
+    0x600a4b1c, 0x70182020, 0x78114a0e, 0x000cf001, 0xd1f9280c, 0x49194b18,
+    0x601a2202, 0x60193b44, 0xf000b662, 0xbf00b8e9, 0x4005200e, 0x00043f82,
+    0x2b000001, 0x40048038, 0x4007d002, 0x40065000, 0x40064001, 0x40064006,
+    0x40064004, 0x1fffe200, 0x1fffecd4, 0x00000410, 0x1ffff000, 0x1ffff530,
+    0x00000000, 0x1ffff000, 0xe000ed08, 0x11030000, 0x40048044, 0x40064000,
+    0x40048048, 0x000510c0, 0x681a4b18, 0x6180f442, 0x60194a17, 0x70132300,
+    0x4a174916, 0x7013700b, 0x4a174916, 0x7013700b, 0xf2404b16, 0xf44f3113,
+    0x60197251, 0x4b14605a, 0x3144f3c0, 0x1247f3c0, 0xf0007019, 0x705a001f,
+    0x72984a10, 0x23042102, 0x74517013, 0x4b0e74d3, 0x70182088, 0x223c480d,
+    0x3180f44f, 0x2c0df803, 0x47706001, 0x40048034, 0x1ffff522, 0x1ffff4a1,
+    0x1ffff524, 0x1ffff523, 0x1ffff4a0, 0x4004a040, 0x4006a000, 0x4006a002,
+    0x4006a010, 0xe000e100, 0x68194b11, 0xd51e054b, 0x78134a10, 0x2b3f3301,
+    0x2300bf88, 0x780a490e, 0xd109429a, 0x4a0db672, 0x6102f24a, 0xf24b8011,
+    0x80114180, 0xe7f1b662, 0x4a0a4909, 0x200154c8, 0x49047010, 0xb2db4a08,
+    0x700b20bc, 0x47707010, 0x40048034, 0x1ffff524, 0x1ffff523, 0x4005200c,
+    0x1ffff4a2, 0x1ffff4a0, 0x4006a003, 0x1845b538, 0x42ac4604, 0xf814d004,
+    0xf7ff0b01, 0xe7f8ffc5, 0x4b07bd38, 0xb1487818, 0x4906b672, 0x6202f24a,
+    0x4380f24b, 0x800b800a, 0xe7f2b662, 0xbf004770, 0x1ffff4a0, 0x4005200c,
+    0x4b0bb508, 0x05426818, 0xf7ffd511, 0x4909ffe6, 0xf44f4809, 0x600a3280,
+    0x23004908, 0x1203f240, 0x600a7003, 0x604a4806, 0x70034a06, 0xbd087013,
+    0x40048034, 0xe000e180, 0x4006a003, 0x4004a040, 0x1ffff522, 0x1ffff4a1,
+    0x4802b401, 0xbc014684, 0xbf004760, 0x1fffe815, 0xffffffff, 0xffffffff,
+    0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+    0xfffffffe, 0x40fffffe, 0xe7fee7fe, 0x4b0cb5f0, 0x781a4c0c, 0x0502f042,
+    0x06c5eb04, 0x0201f082, 0x48096070, 0x7806701a, 0xbf0c2e00, 0x27c82788,
+    0x4101ea47, 0x0601f086, 0x1035f844, 0xbdf07006, 0x1ffff448, 0x1fffe000,
+    0x1ffff49f, 0x43f7e92d, 0x78134a92, 0x0104f003, 0xb108b2c8, 0x70112104,
+    0x0208f003, 0x2a00b2d2, 0x8190f000, 0x782d4d8c, 0xf040092b, 0x08ad8187,
+    0xf8544c8a, 0xeb041035, 0xf3c107c5, 0x28090083, 0xf000687f, 0x280d8158,
+    0x2801d003, 0x8173f040, 0x6879e11c, 0x683a4882, 0x49826041, 0xf8446002,
+    0x4c811035, 0x60234981, 0x700c2401, 0x4980b292, 0x6fa0f5b2, 0xd068800b,
+    0xf240d821, 0x429a1321, 0x808bf000, 0x2a82d80c, 0xf5b2d03f, 0xd04e7f81,
+    0xf0402a80, 0x4c7780ae, 0x70262600, 0xe0ab7066, 0x33a1f240, 0xf000429a,
+    0x33808088, 0xf000429a, 0xf240808b, 0x42823002, 0x809bf040, 0xf240e047,
+    0x428a6181, 0xf5b2d80b, 0xd24e6fd0, 0x53a1f240, 0xd07f429a, 0x429a3380,
+    0x808bf040, 0xf5b2e082, 0xd00f6f10, 0xf5b2d808, 0xf0406f08, 0x4c628082,
+    0x4c607826, 0xe0737026, 0x43fdf5a2, 0x2b013b40, 0xe045d877, 0x4d5c7881,
+    0x8880e01e, 0xb1084b5b, 0xe10f210f, 0x26004c57, 0x70667026, 0xf003781b,
+    0xb2d50202, 0xd0672d00, 0x70212101, 0x484ce064, 0x06518882, 0x8843d15d,
+    0xd15a2b00, 0x00954c4f, 0x7829192d, 0x0102f021, 0x461c7029, 0x4944e05b,
+    0x0650888a, 0x884bd14d, 0xd14a2b00, 0x00944e47, 0x782819a5, 0x0102f040,
+    0x8842e7ee, 0xf8534b44, 0xf1a34c08, 0x2c00010c, 0x330cd03b, 0x0c18f833,
+    0xd1f44290, 0x2d030a15, 0x7823bf0c, 0xe03a890b, 0x88914a33, 0xd12c2904,
+    0x8881e030, 0x88c1bb49, 0x8840b949, 0x460a9100, 0xf000460b, 0xb910fad5,
+    0x240f4e32, 0x23007034, 0x8880e7c7, 0x482db9c8, 0xfb2ef000, 0xe014b9e8,
+    0x889a4b25, 0xf000b98a, 0xe00cfb91, 0xb9618881, 0xfab8f000, 0x70204c25,
+    0xe0102301, 0x88904a1e, 0xf000b918, 0x2800fb99, 0x210fd1e1, 0xe09d4b21,
+    0xe0042302, 0x4c212328, 0x4c1ce001, 0x48162306, 0x42b388c6, 0x461ebf38,
+    0xbf342e40, 0x25404635, 0x46294620, 0xfed2f7ff, 0x442c1b76, 0x2d40d104,
+    0x8085f040, 0xe0034635, 0xbf342e40, 0x25404635, 0x46294620, 0xfec2f7ff,
+    0x442c1b76, 0x2d40d101, 0x4b07d175, 0x601c4a0e, 0xe0708016, 0x40072080,
+    0x40072090, 0x1fffe000, 0x1ffff48c, 0x00400080, 0x1ffff400, 0x1ffff49f,
+    0x1ffff404, 0x1ffff496, 0x1ffff49e, 0x400720c0, 0x1fffebd4, 0x1fffec6e,
+    0x1ffff494, 0x88194b4c, 0x1221f240, 0xd12a4291, 0x4a4a8898, 0x8811b118,
+    0x429988db, 0x4e46d820, 0x88f18812, 0x97008870, 0x0901ebc2, 0x0f40f1b9,
+    0xf04fbf28, 0x464b0940, 0x8100f8df, 0xfa48f000, 0xf8b8b170, 0x88f20000,
+    0xfa1f4481, 0x454af989, 0x9000f8a8, 0x483ad807, 0xf7ff2100, 0xe002fe6f,
+    0x210f4b38, 0x48387019, 0x0035f844, 0x4d37e01f, 0xb195682d, 0x88374e36,
+    0xbf342f40, 0x2440463c, 0x46214628, 0xfe5af7ff, 0xb2881b39, 0xb9088030,
+    0xd1002c40, 0x4b2d1928, 0x49276018, 0xf5b2880a, 0xd1046fa0, 0x70482000,
+    0x78894b2a, 0x482a7019, 0x70022201, 0x21084b29, 0xe6617019, 0xd51f07d9,
+    0x4b274925, 0x24024820, 0x701a700c, 0x4c264b25, 0x60986018, 0x611a4825,
+    0x619a60d8, 0x4b19605c, 0x7018200d, 0x23ff4822, 0xf8007003, 0x74023c08,
+    0x70134a20, 0x209f4b20, 0x70182201, 0xe018700a, 0xd505061a, 0x200d4a0f,
+    0x70102180, 0x1c40f802, 0x0002f003, 0xb12ab2c2, 0x78014815, 0x70012202,
+    0x2c08f800, 0x0310f003, 0xb110b2d8, 0x21104a0b, 0xe8bd7011, 0xbf0083fe,
+    0x1ffff48c, 0x1ffff404, 0x1ffff496, 0x400720c0, 0x00400080, 0x1ffff400,
+    0x1ffff494, 0x40072098, 0x40072094, 0x40072080, 0x1ffff448, 0x1fffe000,
+    0x1ffff408, 0x1ffff44c, 0x40072088, 0x4007208c, 0x40072084, 0x681a4b17,
+    0x2080f442, 0x4b166018, 0x70192180, 0x4a147818, 0xd4fb0600, 0x49144b13,
+    0x2007f3c3, 0xf3c37008, 0x75084007, 0x20ff0e1b, 0xf801760b, 0xf8010c1c,
+    0xf8010c14, 0x78110c8c, 0xf0412001, 0x21000340, 0xf8027013, 0x4b090c78,
+    0x1c0cf802, 0xf8024908, 0x22080c88, 0x601a2010, 0x47707008, 0x40048034,
+    0x4007210c, 0x1fffe000, 0x4007209c, 0xe000e104, 0x40072108, 0x49054b04,
+    0x780a7818, 0xbf384290, 0x1a803040, 0xbf004770, 0x1ffff522, 0x1ffff4a1,
+    0x78194b08, 0x781a4b08, 0xd0084291, 0xb2c21c50, 0xbf882a3f, 0x49052200,
+    0x701a5c88, 0xf04f4770, 0x477030ff, 0x1ffff522, 0x1ffff4a1, 0x1ffff4e2,
+    0x4b30b510, 0xf0107818, 0xd0210f30, 0x492eb672, 0xb932780a, 0x780b390f,
+    0x21404b2c, 0xb6627019, 0xb662e016, 0x482b4c2a, 0x78007823, 0x780c492a,
+    0xb2c91c59, 0xbf88293f, 0x42812100, 0x4b27d002, 0x460b545c, 0xf0123a01,
+    0xd1ef02ff, 0x70034820, 0x78104a23, 0x2900b241, 0xda21b2c2, 0x78184b19,
+    0xd51d0603, 0x49204c1f, 0x780b7824, 0xd00e42a3, 0x48143301, 0x7801b2db,
+    0x2b3f491c, 0x2300bf88, 0x49155cc8, 0x310d7008, 0x28077808, 0x4916d9ee,
+    0x4b0c700b, 0x06007818, 0x4b11d502, 0x7019217c, 0x0240f002, 0xb158b2d0,
+    0x780b4906, 0x0240f003, 0xb128b2d0, 0x480a4b0e, 0x223c2100, 0x70027019,
+    0xbf00bd10, 0x4006a004, 0x4006a016, 0x4006a011, 0x1ffff522, 0x1ffff4a1,
+    0x4006a007, 0x1ffff4e2, 0x4006a003, 0x1ffff524, 0x1ffff523, 0x1ffff4a2,
+    0x1ffff4a0, 0x4b04b672, 0x6202f24a, 0x4080f24b, 0x8018801a, 0x4770b662,
+    0x4005200c, 0xf242b538, 0xf0007010, 0x2107f9ad, 0xf000482e, 0x200af9b1,
+    0xf9bef000, 0xf9c4f000, 0xf7ff2400, 0xb140ff43, 0xff4ef7ff, 0x5ce14b27,
+    0xd1024288, 0x2c073401, 0xf000d1f3, 0x2c07f9a5, 0x4c23d00b, 0xf5a06860,
+    0xf5b25280, 0xd2043ff8, 0x49214d20, 0x428b682b, 0x4a20d127, 0x20204c20,
+    0x75a2f44f, 0x60106025, 0x0c14f842, 0xf86ef000, 0xfee0f7ff, 0xf882f000,
+    0xd0022807, 0xffb6f7ff, 0x4b14e7f8, 0x60192100, 0x4816240b, 0x60052520,
+    0xf7ff4d15, 0x3d01ffab, 0x3c01d1fb, 0xf7ffd1f5, 0xb672ffa5, 0x70144a11,
+    0xb672e7fe, 0x60044810, 0xff9cf7ff, 0x602a2200, 0x68616820, 0x33fff04f,
+    0x4685469e, 0x20004708, 0xbf00bd38, 0x1fffecc4, 0x00001000, 0x20001ffc,
+    0x74624346, 0x400ff094, 0x4004b014, 0x400ff08c, 0x000186a0, 0x40072108,
+    0xe000ed08, 0xb5100603, 0xf010d520, 0xd0070440, 0x4b10480f, 0x210e220a,
+    0x70197002, 0xe0132200, 0x0230f010, 0x4a0ad008, 0x210a4b0a, 0x490a7011,
+    0x70182008, 0xe009700c, 0x0001f010, 0x4b04d007, 0x7018200a, 0x70014803,
+    0x70024803, 0xbd102001, 0x1fffeccc, 0x1ffff52d, 0x1ffff52c, 0x781a4b09,
+    0xd5fb0611, 0x21814808, 0x700122ff, 0x2c01f800, 0x20802170, 0x70187019,
+    0x781a4b02, 0xd5fb0612, 0xbf004770, 0x40020000, 0x40020007, 0x78184b01,
+    0xbf004770, 0x1fffeccc, 0x189cb5f0, 0x6f80f5b4, 0xd8019e05, 0xd904428c,
+    0x210a4b26, 0x22087019, 0x4d25e020, 0x250018aa, 0xd003429d, 0x55575d77,
+    0xe7f93501, 0xd13b428c, 0x781a4b1e, 0xd0052a02, 0xd0032a05, 0x7018200a,
+    0xe00b220f, 0x4a19491b, 0xf013780b, 0xd0020f80, 0x78334e19, 0x210ab133,
+    0x220e7011, 0x70024817, 0xbdf02000, 0x4815b924, 0x70132306, 0xe01b7004,
+    0x48130284, 0x5480f504, 0x25016004, 0x70354811, 0x70062609, 0x4607f3c4,
+    0xb2e40a24, 0x6c01f800, 0x4c02f800, 0x3c03f800, 0x70082070, 0x70082080,
+    0x70112103, 0x70134a05, 0xbdf02001, 0x1fffeccc, 0x14000000, 0x40020000,
+    0x1ffff52c, 0x1ffff52d, 0x1ffff528, 0x40020007, 0xb5f84a2c, 0x2b037813,
+    0xd3424604, 0xd9082b04, 0xd13e2b06, 0x70102007, 0xf44f4a27, 0x6011717a,
+    0x4d26e037, 0x782f4e26, 0x2f017830, 0x2f02d002, 0xe01ed124, 0xf7ff2104,
+    0xb9f8ff35, 0x4a224921, 0x702b2302, 0x210b680b, 0xf3c37011, 0xf8024107,
+    0xf3c31c01, 0xb2db2107, 0x1c02f802, 0x3c03f802, 0x21804a1a, 0xf8027017,
+    0x20700c01, 0x70317030, 0x2107e004, 0xff16f7ff, 0x7028b900, 0x781a4b0d,
+    0xd0062a0a, 0x7801480d, 0x2205b909, 0x2204e000, 0x4b0f701a, 0x78184908,
+    0x4906680b, 0x0a1a7020, 0x70630c18, 0x70a2780b, 0x70e02200, 0x71627123,
+    0xbdf82001, 0x1fffeccc, 0x1fffecd0, 0x1ffff52c, 0x40020000, 0x1ffff528,
+    0x40020007, 0x4002000b, 0x1ffff52d, 0x48094b08, 0x2a0a781a, 0x2202d105,
+    0x70012100, 0x2001701a, 0x210a4770, 0x230f7019, 0x20007003, 0xbf004770,
+    0x1fffeccc, 0x1ffff52d, 0x49044b03, 0x22022000, 0x701a7008, 0x47702001,
+    0x1fffeccc, 0x1ffff52d, 0x4802b401, 0xbc014684, 0xbf004760, 0x00000261,
+    0x4802b401, 0xbc014684, 0xbf004760, 0x00000355, 0x4802b401, 0xbc014684,
+    0xbf004760, 0x00000391, 0x4802b401, 0xbc014684, 0xbf004760, 0x000002f1,
+    0x4802b401, 0xbc014684, 0xbf004760, 0x0000036b, 0x00000100, 0x1fffec1c,
+    0x00000012, 0x00000200, 0x1fffec40, 0x0000001b, 0x00000300, 0x1fffecc0,
+    0x00000000, 0x00000301, 0x1fffec2e, 0x00000000, 0x00000302, 0x1fffec96,
+    0x00000000, 0x000003ee, 0x1fffec5c, 0x00000000, 0x00000000, 0x00000000,
+    0x00000000, 0x02000112, 0x40000000, 0x60821d50, 0x02010101, 0x03120100,
+    0x00630073, 0x006e0061, 0x0069006c, 0x0065006d, 0x001b0209, 0x80020101,
+    0x00040932, 0x01fe0000, 0x21090202, 0x0027100d, 0x00010104, 0x004d0312,
+    0x00460053, 0x00310054, 0x00300030, 0x0028007e, 0x01000000, 0x00010004,
+    0x00000000, 0x01000000, 0x554e4957, 0x00004253, 0x00000000, 0x00000000,
+    0x00000000, 0x032a0000, 0x00610046, 0x00650064, 0x00610063, 0x0064006e,
+    0x00200079, 0x006f0042, 0x0074006f, 0x006f006c, 0x00640061, 0x00720065,
+    0x04090304, 0x422d4346, 0x00746f6f, 0x00000002, 0x00000001,
+};
+
+struct fcImage {
+    const char *name;
+    uint32_t address;
+    const uint32_t *data;
+    unsigned words;
+};
+
+static const fcImage fcImages[] = {
+    { "fcBoot", fcBootAddress, fcBootData, fcBootWords },
+};
+static const unsigned fcImageCount = 1;
@@ -0,0 +1,74 @@
+#!/usr/bin/env python
+
+# Convert Intel HEX images into a C header for the production test jig.
+#
+# usage: make_images.py name=file.hex [name=file.hex ...] > fc_images.h
+#
+# Each image becomes a word array plus its flash base address. Gaps inside
+# an image are filled with 0xFF, the same as erased flash. The fcImages table
+# lists them all, in the order given, for programming in one loader session.
+
+import sys
+
+def readHex(path):
+    mem = {}
+    base = 0
+    for line in open(path):
+        line = line.strip()
+        if not line.startswith(':'):
+            continue
+        rec = bytearray.fromhex(line[1:])
+        count, addr, rtype = rec[0], (rec[1] << 8) | rec[2], rec[3]
+        data = rec[4:4 + count]
+        if rtype == 0:
+            for i, b in enumerate(data):
+                mem[base + addr + i] = b
+        elif rtype == 2:
+            base = ((data[0] << 8) | data[1]) << 4
+        elif rtype == 4:
+            base = ((data[0] << 8) | data[1]) << 16
+    return mem
+
+def toWords(mem):
+    start = min(mem) & ~3
+    end = (max(mem) + 4) & ~3
+    words = []
+    for addr in range(start, end, 4):
+        words.append(sum(mem.get(addr + i, 0xFF) << (8 * i) for i in range(4)))
+    return start, words
+
+print("/*")
+print(" * Flash images for the production test jig.")
+print(" * Generated by make_images.py, do not edit.")
+print(" */")
+print("")
+print("#pragma once")
+print("#include <stdint.h>")
+
+names = []
+for arg in sys.argv[1:]:
+    name, path = arg.split('=', 1)
+    names.append(name)
+    start, words = toWords(readHex(path))
+    print("")
+    print("// %s" % path.split('/')[-1])
+    print("static const uint32_t %sAddress = 0x%08x;" % (name, start))
+    print("static const unsigned %sWords = %d;" % (name, len(words)))
+    print("static const uint32_t %sData[] = {" % name)
+    for i in range(0, len(words), 6):
+        print("    " + " ".join("0x%08x," % w for w in words[i:i+6]))
+    print("};")
+
+print("")
+print("struct fcImage {")
+print("    const char *name;")
+print("    uint32_t address;")
+print("    const uint32_t *data;")
+print("    unsigned words;")
+print("};")
+print("")
+print("static const fcImage fcImages[] = {")
+for name in names:
+    print("    { \"%s\", %sAddress, %sData, %sWords }," % (name, name, name, name))
+print("};")
+print("static const unsigned fcImageCount = %d;" % len(names))
@@ -8,6 +8,7 @@
 
 #include "arm_kinetis_debug.h"
 #include "arm_kinetis_reg.h"
+#include "fc_images.h"
 
 const unsigned buttonPin = 2;
 const unsigned ledPin = 13;
@@ -43,6 +44,26 @@ void loop()
     if (!target.startup())
         return;
 
+    /*
+     * Install the bootloader and firmware: every image in fc_images.h, in one loader session
+     */
+
+    if (fcImageCount < 2)
+        Serial.println("Warning: fc_images.h has no firmware image, this board will still need DFU");
+
+    if (!target.flashMassErase())
+        return;
+    if (!target.flashLoaderStart())
+        return;
+    for (unsigned i = 0; i < fcImageCount; i++) {
+        Serial.print("Programming ");
+        Serial.println(fcImages[i].name);
+        if (!target.flashProgram(fcImages[i].address, fcImages[i].data, fcImages[i].words))
+            return;
+    }
+    if (!target.flashLoaderFinish())
+        return;
+
     /*
      * Try blinking an LED on the target
      */
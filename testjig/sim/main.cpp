@@ -0,0 +1,189 @@
+/*
+ * Host-side test harness for the production test jig's SWD code.
+ *
+ * Runs the same ARMDebug / ARMKinetisDebug sequence the jig uses against a
+ * simulated target, checks the resulting flash contents, and reports how
+ * much wire traffic each step cost.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "arm_kinetis_debug.h"
+#include "swd_target.h"
+#include "fc_images.h"
+
+static const unsigned swclkPin = 3;
+static const unsigned swdioPin = 4;
+
+HostSerial Serial;
+
+void pinMode(unsigned pin, unsigned mode)
+{
+    simTarget.pinMode(pin, mode);
+}
+
+void digitalWrite(unsigned pin, unsigned value)
+{
+    simTarget.digitalWrite(pin, value);
+}
+
+int digitalRead(unsigned pin)
+{
+    return simTarget.digitalRead(pin);
+}
+
+static void report(const char *step, const SWDTarget::Stats &before, unsigned words = 0)
+{
+    const SWDTarget::Stats &s = simTarget.stats();
+    uint64_t clocks = s.clocks - before.clocks;
+
+    printf("%-14s %9llu clocks  DP %5llu/%-5llu AP %6llu/%-6llu bus %6llu/%-6llu wait %4llu  %8.3f ms",
+        step, (unsigned long long) clocks,
+        (unsigned long long) (s.dpReads - before.dpReads),
+        (unsigned long long) (s.dpWrites - before.dpWrites),
+        (unsigned long long) (s.apReads - before.apReads),
+        (unsigned long long) (s.apWrites - before.apWrites),
+        (unsigned long long) (s.busReads - before.busReads),
+        (unsigned long long) (s.busWrites - before.busWrites),
+        (unsigned long long) (s.waits - before.waits),
+        (s.cpuCycles - before.cpuCycles) / 48000.0);
+    if (words) {
+        printf("  %.1f clocks/word", double(clocks) / words);
+    }
+    printf("\n");
+}
+
+static bool fail(const char *step)
+{
+    printf("FAILED: %s\n", step);
+    return false;
+}
+
+static bool run(ARMKinetisDebug &target, ARMDebug::LogLevel logLevel)
+{
+    SWDTarget::Stats before = simTarget.stats();
+    if (!target.begin(swclkPin, swdioPin, logLevel))
+        return fail("begin");
+    report("begin", before);
+
+    before = simTarget.stats();
+    if (!target.startup())
+        return fail("startup");
+    report("startup", before);
+
+    // Round-trip a block through SRAM, to measure bulk memory port throughput
+    static uint32_t pattern[1024], readback[1024];
+    for (unsigned i = 0; i < 1024; i++) {
+        pattern[i] = i * 0x9E3779B9;
+    }
+    before = simTarget.stats();
+    if (!target.memStore(0x1FFFF000, pattern, 1024))
+        return fail("memStore");
+    report("memStore", before, 1024);
+
+    before = simTarget.stats();
+    if (!target.memLoad(0x1FFFF000, readback, 1024))
+        return fail("memLoad");
+    report("memLoad", before, 1024);
+    if (memcmp(pattern, readback, sizeof pattern))
+        return fail("SRAM readback mismatch");
+
+    before = simTarget.stats();
+    if (!target.flashMassErase())
+        return fail("flashMassErase");
+    report("massErase", before);
+
+    before = simTarget.stats();
+    if (!target.flashLoaderStart())
+        return fail("flashLoaderStart");
+    report("loaderStart", before);
+
+    // Every image in one loader session, the same as the production sketch
+    unsigned totalWords = 0;
+    before = simTarget.stats();
+    for (unsigned i = 0; i < fcImageCount; i++) {
+        if (!target.flashProgram(fcImages[i].address, fcImages[i].data, fcImages[i].words))
+            return fail("flashProgram");
+        totalWords += fcImages[i].words;
+    }
+    if (!target.flashLoaderFinish())
+        return fail("flashLoaderFinish");
+    report("flashProgram", before, totalWords);
+
+    if (simTarget.stats().flashWords < totalWords)
+        return fail("not every word was programmed");
+    for (unsigned i = 0; i < fcImageCount; i++) {
+        const fcImage &image = fcImages[i];
+        for (unsigned j = 0; j < image.words; j++) {
+            uint32_t addr = image.address + j * 4;
+            if (simTarget.flashWord(addr) != image.data[j]) {
+                printf("Flash mismatch in %s at %08x: expected %08x, found %08x\n",
+                    image.name, addr, image.data[j], simTarget.flashWord(addr));
+                return fail("flash verify");
+            }
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    int logLevel = ARMDebug::LOG_ERROR;
+    int c;
+
+    while ((c = getopt(argc, argv, "vw:c:")) != -1) {
+        switch (c) {
+            case 'v':
+                logLevel++;
+                break;
+            case 'w':
+                simTarget.setWaitInterval(atoi(optarg));
+                break;
+            case 'c':
+                simTarget.setCyclesPerClock(atoi(optarg));
+                break;
+            default:
+                fprintf(stderr,
+                    "usage: %s [-v ...] [-w wait interval] [-c cycles per clock]\n"
+                    "\n"
+                    "  -v   More logging. Repeat for memory, AP, DP and wire traces.\n"
+                    "  -w   Answer WAIT to every Nth AP access (N >= 2)\n"
+                    "  -c   Target CPU cycles per SWD clock (default 24)\n",
+                    argv[0]);
+                return 2;
+        }
+    }
+
+    simTarget.attach(swclkPin, swdioPin);
+    ARMKinetisDebug target;
+    bool ok = run(target, ARMDebug::LogLevel(logLevel < ARMDebug::LOG_MAX ? logLevel : ARMDebug::LOG_MAX - 1));
+
+    const SWDTarget::Stats &s = simTarget.stats();
+    printf("%s: %llu clocks, %llu waits, %llu faults, %llu protocol errors\n",
+        ok ? "PASSED" : "FAILED",
+        (unsigned long long) s.clocks, (unsigned long long) s.waits,
+        (unsigned long long) s.faults, (unsigned long long) s.protocolErrors);
+
+    return ok && !s.protocolErrors ? 0 : 1;
+}
@@ -0,0 +1,824 @@
+/*
+ * Simulated Freescale Kinetis target, seen through its SWD port.
+ *
+ * This models the SWD wire protocol bit by bit, the ADIv5 debug port,
+ * the AHB-AP and Freescale's MDM-AP, enough of the MK20DX128 memory map
+ * to run the test jig's startup and flash programming sequences, and a
+ * small Thumb interpreter for code the jig loads into SRAM.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "swd_target.h"
+#include "arm_kinetis_reg.h"
+#include <string.h>
+#include <stdio.h>
+
+// Acknowledge codes
+static const unsigned ACK_OK = 1;
+static const unsigned ACK_WAIT = 2;
+static const unsigned ACK_FAULT = 4;
+
+// Identification
+static const uint32_t DP_IDCODE = 0x2ba01477;
+static const uint32_t AHB_AP_IDR = 0x24770011;
+static const uint32_t MDM_AP_IDR = 0x001C0000;
+
+// CTRL/STAT bits
+static const uint32_t CS_WDATAERR = 1 << 7;
+static const uint32_t CS_STICKYERR = 1 << 5;
+static const uint32_t CS_STICKYCMP = 1 << 4;
+static const uint32_t CS_STICKYORUN = 1 << 1;
+static const uint32_t CS_STICKY = CS_WDATAERR | CS_STICKYERR | CS_STICKYCMP | CS_STICKYORUN;
+
+// Timing, in 48 MHz core clock cycles
+static const uint64_t PGM4_CYCLES = 3120;           // 65 us
+static const uint64_t ERSSCR_CYCLES = 960000;       // 20 ms
+static const uint64_t MASS_ERASE_CYCLES = 9600000;  // 200 ms
+
+SWDTarget simTarget;
+
+static bool evenParity(uint32_t word)
+{
+    return __builtin_parity(word);
+}
+
+SWDTarget::SWDTarget()
+    : mClockPin(-1), mDataPin(-1),
+      mClock(false), mHostDrive(false), mHostData(false),
+      mWire(WIRE_JTAG), mBitCount(0), mOnes(0), mShift(0),
+      mHeader(0), mAck(0), mData(0),
+      mTargetDrive(false), mTargetData(false),
+      mCtrlStat(0), mSelect(0), mReadBuffer(0),
+      mWaitInterval(0), mWaitCounter(0),
+      mCSW(0), mTAR(0), mMdmControl(0), mMassEraseCycles(0),
+      mInReset(false), mFlashBusyCycles(0),
+      mCore(CORE_RUNNING), mDHCSR(0), mDCRDR(0),
+      mCyclesPerClock(24)
+{
+    memset(mFlash, 0xFF, sizeof mFlash);
+    memset(mSRAM, 0, sizeof mSRAM);
+    memset(mR, 0, sizeof mR);
+    memset(&mStats, 0, sizeof mStats);
+    systemReset();
+}
+
+void SWDTarget::attach(unsigned clockPin, unsigned dataPin)
+{
+    mClockPin = clockPin;
+    mDataPin = dataPin;
+}
+
+void SWDTarget::pinMode(unsigned pin, unsigned mode)
+{
+    if (pin == mDataPin) {
+        // INPUT and INPUT_PULLUP both release the line; the pull-up is always there.
+        mHostDrive = mode == 1;
+    }
+}
+
+void SWDTarget::digitalWrite(unsigned pin, unsigned value)
+{
+    if (pin == mDataPin) {
+        mHostData = value != 0;
+    }
+
+    if (pin == mClockPin) {
+        bool rising = value && !mClock;
+        mClock = value != 0;
+
+        if (rising) {
+            if (mHostDrive && mTargetDrive) {
+                mStats.protocolErrors++;
+            }
+            clockEdge(mHostDrive ? mHostData : (mTargetDrive ? mTargetData : true));
+            tick(mCyclesPerClock);
+        }
+    }
+}
+
+int SWDTarget::digitalRead(unsigned pin)
+{
+    if (pin != mDataPin) {
+        return 0;
+    }
+    if (mHostDrive) {
+        return mHostData;
+    }
+    return mTargetDrive ? mTargetData : 1;
+}
+
+void SWDTarget::lineReset()
+{
+    mWire = WIRE_RESET;
+    mTargetDrive = false;
+}
+
+void SWDTarget::clockEdge(bool bit)
+{
+    mStats.clocks++;
+    mOnes = bit ? mOnes + 1 : 0;
+
+    if (mWire == WIRE_JTAG) {
+        // Look for at least 48 ones followed by the 16-bit JTAG-to-SWD sequence
+        mShift = (mShift >> 1) | (uint64_t(bit) << 63);
+        if ((mShift >> 48) == 0xE79E && (mShift & 0xFFFFFFFFFFFFull) == 0xFFFFFFFFFFFFull) {
+            mWire = WIRE_LOCKOUT;
+        }
+        mStats.idleClocks++;
+        return;
+    }
+
+    if (mOnes >= 50) {
+        lineReset();
+        mStats.idleClocks++;
+        return;
+    }
+
+    switch (mWire) {
+
+        case WIRE_JTAG:
+        case WIRE_LOCKOUT:
+            mStats.idleClocks++;
+            break;
+
+        case WIRE_RESET:
+            if (!bit) {
+                mWire = WIRE_IDLE;
+            }
+            mStats.idleClocks++;
+            break;
+
+        case WIRE_IDLE:
+            if (bit) {
+                // Start bit
+                mHeader = 1;
+                mBitCount = 1;
+                mWire = WIRE_HEADER;
+            } else {
+                mStats.idleClocks++;
+            }
+            break;
+
+        case WIRE_HEADER:
+            mHeader |= uint8_t(bit) << mBitCount;
+            if (++mBitCount == 8) {
+                packetHeader();
+            }
+            break;
+
+        case WIRE_ACK_TRN:
+            mTargetDrive = true;
+            mTargetData = mAck & 1;
+            mBitCount = 0;
+            mWire = WIRE_ACK;
+            break;
+
+        case WIRE_ACK:
+            if (++mBitCount < 3) {
+                mTargetData = (mAck >> mBitCount) & 1;
+            } else if (mAck == ACK_OK && (mHeader & 4)) {
+                mBitCount = 0;
+                mTargetData = mData & 1;
+                mWire = WIRE_READ_DATA;
+            } else {
+                mTargetDrive = false;
+                mWire = mAck == ACK_OK ? WIRE_WRITE_TRN : WIRE_READ_TRN;
+            }
+            break;
+
+        case WIRE_READ_DATA:
+            if (++mBitCount < 32) {
+                mTargetData = (mData >> mBitCount) & 1;
+            } else if (mBitCount == 32) {
+                mTargetData = evenParity(mData);
+            } else {
+                mTargetDrive = false;
+                mWire = WIRE_READ_TRN;
+            }
+            break;
+
+        case WIRE_READ_TRN:
+            mWire = WIRE_IDLE;
+            break;
+
+        case WIRE_WRITE_TRN:
+            mBitCount = 0;
+            mData = 0;
+            mWire = WIRE_WRITE_DATA;
+            break;
+
+        case WIRE_WRITE_DATA:
+            if (mBitCount < 32) {
+                mData |= uint32_t(bit) << mBitCount++;
+            } else {
+                if (bit != evenParity(mData)) {
+                    mCtrlStat |= CS_WDATAERR;
+                    mStats.protocolErrors++;
+                } else {
+                    packetComplete();
+                }
+                mWire = WIRE_IDLE;
+            }
+            break;
+    }
+}
+
+void SWDTarget::packetHeader()
+{
+    bool APnDP = (mHeader >> 1) & 1;
+    bool RnW = (mHeader >> 2) & 1;
+    bool a2 = (mHeader >> 3) & 1;
+    bool a3 = (mHeader >> 4) & 1;
+    bool parity = (mHeader >> 5) & 1;
+    unsigned addr = (mHeader >> 1) & 0xC;
+
+    if (parity != (APnDP ^ RnW ^ a2 ^ a3) || (mHeader & 0x40) || !(mHeader & 0x80)) {
+        // Not a valid request. Don't drive the line until we see a line reset.
+        mStats.protocolErrors++;
+        mWire = WIRE_LOCKOUT;
+        return;
+    }
+
+    mAck = ACK_OK;
+    if (APnDP) {
+        if (mCtrlStat & CS_STICKY) {
+            mAck = ACK_FAULT;
+        } else if (mWaitInterval && ++mWaitCounter >= mWaitInterval) {
+            mWaitCounter = 0;
+            mAck = ACK_WAIT;
+        }
+    }
+
+    if (mAck == ACK_WAIT) {
+        mStats.waits++;
+    } else if (mAck == ACK_FAULT) {
+        mStats.faults++;
+    } else if (APnDP) {
+        if (RnW) mStats.apReads++; else mStats.apWrites++;
+    } else {
+        if (RnW) mStats.dpReads++; else mStats.dpWrites++;
+    }
+
+    if (mAck == ACK_OK && RnW) {
+        mData = 0;
+        dpAccess(APnDP, true, addr, mData);
+    }
+
+    mWire = WIRE_ACK_TRN;
+}
+
+void SWDTarget::packetComplete()
+{
+    // Data phase of a write finished
+    dpAccess((mHeader >> 1) & 1, false, (mHeader >> 1) & 0xC, mData);
+}
+
+unsigned SWDTarget::dpAccess(bool APnDP, bool RnW, unsigned addr, uint32_t &data)
+{
+    if (APnDP) {
+        return apAccess(RnW, (mSelect & 0xF0) | addr, data);
+    }
+
+    switch (addr) {
+
+        case 0x0:
+            if (RnW) {
+                data = DP_IDCODE;
+            } else {
+                // ABORT
+                if (data & (1 << 1)) mCtrlStat &= ~CS_STICKYCMP;
+                if (data & (1 << 2)) mCtrlStat &= ~CS_STICKYERR;
+                if (data & (1 << 3)) mCtrlStat &= ~CS_WDATAERR;
+                if (data & (1 << 4)) mCtrlStat &= ~CS_STICKYORUN;
+            }
+            break;
+
+        case 0x4:
+            if (RnW) {
+                // Power-up and reset requests are acknowledged immediately
+                data = mCtrlStat;
+                if (mCtrlStat & (1 << 30)) data |= 1 << 31;
+                if (mCtrlStat & (1 << 28)) data |= 1 << 29;
+                if (mCtrlStat & (1 << 26)) data |= 1 << 27;
+            } else {
+                mCtrlStat = (mCtrlStat & CS_STICKY) | (data & 0x54FFFF00);
+            }
+            break;
+
+        case 0x8:
+            if (RnW) {
+                data = mSelect;
+            } else {
+                mSelect = data;
+            }
+            break;
+
+        case 0xC:
+            if (RnW) {
+                data = mReadBuffer;
+            }
+            break;
+    }
+
+    return ACK_OK;
+}
+
+unsigned SWDTarget::apAccess(bool RnW, unsigned addr, uint32_t &data)
+{
+    unsigned apsel = mSelect >> 24;
+    uint32_t value = RnW ? 0 : data;
+
+    if (apsel == 0) {
+        ahbAccess(RnW, addr, value);
+    } else if (apsel == 1) {
+        mdmAccess(RnW, addr, value);
+    }
+
+    if (RnW) {
+        // AP reads are posted: return the previous result, buffer this one.
+        data = mReadBuffer;
+        mReadBuffer = value;
+    }
+
+    return ACK_OK;
+}
+
+void SWDTarget::ahbAccess(bool RnW, unsigned addr, uint32_t &data)
+{
+    switch (addr) {
+
+        case 0x00:
+            if (RnW) {
+                // DeviceEn always set, transfer never in progress
+                data = mCSW | (1 << 6);
+            } else {
+                mCSW = data & ~((1 << 6) | (1 << 7));
+            }
+            break;
+
+        case 0x04:
+            if (RnW) {
+                data = mTAR;
+            } else {
+                mTAR = data;
+            }
+            break;
+
+        case 0x0C: {
+            bool ok;
+            if (RnW) {
+                ok = busRead(mTAR, data);
+                mStats.busReads++;
+            } else {
+                ok = busWrite(mTAR, data);
+                mStats.busWrites++;
+            }
+            if (!ok) {
+                mCtrlStat |= CS_STICKYERR;
+            }
+
+            // Single auto-increment, wrapping within a 1 kB block
+            if ((mCSW & 0x30) == 0x10) {
+                mTAR = (mTAR & ~0x3FF) | ((mTAR + 4) & 0x3FF);
+            }
+            break;
+        }
+
+        case 0xFC:
+            if (RnW) {
+                data = AHB_AP_IDR;
+            }
+            break;
+    }
+}
+
+void SWDTarget::mdmAccess(bool RnW, unsigned addr, uint32_t &data)
+{
+    switch (addr) {
+
+        case 0x00:
+            if (RnW) {
+                data = REG_MDM_STATUS_MASS_ERASE_ENABLE;
+                if (!mInReset) {
+                    data |= REG_MDM_STATUS_SYS_NRESET | REG_MDM_STATUS_FLASH_READY;
+                }
+                if (mMdmControl & (1 << 31)) {
+                    // Internal flag: erase has been acknowledged since the last reset
+                    data |= REG_MDM_STATUS_FLASH_ERASE_ACK;
+                }
+                if (mCore == CORE_HALTED) {
+                    data |= REG_MDM_STATUS_CORE_HALTED;
+                }
+            }
+            break;
+
+        case 0x04:
+            if (RnW) {
+                data = mMdmControl & 0xFF;
+                if (mMassEraseCycles) {
+                    data |= REG_MDM_CONTROL_MASS_ERASE;
+                }
+                break;
+            }
+
+            if ((data & REG_MDM_CONTROL_MASS_ERASE) && !mMassEraseCycles) {
+                mMassEraseCycles = MASS_ERASE_CYCLES;
+                mMdmControl |= 1 << 31;
+            }
+
+            if (data & REG_MDM_CONTROL_SYS_RESET_REQ) {
+                mInReset = true;
+            } else if (mInReset) {
+                mInReset = false;
+                systemReset();
+            }
+
+            mMdmControl = (mMdmControl & (1 << 31)) | (data & 0xFE);
+            break;
+
+        case 0xFC:
+            if (RnW) {
+                data = MDM_AP_IDR;
+            }
+            break;
+    }
+}
+
+void SWDTarget::systemReset()
+{
+    // Peripherals back to defaults. Debug logic (DP, APs, DHCSR) is not affected.
+    mRegs.clear();
+    memset(mFTFL, 0, sizeof mFTFL);
+    mFTFL[0] = REG_FTFL_FSTAT_CCIF;
+    mFTFL[2] = 0xFE;
+    memset(mFTFL + 0x10, 0xFF, 4);
+    mFlashBusyCycles = 0;
+    mMdmControl &= ~(1u << 31);
+
+    mR[13] = mFlash[0];
+    mR[15] = mFlash[1] & ~1;
+    mR[16] = 0x01000000;
+    mCore = (mDHCSR & 3) == 3 ? CORE_HALTED : CORE_RUNNING;
+}
+
+void SWDTarget::tick(unsigned cycles)
+{
+    mStats.cpuCycles += cycles;
+
+    if (mMassEraseCycles) {
+        if (mMassEraseCycles > cycles) {
+            mMassEraseCycles -= cycles;
+        } else {
+            mMassEraseCycles = 0;
+            memset(mFlash, 0xFF, sizeof mFlash);
+        }
+    }
+
+    while (cycles--) {
+        if (mCore == CORE_RUNNING_SRAM && !mInReset) {
+            cpuStep();
+        }
+        if (mFlashBusyCycles && !--mFlashBusyCycles) {
+            mFTFL[0] |= REG_FTFL_FSTAT_CCIF;
+        }
+    }
+}
+
+bool SWDTarget::busRead(uint32_t addr, uint32_t &data, unsigned size)
+{
+    uint32_t word;
+    unsigned shift = (addr & 3) * 8;
+
+    if (mInReset) {
+        return false;
+    }
+
+    if (addr < FLASH_SIZE) {
+        word = mFlash[addr >> 2];
+
+    } else if (addr >= SRAM_BASE && addr < SRAM_BASE + SRAM_SIZE) {
+        word = mSRAM[(addr - SRAM_BASE) >> 2];
+
+    } else if (addr >= REG_FTFL_FSTAT && addr < REG_FTFL_FSTAT + sizeof mFTFL) {
+        unsigned offset = addr - REG_FTFL_FSTAT;
+        word = 0;
+        for (unsigned i = 0; i < size; i++) {
+            word |= uint32_t(mFTFL[offset + i]) << (8 * i);
+        }
+        data = word;
+        return true;
+
+    } else if (addr == REG_SCB_DHCSR) {
+        word = mDHCSR | (1 << 16);
+        if (mCore == CORE_HALTED) word |= 1 << 17;
+        if (mCore == CORE_LOCKUP) word |= 1 << 19;
+
+    } else if (addr == REG_SCB_DCRDR) {
+        word = mDCRDR;
+
+    } else if ((addr >= 0x40000000 && addr < 0x40100000) || (addr >= 0xE0000000 && addr < 0xE0100000)) {
+        word = mRegs[addr & ~3];
+
+    } else {
+        return false;
+    }
+
+    data = size == 4 ? word : (word >> shift) & 0xFF;
+    return true;
+}
+
+bool SWDTarget::busWrite(uint32_t addr, uint32_t data, unsigned size)
+{
+    uint32_t mask = size == 4 ? 0xFFFFFFFF : 0xFF << ((addr & 3) * 8);
+    uint32_t value = size == 4 ? data : (data & 0xFF) << ((addr & 3) * 8);
+
+    if (mInReset || addr < FLASH_SIZE) {
+        // Flash can only be written through the FTFL
+        return false;
+
+    } else if (addr >= SRAM_BASE && addr < SRAM_BASE + SRAM_SIZE) {
+        uint32_t &word = mSRAM[(addr - SRAM_BASE) >> 2];
+        word = (word & ~mask) | value;
+
+    } else if (addr >= REG_FTFL_FSTAT && addr < REG_FTFL_FSTAT + sizeof mFTFL) {
+        // Byte registers. A word write covers four of them, FSTAT last.
+        unsigned offset = addr - REG_FTFL_FSTAT;
+        for (int i = size - 1; i >= 0; i--) {
+            ftflWrite(offset + i, data >> (8 * i));
+        }
+
+    } else if (addr >= 0xE000EDF0 && addr < 0xE000EE00) {
+        scbWrite(addr, data);
+
+    } else if ((addr >= 0x40000000 && addr < 0x40100000) || (addr >= 0xE0000000 && addr < 0xE0100000)) {
+        uint32_t &word = mRegs[addr & ~3];
+        word = (word & ~mask) | value;
+
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+void SWDTarget::ftflWrite(unsigned offset, uint8_t value)
+{
+    if (offset == 0) {
+        // FSTAT: error flags are write-1-to-clear, writing CCIF launches a command
+        mFTFL[0] &= ~(value & (REG_FTFL_FSTAT_RDCOLERR | REG_FTFL_FSTAT_ACCERR | REG_FTFL_FSTAT_FPVIOL));
+        if ((value & REG_FTFL_FSTAT_CCIF) && (mFTFL[0] & REG_FTFL_FSTAT_CCIF)) {
+            ftflLaunch();
+        }
+    } else if (offset >= 4 && offset < 0x10 && (mFTFL[0] & REG_FTFL_FSTAT_CCIF)) {
+        // FCCOB is only writable while no command is running
+        mFTFL[offset] = value;
+    }
+}
+
+void SWDTarget::ftflLaunch()
+{
+    if (mFTFL[0] & (REG_FTFL_FSTAT_ACCERR | REG_FTFL_FSTAT_FPVIOL)) {
+        // Can't launch until the previous error is cleared
+        return;
+    }
+
+    mFTFL[0] &= ~REG_FTFL_FSTAT_MGSTAT0;
+    uint8_t cmd = mFTFL[7];
+    uint32_t addr = (mFTFL[6] << 16) | (mFTFL[5] << 8) | mFTFL[4];
+
+    switch (cmd) {
+
+        case 0x06: {
+            // Program Longword. FCCOB4-7 hold the data, most significant byte first.
+            if ((addr & 3) || addr >= FLASH_SIZE) {
+                mFTFL[0] |= REG_FTFL_FSTAT_ACCERR;
+                return;
+            }
+            uint32_t data = mFTFL[8] | (mFTFL[9] << 8) | (mFTFL[10] << 16) | (mFTFL[11] << 24);
+            uint32_t &word = mFlash[addr >> 2];
+            if ((word & data) != data) {
+                // Can't program a 0 back to 1 without erasing
+                mFTFL[0] |= REG_FTFL_FSTAT_MGSTAT0;
+            }
+            word &= data;
+            mStats.flashWords++;
+            mFlashBusyCycles = PGM4_CYCLES;
+            break;
+        }
+
+        case 0x09: {
+            // Erase Flash Sector (1 kB)
+            if ((addr & 0x3FF) || addr >= FLASH_SIZE) {
+                mFTFL[0] |= REG_FTFL_FSTAT_ACCERR;
+                return;
+            }
+            memset(&mFlash[addr >> 2], 0xFF, 0x400);
+            mFlashBusyCycles = ERSSCR_CYCLES;
+            break;
+        }
+
+        default:
+            mFTFL[0] |= REG_FTFL_FSTAT_ACCERR;
+            return;
+    }
+
+    mFTFL[0] &= ~REG_FTFL_FSTAT_CCIF;
+}
+
+void SWDTarget::scbWrite(uint32_t addr, uint32_t data)
+{
+    switch (addr) {
+
+        case REG_SCB_DHCSR:
+            if ((data >> 16) != 0xA05F) {
+                // Writes without the debug key are ignored
+                break;
+            }
+            mDHCSR = data & 0xF;
+            if ((mDHCSR & 3) == 3) {
+                cpuHalt(CORE_HALTED);
+            } else if ((mDHCSR & 1) && mCore == CORE_HALTED) {
+                bool inSRAM = mR[15] >= SRAM_BASE && mR[15] < SRAM_BASE + SRAM_SIZE;
+                mCore = inSRAM ? CORE_RUNNING_SRAM : CORE_RUNNING;
+            }
+            break;
+
+        case REG_SCB_DCRSR:
+            if (mCore == CORE_HALTED && (data & 0x1F) <= 16) {
+                if (data & (1 << 16)) {
+                    mR[data & 0x1F] = mDCRDR;
+                } else {
+                    mDCRDR = mR[data & 0x1F];
+                }
+            }
+            break;
+
+        case REG_SCB_DCRDR:
+            mDCRDR = data;
+            break;
+
+        default:
+            mRegs[addr] = data;
+            break;
+    }
+}
+
+void SWDTarget::cpuHalt(CoreState state)
+{
+    mCore = state;
+}
+
+void SWDTarget::setNZ(uint32_t result)
+{
+    mR[16] = (mR[16] & 0x3FFFFFFF) | (result & 0x80000000) | (result ? 0 : 0x40000000);
+}
+
+uint32_t SWDTarget::addWithCarry(uint32_t a, uint32_t b, bool carry)
+{
+    uint64_t unsignedSum = uint64_t(a) + b + carry;
+    int64_t signedSum = int64_t(int32_t(a)) + int32_t(b) + carry;
+    uint32_t result = uint32_t(unsignedSum);
+
+    setNZ(result);
+    mR[16] &= ~0x30000000;
+    if (unsignedSum >> 32) mR[16] |= 0x20000000;
+    if (signedSum != int32_t(result)) mR[16] |= 0x10000000;
+    return result;
+}
+
+void SWDTarget::cpuStep()
+{
+    /*
+     * Execute one 16-bit Thumb instruction. Only the subset used by the
+     * jig's RAM loaders is implemented; anything else locks up the core,
+     * which the jig sees in DHCSR.
+     */
+
+    uint32_t pc = mR[15];
+    uint32_t insn;
+
+    if (!busRead(pc & ~3, insn)) {
+        cpuHalt(CORE_LOCKUP);
+        return;
+    }
+    insn = (pc & 2) ? insn >> 16 : insn & 0xFFFF;
+    mR[15] = pc + 2;
+
+    unsigned rd = insn & 7;
+    unsigned rn = (insn >> 3) & 7;
+    unsigned rm = (insn >> 6) & 7;
+    unsigned imm5 = (insn >> 6) & 0x1F;
+    unsigned imm8 = insn & 0xFF;
+    unsigned rdHigh = (insn >> 8) & 7;
+    uint32_t value;
+    bool n = mR[16] >> 31, z = (mR[16] >> 30) & 1, c = (mR[16] >> 29) & 1, v = (mR[16] >> 28) & 1;
+
+    if ((insn & 0xF800) == 0x0000) {
+        // LSLS Rd, Rm, #imm5 (MOVS Rd, Rm when imm5 is zero)
+        value = mR[rn] << imm5;
+        if (imm5) {
+            mR[16] = (mR[16] & ~0x20000000) | (((mR[rn] >> (32 - imm5)) & 1) << 29);
+        }
+        mR[rd] = value;
+        setNZ(value);
+
+    } else if ((insn & 0xFE00) == 0x1A00) {
+        mR[rd] = addWithCarry(mR[rn], ~mR[rm], true);           // SUBS Rd, Rn, Rm
+
+    } else if ((insn & 0xF800) == 0x2000) {
+        mR[rdHigh] = imm8;                                      // MOVS Rd, #imm8
+        setNZ(imm8);
+
+    } else if ((insn & 0xF800) == 0x2800) {
+        addWithCarry(mR[rdHigh], ~imm8, true);                  // CMP Rn, #imm8
+
+    } else if ((insn & 0xF800) == 0x3000) {
+        mR[rdHigh] = addWithCarry(mR[rdHigh], imm8, false);     // ADDS Rd, #imm8
+
+    } else if ((insn & 0xF800) == 0x3800) {
+        mR[rdHigh] = addWithCarry(mR[rdHigh], ~imm8, true);     // SUBS Rd, #imm8
+
+    } else if ((insn & 0xFFC0) == 0x4200) {
+        setNZ(mR[rd] & mR[rn]);                                 // TST Rn, Rm
+
+    } else if ((insn & 0xFFC0) == 0x4300) {
+        mR[rd] |= mR[rn];                                       // ORRS Rd, Rm
+        setNZ(mR[rd]);
+
+    } else if ((insn & 0xF800) == 0x4800) {
+        // LDR Rt, [PC, #imm8*4]
+        if (!busRead(((pc + 4) & ~3) + imm8 * 4, mR[rdHigh])) {
+            cpuHalt(CORE_LOCKUP);
+        }
+
+    } else if ((insn & 0xE000) == 0x6000) {
+        // LDR/STR/LDRB/STRB Rt, [Rn, #imm5]
+        bool byte = insn & 0x1000;
+        bool load = insn & 0x0800;
+        uint32_t addr = mR[rn] + (byte ? imm5 : imm5 * 4);
+        bool ok = load ? busRead(addr, mR[rd], byte ? 1 : 4)
+                       : busWrite(addr, mR[rd], byte ? 1 : 4);
+        if (!ok) {
+            cpuHalt(CORE_LOCKUP);
+        }
+
+    } else if ((insn & 0xFF00) == 0xBE00) {
+        // BKPT halts into debug state if the debugger is attached
+        mR[15] = pc;
+        cpuHalt((mDHCSR & 1) ? CORE_HALTED : CORE_LOCKUP);
+
+    } else if (insn == 0xBF00) {
+        // NOP
+
+    } else if ((insn & 0xF000) == 0xD000 && (insn & 0x0F00) < 0x0E00) {
+        // B<cond>
+        bool taken;
+        switch ((insn >> 8) & 0xF) {
+            case 0x0: taken = z; break;
+            case 0x1: taken = !z; break;
+            case 0x2: taken = c; break;
+            case 0x3: taken = !c; break;
+            case 0x4: taken = n; break;
+            case 0x5: taken = !n; break;
+            case 0x6: taken = v; break;
+            case 0x7: taken = !v; break;
+            case 0x8: taken = c && !z; break;
+            case 0x9: taken = !c || z; break;
+            case 0xA: taken = n == v; break;
+            case 0xB: taken = n != v; break;
+            case 0xC: taken = !z && n == v; break;
+            default:  taken = z || n != v; break;
+        }
+        if (taken) {
+            mR[15] = pc + 4 + (int32_t(int8_t(imm8)) << 1);
+        }
+
+    } else if ((insn & 0xF800) == 0xE000) {
+        // B
+        int32_t offset = int32_t(insn << 21) >> 20;
+        mR[15] = pc + 4 + offset;
+
+    } else {
+        fprintf(stderr, "SWDTarget: Unimplemented instruction %04x at %08x\n", insn, pc);
+        mR[15] = pc;
+        cpuHalt(CORE_LOCKUP);
+    }
+}
@@ -0,0 +1,161 @@
+/*
+ * Simulated Freescale Kinetis target, seen through its SWD port.
+ *
+ * Copyright (c) 2013 Micah Elizabeth Scott
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+#include <stdint.h>
+#include <map>
+
+
+class SWDTarget
+{
+public:
+    SWDTarget();
+
+    // Which host pins are wired to SWCLK and SWDIO
+    void attach(unsigned clockPin, unsigned dataPin);
+
+    // Pin-level interface, called by the Arduino shim
+    void pinMode(unsigned pin, unsigned mode);
+    void digitalWrite(unsigned pin, unsigned value);
+    int digitalRead(unsigned pin);
+
+    // Wire and bus activity counters
+    struct Stats {
+        uint64_t clocks;            // SWCLK rising edges
+        uint64_t idleClocks;        // Edges outside of any packet
+        uint64_t dpReads, dpWrites;
+        uint64_t apReads, apWrites;
+        uint64_t waits, faults;
+        uint64_t protocolErrors;    // Bad headers, parity errors, or bus contention
+        uint64_t busReads, busWrites;
+        uint64_t cpuCycles;
+        uint64_t flashWords;        // Longwords programmed by the FTFL
+    };
+
+    const Stats &stats() const { return mStats; }
+
+    // Respond WAIT to every Nth AP access, to exercise retry paths. Zero disables.
+    void setWaitInterval(unsigned n) { mWaitInterval = n; }
+
+    // Target CPU cycles that elapse per SWD clock
+    void setCyclesPerClock(unsigned n) { mCyclesPerClock = n; }
+
+    // Direct access to flash, for checking results
+    uint32_t flashWord(uint32_t addr) const { return mFlash[(addr & (FLASH_SIZE - 1)) >> 2]; }
+
+    static const uint32_t FLASH_SIZE = 128 * 1024;
+    static const uint32_t SRAM_BASE = 0x1FFFE000;
+    static const uint32_t SRAM_SIZE = 16 * 1024;
+
+private:
+    enum WireState {
+        WIRE_JTAG,          // Waiting for the JTAG-to-SWD sequence
+        WIRE_RESET,         // Line reset, waiting for idle
+        WIRE_IDLE,
+        WIRE_HEADER,
+        WIRE_ACK_TRN,
+        WIRE_ACK,
+        WIRE_READ_DATA,
+        WIRE_READ_TRN,
+        WIRE_WRITE_TRN,
+        WIRE_WRITE_DATA,
+        WIRE_LOCKOUT        // Protocol error, ignoring everything until line reset
+    };
+
+    enum CoreState {
+        CORE_RUNNING,       // Running code we don't model (flash firmware)
+        CORE_RUNNING_SRAM,  // Running our instruction-level model
+        CORE_HALTED,
+        CORE_LOCKUP
+    };
+
+    // Pins
+    unsigned mClockPin, mDataPin;
+    bool mClock, mHostDrive, mHostData;
+
+    // Wire protocol
+    WireState mWire;
+    unsigned mBitCount;
+    unsigned mOnes;
+    uint64_t mShift;
+    uint8_t mHeader;
+    unsigned mAck;
+    uint32_t mData;
+    bool mTargetDrive, mTargetData;
+
+    // Debug port
+    uint32_t mCtrlStat;
+    uint32_t mSelect;
+    uint32_t mReadBuffer;
+    unsigned mWaitInterval, mWaitCounter;
+
+    // AHB-AP and MDM-AP
+    uint32_t mCSW;
+    uint32_t mTAR;
+    uint32_t mMdmControl;
+    uint64_t mMassEraseCycles;
+    bool mInReset;
+
+    // Memory and peripherals
+    uint32_t mFlash[FLASH_SIZE / 4];
+    uint32_t mSRAM[SRAM_SIZE / 4];
+    std::map<uint32_t, uint32_t> mRegs;
+    uint8_t mFTFL[0x18];
+    uint64_t mFlashBusyCycles;
+
+    // Core
+    CoreState mCore;
+    uint32_t mR[17];            // r0-r15, xPSR
+    uint32_t mDHCSR;
+    uint32_t mDCRDR;
+    unsigned mCyclesPerClock;
+
+    Stats mStats;
+
+    void clockEdge(bool hostBit);
+    void packetHeader();
+    void packetComplete();
+    void lineReset();
+
+    unsigned dpAccess(bool APnDP, bool RnW, unsigned addr, uint32_t &data);
+    unsigned apAccess(bool RnW, unsigned addr, uint32_t &data);
+    void ahbAccess(bool RnW, unsigned addr, uint32_t &data);
+    void mdmAccess(bool RnW, unsigned addr, uint32_t &data);
+
+    void systemReset();
+    void tick(unsigned cycles);
+
+    bool busRead(uint32_t addr, uint32_t &data, unsigned size = 4);
+    bool busWrite(uint32_t addr, uint32_t data, unsigned size = 4);
+    void ftflWrite(unsigned offset, uint8_t value);
+    void ftflLaunch();
+    void scbWrite(uint32_t addr, uint32_t data);
+
+    void cpuStep();
+    void cpuHalt(CoreState state);
+    void setNZ(uint32_t result);
+    uint32_t addWithCarry(uint32_t a, uint32_t b, bool carry);
+};
+
+// The target wired to the Arduino shim's pins
+extern SWDTarget simTarget;